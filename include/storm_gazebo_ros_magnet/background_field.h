@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_BACKGROUND_FIELD_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_BACKGROUND_FIELD_H_
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/thread/mutex.hpp>
+
+#include "storm_gazebo_ros_magnet/dipole_magnet_container.h"
+
+namespace gazebo {
+
+/// \brief Uniform field plus a constant gradient, optionally oscillating.
+///
+///   B(p, t) = B_0 + G_0 (p - origin) + s(t) (B_1 + G_1 (p - origin))
+///
+/// with s(t) = sin(2 pi f t + phase). The commanded values may be changed from
+/// any thread, they take effect at the start of the next step.
+class BackgroundField : public DipoleMagnetContainer::FieldSource {
+ public:
+  BackgroundField() : frequency(0), phase(0), scale(0) {
+  }
+
+  /// \brief Set the static part of the field
+  void SetField(const ignition::math::Vector3d& _field) {
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->cmd.field = _field;
+  }
+
+  /// \brief Set the static part of the gradient, gradient(i, j) = dB_i/dx_j
+  void SetGradient(const ignition::math::Matrix3d& _gradient) {
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->cmd.gradient = _gradient;
+  }
+
+  /// \brief Whether a gradient is that of a field without sources or
+  /// currents, i.e. symmetric (curl free) and traceless (divergence free).
+  /// Other gradients give forces that do no conservative work.
+  /// \param[in] gradient Gradient, gradient(i, j) = dB_i/dx_j
+  /// \param[in] tolerance Largest deviation, relative to the largest entry
+  static bool IsSourceFree(const ignition::math::Matrix3d& gradient,
+      double tolerance = 1e-6) {
+    double scale = 0;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j)
+        scale = std::max(scale, std::abs(gradient(i, j)));
+    }
+    double limit = tolerance*scale;
+    if (std::abs(gradient(0, 0) + gradient(1, 1) + gradient(2, 2)) > limit)
+      return false;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = i + 1; j < 3; ++j) {
+        if (std::abs(gradient(i, j) - gradient(j, i)) > limit)
+          return false;
+      }
+    }
+    return true;
+  }
+
+  /// \brief Set the point about which the gradient is applied
+  void SetOrigin(const ignition::math::Vector3d& _origin) {
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->cmd.origin = _origin;
+  }
+
+  /// \brief Set the oscillating part of the field and gradient
+  /// \param[in] _field Amplitude of the oscillating field
+  /// \param[in] _gradient Amplitude of the oscillating gradient
+  /// \param[in] _frequency Frequency in Hz
+  /// \param[in] _phase Phase in radians
+  void SetOscillation(const ignition::math::Vector3d& _field,
+      const ignition::math::Matrix3d& _gradient, double _frequency, double _phase) {
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->cmd.field_amplitude = _field;
+    this->cmd.gradient_amplitude = _gradient;
+    this->frequency = _frequency;
+    this->phase = _phase;
+  }
+
+  void Update(const common::Time& time) {
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->active = this->cmd;
+    this->scale = 0;
+    if (this->frequency > 0)
+      this->scale = std::sin(2*M_PI*this->frequency*time.Double() + this->phase);
+  }
+
+  std::shared_ptr<const void> SaveState() const {
+    boost::mutex::scoped_lock lock(this->mutex);
+    std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+    snapshot->cmd = this->cmd;
+    snapshot->active = this->active;
+    snapshot->frequency = this->frequency;
+    snapshot->phase = this->phase;
+    snapshot->scale = this->scale;
+    return snapshot;
+  }
+
+  void RestoreState(const std::shared_ptr<const void>& state) {
+    if (!state)
+      return;
+    const Snapshot& snapshot = *static_cast<const Snapshot*>(state.get());
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->cmd = snapshot.cmd;
+    this->active = snapshot.active;
+    this->frequency = snapshot.frequency;
+    this->phase = snapshot.phase;
+    this->scale = snapshot.scale;
+  }
+
+  void GetField(const ignition::math::Vector3d& p,
+      ignition::math::Vector3d& field,
+      ignition::math::Matrix3d& gradient) const {
+    gradient = this->active.gradient + this->active.gradient_amplitude*this->scale;
+    field = this->active.field + this->active.field_amplitude*this->scale +
+        gradient*(p - this->active.origin);
+  }
+
+ private:
+  struct State {
+    State() : gradient(ignition::math::Matrix3d::Zero),
+        gradient_amplitude(ignition::math::Matrix3d::Zero) {
+    }
+    ignition::math::Vector3d field;
+    ignition::math::Matrix3d gradient;
+    ignition::math::Vector3d origin;
+    ignition::math::Vector3d field_amplitude;
+    ignition::math::Matrix3d gradient_amplitude;
+  };
+
+  struct Snapshot {
+    State cmd;
+    State active;
+    double frequency;
+    double phase;
+    double scale;
+  };
+
+  mutable boost::mutex mutex;
+  /// \brief Values set by the user
+  State cmd;
+  /// \brief Values used during the current step
+  State active;
+  double frequency;
+  double phase;
+  double scale;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_BACKGROUND_FIELD_H_
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_BATCH_EVALUATION_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_BATCH_EVALUATION_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <ignition/math/Quaternion.hh>
+#include <ignition/math/Vector3.hh>
+
+#include "storm_gazebo_ros_magnet/interaction_kernel.h"
+#include "storm_gazebo_ros_magnet/task_pool.h"
+
+namespace gazebo {
+
+/// \brief Magnets stored as row-major arrays of doubles, as handed over by
+/// NumPy or any other caller, without copying
+struct MagnetArrays {
+  MagnetArrays() : positions(NULL), moments(NULL), orientations(NULL), size(0) {
+  }
+
+  /// \brief (size, 3) world positions
+  const double* positions;
+  /// \brief (size, 3) moments, in the world frame unless orientations is set.
+  /// NULL for zero moments, e.g. for field probes.
+  const double* moments;
+  /// \brief (size, 4) unit quaternions w, x, y, z rotating the moments into
+  /// the world frame, or NULL
+  const double* orientations;
+  size_t size;
+
+  ignition::math::Vector3d Position(size_t i) const {
+    const double* p = this->positions + 3*i;
+    return ignition::math::Vector3d(p[0], p[1], p[2]);
+  }
+
+  ignition::math::Vector3d Moment(size_t i) const {
+    if (!this->moments)
+      return ignition::math::Vector3d::Zero;
+    const double* m = this->moments + 3*i;
+    ignition::math::Vector3d moment(m[0], m[1], m[2]);
+    if (!this->orientations)
+      return moment;
+    const double* q = this->orientations + 4*i;
+    return ignition::math::Quaterniond(q[0], q[1], q[2], q[3]).RotateVector(moment);
+  }
+};
+
+/// \brief Row-major output arrays. Outputs left NULL are not computed.
+struct InteractionArrays {
+  InteractionArrays() : force(NULL), torque(NULL), field(NULL), gradient(NULL),
+      energy(NULL) {
+  }
+
+  /// \brief (size, 3)
+  double* force;
+  /// \brief (size, 3)
+  double* torque;
+  /// \brief (size, 3)
+  double* field;
+  /// \brief (size, 3, 3) with gradient[i][a][b] = dB_a/dx_b
+  double* gradient;
+  /// \brief (size)
+  double* energy;
+
+  /// \brief InteractionOutput flags of the outputs that are set
+  unsigned Outputs() const {
+    return (this->force ? OUTPUT_FORCE : 0) | (this->torque ? OUTPUT_TORQUE : 0) |
+        (this->field ? OUTPUT_FIELD : 0) | (this->gradient ? OUTPUT_GRADIENT : 0) |
+        (this->energy ? OUTPUT_ENERGY : 0);
+  }
+};
+
+/// \brief Batch evaluation of interaction kernels over many magnets.
+///
+/// The model and the requested outputs are dispatched once per call to a
+/// fully specialized kernel. Rows are split into chunks that run on a task
+/// pool, each writing its own rows, so the results do not depend on the
+/// number of threads.
+class BatchEvaluator {
+ public:
+  /// \param[in] pool Pool to run on, or NULL to run on the calling thread
+  explicit BatchEvaluator(TaskPool* _pool = NULL) : pool(_pool) {
+  }
+
+  /// \brief Interaction of source i on target i for every row i
+  template <class Model>
+  void Pairs(const Model& model, const MagnetArrays& targets,
+      const MagnetArrays& sources, const InteractionArrays& out) const {
+    Dispatch<Model, 0>::Run(*this, model, out.Outputs(), targets, sources, out, true);
+  }
+
+  /// \brief Sum of the interactions of all sources on each target. Sources
+  /// at the position of a target are skipped.
+  template <class Model>
+  void Targets(const Model& model, const MagnetArrays& targets,
+      const MagnetArrays& sources, const InteractionArrays& out) const {
+    Dispatch<Model, 0>::Run(*this, model, out.Outputs(), targets, sources, out, false);
+  }
+
+ private:
+  /// \brief Walks the output combinations at compile time to the one
+  /// requested at run time
+  template <class Model, unsigned Outputs>
+  struct Dispatch {
+    static void Run(const BatchEvaluator& batch, const Model& model, unsigned outputs,
+        const MagnetArrays& targets, const MagnetArrays& sources,
+        const InteractionArrays& out, bool pairs) {
+      if (outputs == Outputs) {
+        batch.Evaluate(InteractionKernel<Model, Outputs>(model), targets, sources, out, pairs);
+      } else {
+        Dispatch<Model, Outputs + 1>::Run(batch, model, outputs, targets, sources, out, pairs);
+      }
+    }
+  };
+
+  template <class Model>
+  struct Dispatch<Model, 32> {
+    static void Run(const BatchEvaluator&, const Model&, unsigned,
+        const MagnetArrays&, const MagnetArrays&, const InteractionArrays&, bool) {
+    }
+  };
+
+  template <class Kernel>
+  void Evaluate(const Kernel& kernel, const MagnetArrays& targets,
+      const MagnetArrays& sources, const InteractionArrays& out, bool pairs) const {
+    const size_t n = targets.size;
+    if (n == 0 || Kernel::outputs == 0)
+      return;
+
+    // A few chunks per thread balance uneven rows
+    const size_t threads = this->pool ? this->pool->GetThreadCount() : 1;
+    const size_t chunk = std::max<size_t>(64, (n + 4*threads - 1)/(4*threads));
+    std::vector<TaskPool::Task> tasks;
+    for (size_t begin = 0; begin < n; begin += chunk) {
+      const size_t end = std::min(begin + chunk, n);
+      if (pairs) {
+        tasks.push_back([&kernel, &targets, &sources, &out, begin, end]() {
+          PairRows(kernel, targets, sources, out, begin, end);
+        });
+      } else {
+        tasks.push_back([&kernel, &targets, &sources, &out, begin, end]() {
+          TargetRows(kernel, targets, sources, out, begin, end);
+        });
+      }
+    }
+    if (this->pool) {
+      this->pool->Run(tasks);
+    } else {
+      for (size_t t = 0; t < tasks.size(); ++t)
+        tasks[t]();
+    }
+  }
+
+  template <class Kernel>
+  static void PairRows(const Kernel& kernel, const MagnetArrays& targets,
+      const MagnetArrays& sources, const InteractionArrays& out,
+      size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      Interaction result;
+      kernel(targets.Position(i), targets.Moment(i), sources.Position(i),
+          sources.Moment(i), result);
+      Store<Kernel::outputs>(result, out, i);
+    }
+  }
+
+  template <class Kernel>
+  static void TargetRows(const Kernel& kernel, const MagnetArrays& targets,
+      const MagnetArrays& sources, const InteractionArrays& out,
+      size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const ignition::math::Vector3d p_self = targets.Position(i);
+      const ignition::math::Vector3d m_self = targets.Moment(i);
+      Interaction sum;
+      sum.gradient = ignition::math::Matrix3d::Zero;
+      sum.energy = 0;
+      for (size_t j = 0; j < sources.size; ++j) {
+        const ignition::math::Vector3d p_other = sources.Position(j);
+        if ((p_other - p_self).SquaredLength() == 0)
+          continue;
+        Interaction result;
+        kernel(p_self, m_self, p_other, sources.Moment(j), result);
+        if (Kernel::outputs & OUTPUT_FORCE)
+          sum.force += result.force;
+        if (Kernel::outputs & OUTPUT_TORQUE)
+          sum.torque += result.torque;
+        if (Kernel::outputs & OUTPUT_FIELD)
+          sum.field += result.field;
+        if (Kernel::outputs & OUTPUT_GRADIENT)
+          sum.gradient += result.gradient;
+        if (Kernel::outputs & OUTPUT_ENERGY)
+          sum.energy += result.energy;
+      }
+      Store<Kernel::outputs>(sum, out, i);
+    }
+  }
+
+  template <unsigned Outputs>
+  static inline void Store(const Interaction& result, const InteractionArrays& out, size_t i) {
+    if (Outputs & OUTPUT_FORCE)
+      StoreVector(result.force, out.force + 3*i);
+    if (Outputs & OUTPUT_TORQUE)
+      StoreVector(result.torque, out.torque + 3*i);
+    if (Outputs & OUTPUT_FIELD)
+      StoreVector(result.field, out.field + 3*i);
+    if (Outputs & OUTPUT_GRADIENT) {
+      for (int a = 0; a < 3; ++a)
+        for (int b = 0; b < 3; ++b)
+          out.gradient[9*i + 3*a + b] = result.gradient(a, b);
+    }
+    if (Outputs & OUTPUT_ENERGY)
+      out.energy[i] = result.energy;
+  }
+
+  static inline void StoreVector(const ignition::math::Vector3d& v, double* row) {
+    row[0] = v.X();
+    row[1] = v.Y();
+    row[2] = v.Z();
+  }
+
+  TaskPool* pool;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_BATCH_EVALUATION_H_
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_COIL_FIELD_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_COIL_FIELD_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <boost/math/special_functions/ellint_1.hpp>
+#include <boost/math/special_functions/ellint_2.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "storm_gazebo_ros_magnet/dipole_magnet_container.h"
+
+namespace gazebo {
+
+/// \brief Field of a cylindrical coil scaled from a precomputed unit-current map.
+///
+/// The coil axis is the z axis of the coil frame and the winding is centered
+/// on its origin. The winding is discretized into current loops whose exact
+/// field is evaluated with complete elliptic integrals once, at load time, on
+/// an axisymmetric (rho, z) grid. Each step the field is interpolated from the
+/// grid and scaled by the commanded current. Outside the grid the coil is
+/// treated as a point dipole.
+class CoilField : public DipoleMagnetContainer::FieldSource {
+ public:
+  struct Geometry {
+    Geometry() : inner_radius(0), outer_radius(0), length(0), turns(1),
+        radial_loops(1), axial_loops(1) {
+    }
+    double inner_radius;
+    double outer_radius;
+    double length;
+    /// \brief Total number of turns of the winding
+    double turns;
+    /// \brief Number of loops used to discretize the winding radially
+    int radial_loops;
+    /// \brief Number of loops used to discretize the winding axially
+    int axial_loops;
+  };
+
+  CoilField() : cmd_current(0), current(0), rho_max(0), z_max(0), cell(0),
+      n_rho(0), n_z(0), unit_moment(0) {
+  }
+
+  /// \brief Precompute the unit-current field map
+  /// \param[in] _geometry Winding geometry
+  /// \param[in] _rho_max Radial extent of the map
+  /// \param[in] _z_max Axial half extent of the map
+  /// \param[in] _cell Grid spacing of the map
+  void Build(const Geometry& _geometry, double _rho_max, double _z_max, double _cell) {
+    this->geometry = _geometry;
+    this->cell = _cell;
+    this->n_rho = static_cast<int>(std::ceil(_rho_max/_cell)) + 1;
+    this->n_z = 2*static_cast<int>(std::ceil(_z_max/_cell)) + 1;
+    this->rho_max = (this->n_rho - 1)*_cell;
+    this->z_max = 0.5*(this->n_z - 1)*_cell;
+
+    // Loop radii and axial positions at the centers of equal winding cells
+    this->loops.clear();
+    const Geometry& g = this->geometry;
+    double loop_current = g.turns/(g.radial_loops*g.axial_loops);
+    this->unit_moment = 0;
+    for (int i = 0; i < g.radial_loops; ++i) {
+      double a = g.inner_radius +
+          (i + 0.5)*(g.outer_radius - g.inner_radius)/g.radial_loops;
+      for (int j = 0; j < g.axial_loops; ++j) {
+        double z = -0.5*g.length + (j + 0.5)*g.length/g.axial_loops;
+        this->loops.push_back(Loop(a, z, loop_current));
+        this->unit_moment += loop_current*M_PI*a*a;
+      }
+    }
+
+    this->nodes.assign(this->n_rho*this->n_z, Node());
+    double h = 1e-3*_cell;
+    for (int i = 0; i < this->n_rho; ++i) {
+      double rho = i*_cell;
+      for (int j = 0; j < this->n_z; ++j) {
+        double z = -this->z_max + j*_cell;
+        Node& node = this->nodes[i*this->n_z + j];
+        this->ExactField(rho, z, node.b_rho, node.b_z);
+
+        double br_p, bz_p, br_m, bz_m;
+        // Central differences, one-sided on the axis where B_rho is odd in rho
+        if (i == 0) {
+          this->ExactField(h, z, br_p, bz_p);
+          node.drho_b_rho = br_p/h;
+          node.drho_b_z = 0;
+        } else {
+          this->ExactField(rho + h, z, br_p, bz_p);
+          this->ExactField(rho - h, z, br_m, bz_m);
+          node.drho_b_rho = (br_p - br_m)/(2*h);
+          node.drho_b_z = (bz_p - bz_m)/(2*h);
+        }
+        this->ExactField(rho, z + h, br_p, bz_p);
+        this->ExactField(rho, z - h, br_m, bz_m);
+        node.dz_b_rho = (br_p - br_m)/(2*h);
+        node.dz_b_z = (bz_p - bz_m)/(2*h);
+      }
+    }
+  }
+
+  /// \brief Set the commanded current in A, applied at the next step
+  void SetCurrent(double _current) {
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->cmd_current = _current;
+  }
+
+  /// \brief Set the world pose of the coil frame, applied by the next Update
+  void SetPose(const ignition::math::Pose3d& _pose) {
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->cmd_pose = _pose;
+  }
+
+  void Update(const common::Time& /*time*/) {
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->current = this->cmd_current;
+    this->pose = this->cmd_pose;
+  }
+
+  std::shared_ptr<const void> SaveState() const {
+    boost::mutex::scoped_lock lock(this->mutex);
+    std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+    snapshot->cmd_current = this->cmd_current;
+    snapshot->cmd_pose = this->cmd_pose;
+    snapshot->current = this->current;
+    snapshot->pose = this->pose;
+    return snapshot;
+  }
+
+  void RestoreState(const std::shared_ptr<const void>& state) {
+    if (!state)
+      return;
+    const Snapshot& snapshot = *static_cast<const Snapshot*>(state.get());
+    boost::mutex::scoped_lock lock(this->mutex);
+    this->cmd_current = snapshot.cmd_current;
+    this->cmd_pose = snapshot.cmd_pose;
+    this->current = snapshot.current;
+    this->pose = snapshot.pose;
+  }
+
+  void GetField(const ignition::math::Vector3d& p,
+      ignition::math::Vector3d& field,
+      ignition::math::Matrix3d& gradient) const {
+    ignition::math::Vector3d local = this->pose.Rot().RotateVectorReverse(p - this->pose.Pos());
+    double rho = std::sqrt(local.X()*local.X() + local.Y()*local.Y());
+
+    ignition::math::Vector3d field_local;
+    ignition::math::Matrix3d gradient_local;
+    if (this->nodes.empty() || rho >= this->rho_max || std::abs(local.Z()) >= this->z_max) {
+      this->FarField(local, field_local, gradient_local);
+    } else {
+      this->MapField(local, rho, field_local, gradient_local);
+    }
+
+    // Rotate back into the world frame, G_world = R G_local R^T
+    ignition::math::Matrix3d R;
+    for (int j = 0; j < 3; ++j) {
+      ignition::math::Vector3d e;
+      e[j] = 1;
+      ignition::math::Vector3d col = this->pose.Rot().RotateVector(e);
+      for (int i = 0; i < 3; ++i)
+        R(i, j) = col[i];
+    }
+    field = this->pose.Rot().RotateVector(field_local)*this->current;
+    gradient = R*gradient_local*R.Transposed()*this->current;
+  }
+
+ private:
+  struct Loop {
+    Loop(double _radius, double _z, double _current)
+        : radius(_radius), z(_z), current(_current) {
+    }
+    double radius;
+    double z;
+    double current;
+  };
+
+  struct Node {
+    Node() : b_rho(0), b_z(0), drho_b_rho(0), dz_b_rho(0), drho_b_z(0), dz_b_z(0) {
+    }
+    double b_rho;
+    double b_z;
+    double drho_b_rho;
+    double dz_b_rho;
+    double drho_b_z;
+    double dz_b_z;
+  };
+
+  /// \brief Exact unit-current field of the discretized winding
+  void ExactField(double rho, double z, double& b_rho, double& b_z) const {
+    const double mu_0 = 4*M_PI*1e-7;
+    b_rho = 0;
+    b_z = 0;
+    for (size_t l = 0; l < this->loops.size(); ++l) {
+      const Loop& loop = this->loops[l];
+      double a = loop.radius;
+      double dz = z - loop.z;
+      double sum2 = (a + rho)*(a + rho) + dz*dz;
+      double diff2 = (a - rho)*(a - rho) + dz*dz;
+      if (diff2 < 1e-18)
+        continue;  // on the wire
+      double k = std::sqrt(4*a*rho/sum2);
+      double K = boost::math::ellint_1(k);
+      double E = boost::math::ellint_2(k);
+      double c = mu_0*loop.current/(2*M_PI*std::sqrt(sum2));
+      b_z += c*(K + (a*a - rho*rho - dz*dz)/diff2*E);
+      if (rho > 0)
+        b_rho += c*dz/rho*(-K + (a*a + rho*rho + dz*dz)/diff2*E);
+    }
+  }
+
+  /// \brief Bilinear interpolation of the unit-current map
+  void MapField(const ignition::math::Vector3d& local, double rho,
+      ignition::math::Vector3d& field, ignition::math::Matrix3d& gradient) const {
+    double u = rho/this->cell;
+    double v = (local.Z() + this->z_max)/this->cell;
+    int i = std::min(static_cast<int>(u), this->n_rho - 2);
+    int j = std::min(static_cast<int>(v), this->n_z - 2);
+    double fu = u - i;
+    double fv = v - j;
+    const Node& n00 = this->nodes[i*this->n_z + j];
+    const Node& n01 = this->nodes[i*this->n_z + j + 1];
+    const Node& n10 = this->nodes[(i + 1)*this->n_z + j];
+    const Node& n11 = this->nodes[(i + 1)*this->n_z + j + 1];
+    double w00 = (1 - fu)*(1 - fv), w01 = (1 - fu)*fv, w10 = fu*(1 - fv), w11 = fu*fv;
+    auto lerp = [&](double Node::*member) {
+      return w00*(n00.*member) + w01*(n01.*member) + w10*(n10.*member) + w11*(n11.*member);
+    };
+    double b_rho = lerp(&Node::b_rho);
+    double b_z = lerp(&Node::b_z);
+    double drho_b_rho = lerp(&Node::drho_b_rho);
+    double dz_b_rho = lerp(&Node::dz_b_rho);
+    double drho_b_z = lerp(&Node::drho_b_z);
+    double dz_b_z = lerp(&Node::dz_b_z);
+
+    // Cylindrical to cartesian. B_rho/rho tends to dB_rho/drho on the axis.
+    double c = 1, s = 0, b_rho_over_rho = drho_b_rho;
+    if (rho > 1e-9) {
+      c = local.X()/rho;
+      s = local.Y()/rho;
+      b_rho_over_rho = b_rho/rho;
+    }
+    field.Set(b_rho*c, b_rho*s, b_z);
+    gradient(0, 0) = drho_b_rho*c*c + b_rho_over_rho*s*s;
+    gradient(0, 1) = (drho_b_rho - b_rho_over_rho)*c*s;
+    gradient(0, 2) = dz_b_rho*c;
+    gradient(1, 0) = gradient(0, 1);
+    gradient(1, 1) = drho_b_rho*s*s + b_rho_over_rho*c*c;
+    gradient(1, 2) = dz_b_rho*s;
+    gradient(2, 0) = drho_b_z*c;
+    gradient(2, 1) = drho_b_z*s;
+    gradient(2, 2) = dz_b_z;
+  }
+
+  /// \brief Far field of the unit-current coil
+  void FarField(const ignition::math::Vector3d& r,
+      ignition::math::Vector3d& field, ignition::math::Matrix3d& gradient) const {
+    ignition::math::Vector3d m(0, 0, this->unit_moment);
+    double r2 = r.SquaredLength();
+    double r1 = std::sqrt(r2);
+    double ir5 = 1.0/(r2*r2*r1);
+    double mr = m.Dot(r);
+    field = DipoleField(r, m);
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        double delta = (i == j) ? 1.0 : 0.0;
+        gradient(i, j) = 3e-7*ir5*(m[j]*r[i] + m[i]*r[j] + mr*delta - 5*mr*r[i]*r[j]/r2);
+      }
+    }
+  }
+
+  struct Snapshot {
+    double cmd_current;
+    ignition::math::Pose3d cmd_pose;
+    double current;
+    ignition::math::Pose3d pose;
+  };
+
+  mutable boost::mutex mutex;
+  double cmd_current;
+  ignition::math::Pose3d cmd_pose;
+  double current;
+  ignition::math::Pose3d pose;
+
+  Geometry geometry;
+  std::vector<Loop> loops;
+  std::vector<Node> nodes;
+  double rho_max;
+  double z_max;
+  double cell;
+  int n_rho;
+  int n_z;
+  /// \brief Dipole moment of the coil per unit current
+  double unit_moment;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_COIL_FIELD_H_
@@ -24,36 +24,145 @@
 #include <gazebo/physics/physics.hh>
 #include <gazebo/common/common.hh>
 
+#include <boost/thread.hpp>
+
+#include <ros/callback_queue.h>
+#include <ros/ros.h>
 #include <geometry_msgs/WrenchStamped.h>
 #include <sensor_msgs/MagneticField.h>
+#include <std_msgs/Float64MultiArray.h>
 
+#include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "storm_gazebo_ros_magnet/dipole_magnet_container.h"
+#include "storm_gazebo_ros_magnet/interaction_kernel.h"
+#include "storm_gazebo_ros_magnet/latency_probe.h"
+#include "storm_gazebo_ros_magnet/tolerance_analysis.h"
+#include "storm_gazebo_ros_magnet/top_contributions.h"
 
 namespace gazebo {
 
-class DipoleMagnet : public ModelPlugin {
+/// \brief Magnet of one link. Its plugin owns it through a shared pointer
+/// and its callbacks hold it only while they run, so a step that is under
+/// way when the plugin is destroyed finishes with it.
+class DipoleMagnet : public std::enable_shared_from_this<DipoleMagnet> {
  public:
   DipoleMagnet();
 
   ~DipoleMagnet();
 
-  /// \brief Loads the plugin
+  /// \brief Loads the magnet. It must be owned by a shared pointer.
   void Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf);
 
+  /// \brief Restores the loaded moment and clears per-step state
+  void Reset();
+
   /// \brief Callback for when subscribers connect
   void Connect();
 
   /// \brief Callback for when subscribers disconnect
   void Disconnect();
 
-  /// \brief Thread to interact with ROS
-  void QueueThread();
+  /// \brief Set the world pose of the magnet from its link
+  void UpdatePose();
 
   /// \brief Called by the world update start event
   void OnUpdate(const common::UpdateInfo & /*_info*/);
 
+  /// \brief Solve the wrench on the magnet into the held force, torque and
+  /// field. Called by the container when it solves clusters in parallel, so
+  /// it must not touch the link.
+  void Solve();
+
+  /// \brief Solver of the interactions of this magnet, bound to a kernel
+  typedef std::function<void(DipoleMagnetContainer&, const ignition::math::Pose3d&,
+      const ignition::math::Vector3d&, ignition::math::Vector3d&,
+      ignition::math::Vector3d&, ignition::math::Vector3d&, double&)> InteractionSolver;
+
+  /// \brief Bind compute_interactions to the kernel of a model and of the
+  /// outputs this plugin uses, and compute_interactions_energy to the same
+  /// kernel with the energy added
+  template <class Model>
+  void SelectKernel(const Model& model);
+
+  /// \brief Accumulates the force and torque of the interacting magnets, if
+  /// the container did not solve them, and of the ferromagnetic boundaries
+  /// \param[in] kernel Interaction kernel
+  /// \param[in] dp Container of the magnets
+  /// \param[in] p_self Pose of this magnet
+  /// \param[in] moment_world Dipole moment of this magnet in the world frame
+  /// \param[in,out] force Accumulated force
+  /// \param[in,out] torque Accumulated torque
+  /// \param[in,out] mfs Accumulated magnetic field in the body frame
+  /// \param[in,out] energy Accumulated interaction energy, with the energy
+  /// of pairs of calculated magnets split between them. Only accumulated if
+  /// the kernel outputs it.
+  template <class Kernel>
+  void ComputeInteractions(const Kernel& kernel, DipoleMagnetContainer& dp,
+      const ignition::math::Pose3d& p_self,
+      const ignition::math::Vector3d& moment_world,
+      ignition::math::Vector3d& force,
+      ignition::math::Vector3d& torque,
+      ignition::math::Vector3d& mfs, double& energy);
+
+  /// \brief What the loop over other magnets has to handle, fixed at
+  /// compile time so that it tests neither per pair
+  /// \tparam kShaped Whether any magnet may have a finite-size shape
+  /// \tparam kRecorded Whether contributions are recorded
+  template <bool kShaped, bool kRecorded>
+  struct PairPolicy {
+    static const bool shaped = kShaped;
+    static const bool recorded = kRecorded;
+  };
+
+  /// \brief Accumulates the interactions with other magnets
+  template <class Kernel, class Policy>
+  void ComputeMagnetInteractions(const Kernel& kernel, DipoleMagnetContainer& dp,
+      const ignition::math::Pose3d& p_self,
+      const ignition::math::Vector3d& moment_world,
+      ignition::math::Vector3d& force,
+      ignition::math::Vector3d& torque,
+      ignition::math::Vector3d& mfs, double& energy);
+
+  /// \brief Accumulates the interactions with the magnets of one model
+  /// \tparam kOwnModel Whether the group is this magnet's own model, whose
+  /// magnets with this magnet's id are skipped
+  template <class Kernel, class Policy, bool kOwnModel>
+  void AddGroupInteractions(const Kernel& kernel,
+      const DipoleMagnetContainer::Group& group,
+      const ignition::math::Pose3d& p_self,
+      const ignition::math::Vector3d& moment_world,
+      ignition::math::Vector3d& force,
+      ignition::math::Vector3d& torque,
+      ignition::math::Vector3d& mfs, double& energy);
+
+  /// \brief Accumulates the attraction to the ferromagnetic boundaries
+  template <class Kernel>
+  void ComputePlaneInteractions(const Kernel& kernel, DipoleMagnetContainer& dp,
+      const ignition::math::Pose3d& p_self,
+      const ignition::math::Vector3d& moment_world,
+      ignition::math::Vector3d& force,
+      ignition::math::Vector3d& torque,
+      ignition::math::Vector3d& mfs, double& energy);
+
+  /// \brief Publishes the strongest contributions recorded in this step
+  void PublishContributions();
+
+  /// \brief Evaluates the wrench and field for every draw of the magnet
+  /// tolerances and publishes their statistics
+  void PublishTolerance();
+
+  /// \brief Moments of a soft magnet for every tolerance draw, to first
+  /// order about its solved moment
+  /// \param[in] dp Container of the magnets
+  /// \param[in] soft Soft magnet
+  /// \param[in] samples Number of draws
+  /// \return World frame moments
+  static std::shared_ptr<MomentSamples> GetInducedSamples(const DipoleMagnetContainer& dp,
+      const DipoleMagnetContainer::Magnet& soft, size_t samples);
 
   /// \brief Publishes data to ros topics
   /// \pram[in] force A vector of force that makes up the wrench to be published
@@ -64,26 +173,30 @@ class DipoleMagnet : public ModelPlugin {
       const ignition::math::Vector3d& torque,
       const ignition::math::Vector3d& mfs);
 
-  /// \brief Calculate force and torque of a magnet on another
+  /// \brief Calculate force and torque between two finite-size magnets
   /// \parama[in] p_self Pose of the first magnet
   /// \parama[in] m_self Dipole moment of the first magnet
-  /// \parama[in] p_other Pose of the second magnet
-  /// \parama[in] m_other Dipole moment of the second magnet on which the force is calculated
-  /// \param[out] force Calculated force vector
-  /// \param[out] torque Calculated torque vector
-  void GetForceTorque(const ignition::math::Pose3d& p_self,  const ignition::math::Vector3d& m_self,
-      const ignition::math::Pose3d& p_other, const ignition::math::Vector3d& m_other,
-      ignition::math::Vector3d& force, ignition::math::Vector3d& torque);
-
-  /// \brief Calculate the magnetic field on all 6 sensors
-  /// \parama[in] p_self Pose of the first magnet
+  /// \parama[in] s_self Shape of the first magnet
   /// \parama[in] p_other Pose of the second magnet
   /// \parama[in] m_other Dipole moment of the second magnet
-  /// \param[out] mfs magnetic field sensors
-  void GetMFS(const ignition::math::Pose3d& p_self,
+  /// \parama[in] s_other Shape of the second magnet
+  /// \param[out] force Calculated force vector on the first magnet
+  /// \param[out] torque Calculated torque vector on the first magnet about its center
+  /// \param[out] field Field of the second magnet at the center of the first
+  void GetFiniteForceTorque(const ignition::math::Pose3d& p_self,
+      const ignition::math::Vector3d& m_self, const MagnetShape& s_self,
       const ignition::math::Pose3d& p_other,
-      const ignition::math::Vector3d& m_other,
-      ignition::math::Vector3d& mfs);
+      const ignition::math::Vector3d& m_other, const MagnetShape& s_other,
+      ignition::math::Vector3d& force, ignition::math::Vector3d& torque,
+      ignition::math::Vector3d& field);
+
+  /// \brief Weight of the finite-size model for a pair of magnets, the same
+  /// for either order of the two
+  /// \return 1 inside the near radius, 0 beyond the far radius and a smooth
+  /// blend in between
+  static double GetFiniteSizeWeight(const ignition::math::Pose3d& p_self,
+      const DipoleMagnetContainer::Magnet& self, const ignition::math::Pose3d& p_other,
+      const DipoleMagnetContainer::Magnet& other);
 
   // Pointer to the model
  private:
@@ -92,32 +205,108 @@ class DipoleMagnet : public ModelPlugin {
   physics::WorldPtr world;
 
   std::shared_ptr<DipoleMagnetContainer::Magnet> mag;
+  /// \brief Container of the magnets in this model's world
+  std::shared_ptr<DipoleMagnetContainer> container;
+  /// \brief Body frame moment as loaded, restored on reset
+  ignition::math::Vector3d initial_moment;
+  /// \brief Wrench and field of the last solved step, applied again on
+  /// steps the quality governor skips
+  ignition::math::Vector3d held_force;
+  ignition::math::Vector3d held_torque;
+  ignition::math::Vector3d held_mfs;
+  /// \brief Interaction energy of the last solved step, only computed
+  /// while the container monitors the energy
+  double held_energy;
 
   std::string link_name;
   std::string robot_namespace;
   std::string topic_ns;
   std::uint32_t low_id;
 
+  /// \brief Models farther than this multiple of their extent are evaluated
+  /// through their aggregate multipole. Zero disables aggregation.
+  double far_field_ratio;
+
+  /// \brief Interactions with other magnets and planes, computed by the
+  /// kernel selected at load
+  InteractionSolver compute_interactions;
+  InteractionSolver compute_interactions_energy;
+
+  /// \brief ROS node and callback thread shared by all magnets with the
+  /// same namespace, so that spawning many magnets does not start a thread
+  /// per magnet
+  struct SharedNode {
+    explicit SharedNode(const std::string& ns);
+    ~SharedNode();
+
+    /// \brief Thread to interact with ROS
+    void QueueThread();
+
+    ros::NodeHandle node;
+    ros::CallbackQueue queue;
+    boost::thread callback_queue_thread;
+  };
+
+  /// \brief Get the shared node of a namespace, creating it on first use
+  static std::shared_ptr<SharedNode> GetSharedNode(const std::string& ns);
+
   bool should_publish;
-  ros::NodeHandle* rosnode;
+  std::shared_ptr<SharedNode> rosnode;
+  /// \brief Expires before this plugin is destroyed so that queued
+  /// subscriber callbacks are dropped
+  ros::VoidPtr tracked_object;
   ros::Publisher wrench_pub;
   ros::Publisher mfs_pub;
+  ros::Publisher contributions_pub;
+  std_msgs::Float64MultiArray contributions_msg;
+
+  /// \brief Strongest contributions of the current step, NULL on steps
+  /// that are not introspected
+  TopContributions* recording;
+  std::unique_ptr<TopContributions> contributions;
+  double contributions_rate;
+  common::Time contributions_time;
+
+  /// \brief Monte Carlo analysis of the magnet tolerances, NULL if it is
+  /// not published
+  std::unique_ptr<ToleranceAnalysis> tolerance;
+  std::vector<ToleranceAnalysis::Source> tolerance_sources;
+  double tolerance_rate;
+  common::Time tolerance_time;
+  ros::Publisher tolerance_pub;
+  std_msgs::Float64MultiArray tolerance_msg;
 
   geometry_msgs::WrenchStamped wrench_msg;
   sensor_msgs::MagneticField mfs_msg;
 
+  /// \brief Stamps of the mfs samples for measuring their latency, not
+  /// advertised unless the latency probe is enabled
+  ros::Publisher mfs_stamp_pub;
+  std_msgs::Float64MultiArray mfs_stamp_msg;
+  /// \brief Sequence number of the next mfs sample
+  std::uint64_t mfs_seq;
+
   private: boost::mutex lock;
   int connect_count;
 
-  // Custom Callback Queue
-  ros::CallbackQueue queue;
-  boost::thread callback_queue_thread;
-
   common::Time last_time;
   double update_rate;
   // Pointer to the update event connection
   event::ConnectionPtr update_connection;
 };
 
+/// \brief Gazebo plugin of a DipoleMagnet
+class DipoleMagnetPlugin : public ModelPlugin {
+ public:
+  /// \brief Loads the plugin
+  void Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf);
+
+  /// \brief Restores the loaded moment and clears per-step state
+  void Reset();
+
+ private:
+  std::shared_ptr<DipoleMagnet> magnet;
+};
+
 }
 #endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_DIPOLE_MAGNET_H_
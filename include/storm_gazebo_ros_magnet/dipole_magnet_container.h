@@ -19,22 +19,91 @@
 #ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_DIPOLE_MAGNET_CONTAINER_H_
 #define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_DIPOLE_MAGNET_CONTAINER_H_
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <numeric>
 #include <vector>
 #include <memory>
+#include <string>
 #include <cstdint>
 
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+
 #include <gazebo/common/common.hh>
+#include <gazebo/physics/PhysicsTypes.hh>
+
+#include "storm_gazebo_ros_magnet/energy_monitor.h"
+#include "storm_gazebo_ros_magnet/ewald.h"
+#include "storm_gazebo_ros_magnet/island_sleep.h"
+#include "storm_gazebo_ros_magnet/latency_probe.h"
+#include "storm_gazebo_ros_magnet/magnet_shape.h"
+#include "storm_gazebo_ros_magnet/multipole.h"
+#include "storm_gazebo_ros_magnet/quality_governor.h"
+#include "storm_gazebo_ros_magnet/shared_exchange.h"
+#include "storm_gazebo_ros_magnet/task_pool.h"
+#include "storm_gazebo_ros_magnet/tiled_all_pairs.h"
+#include "storm_gazebo_ros_magnet/tolerance_analysis.h"
 
 namespace gazebo {
 
 class DipoleMagnetContainer {
  public:
-  DipoleMagnetContainer() {
+  /// \brief Amount of registration logging, sent to gzdbg
+  enum LogLevel {
+    /// \brief Nothing is logged
+    LOG_NONE,
+    /// \brief Number of magnets, once per step in which it changed
+    LOG_SUMMARY,
+    /// \brief Every added and removed magnet
+    LOG_VERBOSE
+  };
+
+  DipoleMagnetContainer() : induction_tolerance(1e-6), induction_max_iterations(20),
+      induction_iterations(0), cluster_field(0), small_cluster(16), tiled_cluster(0),
+      sleeping(0),
+      log_level(LOG_SUMMARY), last_refresh(0), step_start(0),
+      refresh_time(0), refreshed(false),
+      groups_dirty(false), update_step(true), solved(false),
+      pairs_solved(false), point_dipoles(true),
+      version(0), synced_version(0), remote_ok(true) {
   }
 
-  static DipoleMagnetContainer& Get() {
-    static DipoleMagnetContainer instance;
+  /// \brief Container of the magnets in a world. Magnets in different
+  /// worlds never interact, so several worlds can be stepped in one process,
+  /// each on its own thread. Worlds are told apart by identity, not by name,
+  /// so two worlds that share a name get their own containers. The container
+  /// lives as long as someone holds the returned pointer and is recreated on
+  /// the next lookup afterwards.
+  /// \param[in] world World the magnets live in
+  static std::shared_ptr<DipoleMagnetContainer> Get(const physics::WorldPtr& world) {
+    struct Entry {
+      boost::weak_ptr<physics::World> world;
+      std::weak_ptr<DipoleMagnetContainer> container;
+    };
+    static boost::mutex registry_lock;
+    static std::map<const physics::World*, Entry> registry;
+
+    boost::mutex::scoped_lock lock(registry_lock);
+    // Drop entries of worlds or containers that are gone. A destroyed world
+    // may leave its address to a new one, which must not find the old entry.
+    for (std::map<const physics::World*, Entry>::iterator it = registry.begin();
+        it != registry.end();) {
+      if (it->second.world.expired() || it->second.container.expired())
+        registry.erase(it++);
+      else
+        ++it;
+    }
+    Entry& entry = registry[world.get()];
+    std::shared_ptr<DipoleMagnetContainer> instance = entry.container.lock();
+    if (!instance) {
+      instance = std::make_shared<DipoleMagnetContainer>();
+      entry.world = world;
+      entry.container = instance;
+    }
     return instance;
   }
 
@@ -44,23 +113,1049 @@ class DipoleMagnetContainer {
     ignition::math::Pose3d offset;
     ignition::math::Pose3d pose;
     std::uint32_t model_id;
+    /// \brief Id of the gazebo model that owns this magnet
+    std::uint32_t owner_id;
+    /// \brief Induced moment per unit field in A m^2/T. Non-zero for soft
+    /// magnetic bodies, whose moment is solved for every step.
+    double polarizability;
+    /// \brief Volume used for finite-size interaction at close range
+    MagnetShape shape;
+    /// \brief Pairs closer than lod_near_ratio times the sum of their
+    /// bounding radii use the finite-size model, pairs beyond lod_far_ratio
+    /// the dipole model, and pairs in between a blend of both. A pair uses
+    /// the larger ratios of its two magnets, so both get the same blend.
+    double lod_near_ratio;
+    double lod_far_ratio;
+    /// \brief Draws of the moment within its manufacturing tolerance, or
+    /// NULL if the magnet has none
+    std::shared_ptr<const MomentSamples> moment_samples;
+    /// \brief World frame force, torque and field solved by the container
+    /// for the current step, when the container solves all magnets at once
+    ignition::math::Vector3d force;
+    ignition::math::Vector3d torque;
+    ignition::math::Vector3d field;
+    /// \brief Whether force, torque and field hold the interactions with all
+    /// other magnets for the current step, solved by the container for this
+    /// magnet's cluster alone
+    bool pairs_solved;
+    /// \brief Field of the magnets that do not calculate, at this magnet,
+    /// with pairs_solved while the energy is summed. Those magnets never
+    /// count their share of a pair, so this magnet counts all of it.
+    ignition::math::Vector3d fixed_field;
+    /// \brief Position in magnets, maintained by the container at the
+    /// start of each step
+    size_t index;
+    /// \brief Set when the magnet is removed. Steps no longer call its
+    /// callbacks, but one that is under way may have checked it just before
+    /// it was set.
+    std::atomic<bool> retired;
+    /// \brief Cluster of the magnet's model in the current step
+    size_t cluster;
+    /// \brief Whether the magnet is asleep and what wakes it, only
+    /// maintained while the container puts magnets to sleep
+    SleepState sleep_state;
+    /// \brief Set the pose from the simulation, called at the start of
+    /// every step when set. Removing the magnet does not wait for a call
+    /// that is under way, so the callbacks must keep what they use alive,
+    /// e.g. through a weak pointer they lock for the call.
+    std::function<void()> update_pose;
+    /// \brief Solve the wrench on the magnet. Called from worker threads
+    /// when the container solves clusters in parallel, so it may only write
+    /// to the magnet itself and to its owner's state.
+    std::function<void()> solve;
   };
 
   typedef std::shared_ptr<Magnet> MagnetPtr ;
   typedef std::vector<MagnetPtr> MagnetPtrV ;
 
+  /// \brief All magnets owned by one model, with their far-field expansion
+  struct Group {
+    Group() : owner_id(0), moment_sum(0), fixed(false), cluster(0) {
+    }
+
+    std::uint32_t owner_id;
+    MagnetPtrV magnets;
+    Multipole aggregate;
+    /// \brief Sum of the moment magnitudes, bounds the field of the group
+    double moment_sum;
+    /// \brief Whether none of the magnets calculate, so magnets interacting
+    /// with the group count the whole energy
+    bool fixed;
+    size_t cluster;
+  };
+  typedef std::map<std::uint32_t, Group> GroupMap;
+  typedef std::vector<Group*> GroupPtrV;
+
+  /// \brief Models connected by interactions above cluster_field. Models in
+  /// different clusters are solved independently.
+  struct Cluster {
+    GroupPtrV groups;
+    MagnetPtrV magnets;
+  };
+
+  /// \brief Soft ferromagnetic half-space bounded by a plane
+  struct FerromagneticPlane {
+    /// \brief Any point on the surface
+    ignition::math::Vector3d point;
+    /// \brief Unit surface normal pointing out of the material
+    ignition::math::Vector3d normal;
+    /// \brief (mu_r - 1)/(mu_r + 1), 1 for an ideal soft iron
+    double image_factor;
+
+    /// \brief Compute the image of a dipole in front of the plane
+    /// \param[in] p Position of the dipole
+    /// \param[in] m World frame moment of the dipole
+    /// \param[out] p_image Position of the image dipole
+    /// \param[out] m_image World frame moment of the image dipole
+    /// \return False if the dipole is not in front of the plane
+    bool GetImage(const ignition::math::Vector3d& p,
+        const ignition::math::Vector3d& m,
+        ignition::math::Vector3d& p_image,
+        ignition::math::Vector3d& m_image) const {
+      double h = (p - this->point).Dot(this->normal);
+      if (h <= 0)
+        return false;
+      p_image = p - this->normal*(2*h);
+      // Normal component is preserved, tangential components are flipped
+      m_image = (this->normal*(2*m.Dot(this->normal)) - m)*this->image_factor;
+      return true;
+    }
+  };
+  typedef std::vector<FerromagneticPlane> FerromagneticPlaneV;
+
+  /// \brief Source of a field that is not produced by a registered magnet
+  class FieldSource {
+   public:
+    virtual ~FieldSource() {
+    }
+
+    /// \brief Called once per step before any field is evaluated
+    /// \param[in] time Current simulation time
+    virtual void Update(const common::Time& /*time*/) {
+    }
+
+    /// \brief Field and field gradient at a point
+    /// \param[in] p World position
+    /// \param[out] field Magnetic field at p
+    /// \param[out] gradient Field gradient at p, gradient(i, j) = dB_i/dx_j
+    virtual void GetField(const ignition::math::Vector3d& p,
+        ignition::math::Vector3d& field,
+        ignition::math::Matrix3d& gradient) const = 0;
+
+    /// \brief Snapshot of the commanded and active state of the source
+    virtual std::shared_ptr<const void> SaveState() const {
+      return std::shared_ptr<const void>();
+    }
+
+    /// \brief Restore a snapshot taken with SaveState
+    virtual void RestoreState(const std::shared_ptr<const void>& /*state*/) {
+    }
+
+    /// \brief Set the pose from the simulation, called at the start of
+    /// every step before Update when set
+    std::function<void()> update_pose;
+  };
+  typedef std::shared_ptr<FieldSource> FieldSourcePtr;
+  typedef std::vector<FieldSourcePtr> FieldSourcePtrV;
+
+  /// \brief State of a magnet that is not recomputed every step
+  struct MagnetState {
+    std::uint32_t model_id;
+    ignition::math::Vector3d moment;
+  };
+
+  /// \brief Snapshot of the container state. Taking a snapshot into an
+  /// existing checkpoint reuses its storage.
+  struct Checkpoint {
+    std::vector<MagnetState> magnets;
+    std::vector<std::shared_ptr<const void> > field_sources;
+    int induction_iterations;
+  };
+
+  /// \brief Register a magnet. Safe to call from any thread; the magnet
+  /// takes part from the next step on.
   void Add(MagnetPtr mag) {
-    std::cout << "Adding mag id:" << mag->model_id << std::endl;
-    this->magnets.push_back(mag);
-    std::cout << "Total: " << this->magnets.size() << " magnets" << std::endl;
+    this->Add(MagnetPtrV(1, mag));
+  }
+
+  /// \brief Register many magnets at once
+  void Add(const MagnetPtrV& mags) {
+    boost::mutex::scoped_lock lock(this->registration_lock);
+    for (size_t i = 0; i < mags.size(); ++i) {
+      mags[i]->cluster = static_cast<size_t>(-1);
+      mags[i]->retired = false;
+      this->pending.push_back(Registration(mags[i], true));
+    }
+    ++this->version;
   }
+
+  /// \brief Unregister a magnet. Safe to call from any thread. The order of
+  /// the remaining magnets is not preserved.
   void Remove(MagnetPtr mag) {
-    std::cout << "Removing mag id:" << mag->model_id << std::endl;
-    this->magnets.erase(std::remove(this->magnets.begin(), this->magnets.end(), mag), this->magnets.end());
-    std::cout << "Total: " << this->magnets.size() << " magnets" << std::endl;
+    this->Remove(MagnetPtrV(1, mag));
+  }
+
+  /// \brief Unregister many magnets at once. Never waits, so it may also
+  /// be called from within a step. A step that is under way may still call
+  /// their callbacks. The magnets live on in the list of the steps that
+  /// hold them until the next step drops them.
+  void Remove(const MagnetPtrV& mags) {
+    if (mags.empty())
+      return;
+    boost::mutex::scoped_lock lock(this->registration_lock);
+    for (size_t i = 0; i < mags.size(); ++i) {
+      mags[i]->retired = true;
+      this->pending.push_back(Registration(mags[i], false));
+    }
+    ++this->version;
+  }
+
+  /// \brief Apply the registrations and removals made since the last step,
+  /// in the order they were made. Only called at a step boundary on the
+  /// thread that steps the world, which is the only one that reads magnets.
+  /// Costs O(1) per change, however many magnets there are.
+  void SyncRegistrations() {
+    if (this->version.load() == this->synced_version)
+      return;
+    {
+      boost::mutex::scoped_lock lock(this->registration_lock);
+      this->applying.swap(this->pending);
+      this->synced_version = this->version.load();
+    }
+
+    for (size_t i = 0; i < this->applying.size(); ++i) {
+      const MagnetPtr& mag = this->applying[i].magnet;
+      const bool present = mag->index < this->magnets.size() &&
+          this->magnets[mag->index] == mag;
+      if (this->applying[i].add) {
+        if (present)
+          continue;
+        if (this->log_level >= LOG_VERBOSE)
+          gzdbg << "Adding mag id:" << mag->model_id << "\n";
+        mag->index = this->magnets.size();
+        this->magnets.push_back(mag);
+      } else if (present) {
+        if (this->log_level >= LOG_VERBOSE)
+          gzdbg << "Removing mag id:" << mag->model_id << "\n";
+        MagnetPtr last = this->magnets.back();
+        last->index = mag->index;
+        this->magnets[mag->index] = last;
+        this->magnets.pop_back();
+      }
+    }
+    this->applying.clear();
+    this->groups_dirty = true;
+  }
+
+  /// \brief Rebuild the per-model aggregates once per simulation step
+  /// \param[in] iteration Current world iteration. Calls with an iteration
+  /// that was already refreshed are no-ops.
+  /// \param[in] time Current simulation time
+  void Refresh(std::uint64_t iteration, const common::Time& time) {
+    if (this->refreshed && iteration == this->last_refresh)
+      return;
+    this->last_refresh = iteration;
+    this->refreshed = true;
+    this->step_start = MonotonicSeconds();
+    this->refresh_time = time.Double();
+    this->step_time = time;
+
+    this->SyncRegistrations();
+    if (this->groups_dirty)
+      this->RebuildGroups();
+    this->solved = false;
+    this->pairs_solved = false;
+
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      this->magnets[i]->pairs_solved = false;
+      if (this->magnets[i]->update_pose && !this->magnets[i]->retired)
+        this->magnets[i]->update_pose();
+    }
+
+    this->UpdateFieldSources(time);
+
+    // Magnets hold their last wrench on steps the governor skips
+    this->update_step = !this->governor || this->governor->NextStep();
+    if (!this->update_step)
+      return;
+
+    this->SolveInduced();
+
+    std::vector<ignition::math::Vector3d> positions;
+    std::vector<ignition::math::Vector3d> moments;
+    for (GroupMap::iterator git = this->groups.begin(); git != this->groups.end(); ++git) {
+      Group& group = git->second;
+      positions.clear();
+      moments.clear();
+      group.moment_sum = 0;
+      group.fixed = true;
+      for (size_t i = 0; i < group.magnets.size(); ++i) {
+        const Magnet& mag = *group.magnets[i];
+        group.fixed = group.fixed && !mag.calculate;
+        positions.push_back(mag.pose.Pos());
+        moments.push_back(mag.pose.Rot().RotateVector(mag.moment));
+        group.moment_sum += mag.moment.Length();
+      }
+      group.aggregate.Build(positions, moments);
+    }
+
+    if (this->periodic) {
+      this->SolvePeriodic();
+      this->pairs_solved = true;
+    } else if (this->exchange && this->point_dipoles && this->SolveRemote()) {
+      this->pairs_solved = true;
+      this->SolveFixedFields(this->magnets);
+    } else if (this->all_pairs && this->point_dipoles) {
+      this->SolveAllPairs();
+      this->pairs_solved = true;
+      this->SolveFixedFields(this->magnets);
+    } else {
+      if (this->cluster_field > 0)
+        this->BuildClusters();
+      if (this->sleep)
+        this->UpdateSleep(time.Double());
+      if (this->cluster_field > 0 && this->task_pool) {
+        this->SolveClusters();
+        this->solved = true;
+      }
+    }
+  }
+
+  /// \brief Put quiet islands to sleep and wake up disturbed ones. The
+  /// islands are the clusters, or all magnets without clustering.
+  void UpdateSleep(double time) {
+    this->sleeping = 0;
+    if (this->cluster_field > 0) {
+      for (size_t c = 0; c < this->clusters.size(); ++c)
+        this->UpdateIsland(this->clusters[c].magnets, time);
+    } else {
+      this->UpdateIsland(this->magnets, time);
+    }
+  }
+
+  /// \brief Move the field sources with their links and apply their
+  /// commands for the step at time
+  void UpdateFieldSources(const common::Time& time) {
+    for (size_t i = 0; i < this->field_sources.size(); ++i) {
+      FieldSource& source = *this->field_sources[i];
+      if (source.update_pose)
+        source.update_pose();
+      source.Update(time);
+    }
+  }
+
+  /// \brief Sum of the fields of the field sources at a point
+  ignition::math::Vector3d GetExternalField(const ignition::math::Vector3d& p) const {
+    ignition::math::Vector3d field(0, 0, 0);
+    for (size_t i = 0; i < this->field_sources.size(); ++i) {
+      ignition::math::Vector3d field_tmp;
+      ignition::math::Matrix3d gradient_tmp;
+      this->field_sources[i]->GetField(p, field_tmp, gradient_tmp);
+      field += field_tmp;
+    }
+    return field;
+  }
+
+  /// \brief Groups a magnet interacts with in the current step
+  const GroupPtrV& GetInteractingGroups(const Magnet& mag) const {
+    if (this->cluster_field > 0 && !this->periodic && mag.cluster < this->clusters.size())
+      return this->clusters[mag.cluster].groups;
+    return this->group_list;
+  }
+
+  /// \brief Split the models into connected components of the graph whose
+  /// edges are the pairs of models that may produce a field above
+  /// cluster_field at each other
+  void BuildClusters() {
+    const size_t n = this->group_list.size();
+
+    // Distance from its center within which a group's field may exceed the
+    // threshold, |B| <= 2e-7 sum|m| / d^3
+    std::vector<double> reach(n);
+    double max_reach = 0;
+    double max_radius = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const Group& group = *this->group_list[i];
+      reach[i] = std::cbrt(2e-7*group.moment_sum/this->cluster_field) + group.aggregate.radius;
+      max_reach = std::max(max_reach, reach[i]);
+      max_radius = std::max(max_radius, group.aggregate.radius);
+    }
+
+    // Sweep along x, only groups that overlap in x can be connected
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+      return this->group_list[a]->aggregate.center.X() < this->group_list[b]->aggregate.center.X();
+    });
+
+    std::vector<size_t> parent(n);
+    std::iota(parent.begin(), parent.end(), 0);
+    std::function<size_t(size_t)> find = [&parent](size_t i) {
+      while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+      }
+      return i;
+    };
+
+    const double window = max_reach + max_radius;
+    for (size_t a = 0; a < n; ++a) {
+      const Multipole& agg_a = this->group_list[order[a]]->aggregate;
+      for (size_t b = a + 1; b < n; ++b) {
+        const Multipole& agg_b = this->group_list[order[b]]->aggregate;
+        if (agg_b.center.X() - agg_a.center.X() > window)
+          break;
+        double dist = agg_a.center.Distance(agg_b.center);
+        if (dist < reach[order[a]] + agg_b.radius || dist < reach[order[b]] + agg_a.radius) {
+          size_t root_a = find(order[a]);
+          size_t root_b = find(order[b]);
+          if (root_a != root_b)
+            parent[root_a] = root_b;
+        }
+      }
+    }
+
+    this->clusters.clear();
+    std::vector<size_t> cluster_of_root(n, n);
+    for (size_t i = 0; i < n; ++i) {
+      size_t root = find(i);
+      if (cluster_of_root[root] == n) {
+        cluster_of_root[root] = this->clusters.size();
+        this->clusters.push_back(Cluster());
+      }
+      Group& group = *this->group_list[i];
+      group.cluster = cluster_of_root[root];
+      Cluster& cluster = this->clusters[group.cluster];
+      cluster.groups.push_back(&group);
+      for (size_t j = 0; j < group.magnets.size(); ++j) {
+        group.magnets[j]->cluster = group.cluster;
+        cluster.magnets.push_back(group.magnets[j]);
+      }
+    }
+  }
+
+  /// \brief Solve every cluster as independent tasks on the task pool.
+  ///
+  /// The cost of a cluster grows with the square of its size. Clusters of
+  /// up to small_cluster magnets are batched into tasks of about that size
+  /// to amortize scheduling. Larger clusters are split into one task per
+  /// thread. Clusters of point dipoles with at least tiled_cluster magnets
+  /// first have their pairs solved by the tiled kernel, so their magnets
+  /// only add the planes and field sources. Tasks are started in order of
+  /// decreasing cost.
+  void SolveClusters() {
+    std::vector<std::pair<double, MagnetPtrV> > batches;
+    MagnetPtrV small;
+    double small_cost = 0;
+    const size_t threads = this->task_pool->GetThreadCount();
+    for (size_t c = 0; c < this->clusters.size(); ++c) {
+      const MagnetPtrV& mags = this->clusters[c].magnets;
+      const double n = static_cast<double>(mags.size());
+      if (this->tiled_cluster > 0 && mags.size() >= this->tiled_cluster &&
+          this->SolveClusterPairs(mags)) {
+        // What is left costs about the same for every magnet
+        size_t chunk = (mags.size() + threads - 1)/threads;
+        for (size_t start = 0; start < mags.size(); start += chunk) {
+          size_t end = std::min(mags.size(), start + chunk);
+          batches.push_back(std::make_pair(static_cast<double>(end - start),
+                MagnetPtrV(mags.begin() + start, mags.begin() + end)));
+        }
+        continue;
+      }
+      if (mags.size() <= this->small_cluster) {
+        small.insert(small.end(), mags.begin(), mags.end());
+        small_cost += n*n;
+        if (small.size() >= this->small_cluster) {
+          batches.push_back(std::make_pair(small_cost, small));
+          small.clear();
+          small_cost = 0;
+        }
+        continue;
+      }
+      size_t chunk = (mags.size() + threads - 1)/threads;
+      for (size_t start = 0; start < mags.size(); start += chunk) {
+        size_t end = std::min(mags.size(), start + chunk);
+        batches.push_back(std::make_pair(n*(end - start),
+              MagnetPtrV(mags.begin() + start, mags.begin() + end)));
+      }
+    }
+    if (!small.empty())
+      batches.push_back(std::make_pair(small_cost, small));
+
+    std::sort(batches.begin(), batches.end(),
+        [](const std::pair<double, MagnetPtrV>& a, const std::pair<double, MagnetPtrV>& b) {
+          return a.first > b.first;
+        });
+    std::vector<TaskPool::Task> tasks;
+    tasks.reserve(batches.size());
+    for (size_t i = 0; i < batches.size(); ++i) {
+      const MagnetPtrV* batch = &batches[i].second;
+      tasks.push_back([batch]() {
+        for (size_t j = 0; j < batch->size(); ++j) {
+          const Magnet& mag = *(*batch)[j];
+          if (mag.solve && !mag.retired && !mag.sleep_state.asleep)
+            (*batch)[j]->solve();
+        }
+      });
+    }
+    this->task_pool->Run(tasks);
   }
 
+  /// \brief Solve the pairs of one cluster with the tiled kernel, the rows
+  /// of tiles split between the threads of the task pool
+  /// \return False if the cluster has finite-size shapes or is asleep
+  bool SolveClusterPairs(const MagnetPtrV& mags) {
+    bool awake = false;
+    for (size_t i = 0; i < mags.size(); ++i) {
+      if (mags[i]->shape.points.size() > 1)
+        return false;
+      awake = awake || !mags[i]->sleep_state.asleep;
+    }
+    if (!awake)
+      return false;
+
+    const size_t n = mags.size();
+    const size_t parts = this->task_pool->GetThreadCount();
+    const size_t tile_size = this->all_pairs ? this->all_pairs->tile_size : 64;
+    if (this->cluster_kernels.size() != parts || this->cluster_kernels[0].tile_size != tile_size)
+      this->cluster_kernels.assign(parts, TiledAllPairs(tile_size));
+    for (size_t k = 0; k < parts; ++k) {
+      TiledAllPairs& kernel = this->cluster_kernels[k];
+      kernel.Resize(n);
+      for (size_t i = 0; i < n; ++i) {
+        const Magnet& mag = *mags[i];
+        ignition::math::Vector3d moment = mag.pose.Rot().RotateVector(mag.moment);
+        kernel.x[i] = mag.pose.Pos().X();
+        kernel.y[i] = mag.pose.Pos().Y();
+        kernel.z[i] = mag.pose.Pos().Z();
+        kernel.mx[i] = moment.X();
+        kernel.my[i] = moment.Y();
+        kernel.mz[i] = moment.Z();
+        kernel.id[i] = mag.model_id;
+      }
+    }
+
+    std::vector<TaskPool::Task> tasks;
+    for (size_t k = 0; k < parts; ++k) {
+      TiledAllPairs* kernel = &this->cluster_kernels[k];
+      tasks.push_back([kernel, k, parts]() { kernel->SolveRows(k, parts); });
+    }
+    this->task_pool->Run(tasks);
+
+    TiledAllPairs& total = this->cluster_kernels[0];
+    for (size_t k = 1; k < parts; ++k) {
+      const TiledAllPairs& part = this->cluster_kernels[k];
+      for (size_t i = 0; i < n; ++i) {
+        total.fx[i] += part.fx[i];
+        total.fy[i] += part.fy[i];
+        total.fz[i] += part.fz[i];
+        total.bx[i] += part.bx[i];
+        total.by[i] += part.by[i];
+        total.bz[i] += part.bz[i];
+      }
+    }
+    total.SolveTorques();
+    for (size_t i = 0; i < n; ++i) {
+      Magnet& mag = *mags[i];
+      mag.field.Set(total.bx[i], total.by[i], total.bz[i]);
+      mag.force.Set(total.fx[i], total.fy[i], total.fz[i]);
+      mag.torque.Set(total.tx[i], total.ty[i], total.tz[i]);
+      mag.pairs_solved = true;
+    }
+    this->SolveFixedFields(mags);
+    return true;
+  }
+
+  /// \brief Set the fixed_field of the calculating magnets among mags to
+  /// the point dipole field of the others among them, if the energy is
+  /// summed
+  void SolveFixedFields(const MagnetPtrV& mags) {
+    if (!this->energy)
+      return;
+    std::vector<const Magnet*> fixed;
+    for (size_t i = 0; i < mags.size(); ++i) {
+      mags[i]->fixed_field.Set(0, 0, 0);
+      if (!mags[i]->calculate)
+        fixed.push_back(mags[i].get());
+    }
+    if (fixed.empty())
+      return;
+    for (size_t i = 0; i < mags.size(); ++i) {
+      Magnet& mag = *mags[i];
+      if (!mag.calculate)
+        continue;
+      for (size_t j = 0; j < fixed.size(); ++j) {
+        const Magnet& other = *fixed[j];
+        ignition::math::Vector3d r = mag.pose.Pos() - other.pose.Pos();
+        if (other.model_id == mag.model_id || r.SquaredLength() == 0)
+          continue;
+        mag.fixed_field += DipoleField(r, other.pose.Rot().RotateVector(other.moment));
+      }
+    }
+  }
+
+  /// \brief Solve all magnets and their periodic images with Ewald summation
+  void SolvePeriodic() {
+    const size_t n = this->magnets.size();
+    std::vector<ignition::math::Vector3d> positions(n);
+    std::vector<ignition::math::Vector3d> moments(n);
+    std::vector<std::uint32_t> ids(n);
+    for (size_t i = 0; i < n; ++i) {
+      const Magnet& mag = *this->magnets[i];
+      positions[i] = mag.pose.Pos();
+      moments[i] = mag.pose.Rot().RotateVector(mag.moment);
+      ids[i] = mag.model_id;
+    }
+
+    std::vector<ignition::math::Vector3d> fields;
+    std::vector<ignition::math::Vector3d> forces;
+    std::vector<ignition::math::Vector3d> torques;
+    this->periodic->Solve(positions, moments, ids, fields, forces, torques);
+    for (size_t i = 0; i < n; ++i) {
+      Magnet& mag = *this->magnets[i];
+      mag.field = fields[i];
+      mag.force = forces[i];
+      mag.torque = torques[i];
+      mag.fixed_field.Set(0, 0, 0);
+    }
+
+    // The field of the magnets that do not calculate, and of their images,
+    // is that of the same lattice with all other moments zero
+    if (!this->energy)
+      return;
+    bool any_fixed = false;
+    for (size_t i = 0; i < n; ++i) {
+      if (this->magnets[i]->calculate)
+        moments[i].Set(0, 0, 0);
+      else
+        any_fixed = true;
+    }
+    if (!any_fixed)
+      return;
+    this->periodic->Solve(positions, moments, ids, fields, forces, torques);
+    for (size_t i = 0; i < n; ++i)
+      this->magnets[i]->fixed_field = fields[i];
+  }
+
+  /// \brief Solve the exact interactions of all magnets with the tiled
+  /// all-pairs kernel
+  void SolveAllPairs() {
+    TiledAllPairs& kernel = *this->all_pairs;
+    const size_t n = this->magnets.size();
+    kernel.Resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      const Magnet& mag = *this->magnets[i];
+      ignition::math::Vector3d moment = mag.pose.Rot().RotateVector(mag.moment);
+      kernel.x[i] = mag.pose.Pos().X();
+      kernel.y[i] = mag.pose.Pos().Y();
+      kernel.z[i] = mag.pose.Pos().Z();
+      kernel.mx[i] = moment.X();
+      kernel.my[i] = moment.Y();
+      kernel.mz[i] = moment.Z();
+      kernel.id[i] = mag.model_id;
+    }
+
+    kernel.Solve();
+    for (size_t i = 0; i < n; ++i) {
+      Magnet& mag = *this->magnets[i];
+      mag.field.Set(kernel.bx[i], kernel.by[i], kernel.bz[i]);
+      mag.force.Set(kernel.fx[i], kernel.fy[i], kernel.fz[i]);
+      mag.torque.Set(kernel.tx[i], kernel.ty[i], kernel.tz[i]);
+    }
+  }
+
+  /// \brief Have the solver process compute the interactions of all
+  /// magnets as point dipoles
+  /// \return False if it did not, the magnets are then solved here
+  bool SolveRemote() {
+    SharedExchange& remote = *this->exchange;
+    const size_t n = this->magnets.size();
+    bool ok = n <= remote.GetCapacity() && remote.IsAttached();
+    if (ok) {
+      for (size_t i = 0; i < n; ++i) {
+        const Magnet& mag = *this->magnets[i];
+        SharedExchange::Slot& slot = remote.slots[i];
+        ignition::math::Vector3d moment = mag.pose.Rot().RotateVector(mag.moment);
+        for (int a = 0; a < 3; ++a) {
+          slot.position[a] = mag.pose.Pos()[a];
+          slot.moment[a] = moment[a];
+        }
+        slot.id = mag.model_id;
+      }
+      remote.header->count = n;
+      ok = remote.Call();
+    }
+
+    if (ok != this->remote_ok) {
+      if (ok)
+        gzmsg << "Magnet solver process took over " << n << " magnets" << std::endl;
+      else if (n > remote.GetCapacity())
+        gzwarn << n << " magnets exceed the solver exchange capacity of "
+            << remote.GetCapacity() << ", solving in process" << std::endl;
+      else
+        gzwarn << "No magnet solver process answered, solving in process" << std::endl;
+      this->remote_ok = ok;
+    }
+    if (!ok)
+      return false;
+
+    for (size_t i = 0; i < n; ++i) {
+      Magnet& mag = *this->magnets[i];
+      const SharedExchange::Slot& slot = remote.slots[i];
+      mag.force.Set(slot.force[0], slot.force[1], slot.force[2]);
+      mag.torque.Set(slot.torque[0], slot.torque[1], slot.torque[2]);
+      mag.field.Set(slot.field[0], slot.field[1], slot.field[2]);
+    }
+    return true;
+  }
+
+  /// \brief Regroup the magnets by owner after magnets were added or removed
+  void RebuildGroups() {
+    for (GroupMap::iterator git = this->groups.begin(); git != this->groups.end(); ++git)
+      git->second.magnets.clear();
+    for (size_t i = 0; i < this->magnets.size(); ++i)
+      this->groups[this->magnets[i]->owner_id].magnets.push_back(this->magnets[i]);
+    this->group_list.clear();
+    for (GroupMap::iterator git = this->groups.begin(); git != this->groups.end();) {
+      if (git->second.magnets.empty()) {
+        this->groups.erase(git++);
+      } else {
+        git->second.owner_id = git->first;
+        this->group_list.push_back(&git->second);
+        ++git;
+      }
+    }
+    this->clusters.clear();
+    this->groups_dirty = false;
+
+    this->point_dipoles = true;
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      if (this->magnets[i]->shape.points.size() > 1)
+        this->point_dipoles = false;
+    }
+
+    if (this->log_level >= LOG_SUMMARY)
+      gzdbg << "Total: " << this->magnets.size() << " magnets in "
+          << this->groups.size() << " models" << std::endl;
+  }
+
+  /// \brief Forget per-step caches, e.g. after the world was reset
+  void Reset() {
+    this->refreshed = false;
+    this->WakeAll(0);
+    if (this->energy)
+      this->energy->Reset();
+    if (this->governor)
+      this->governor->Reset();
+  }
+
+  /// \brief Whether interactions are solved in the current step
+  bool IsUpdateStep() const {
+    return this->update_step;
+  }
+
+  /// \brief Whether the container solved the interactions between magnets
+  /// into their force, torque and field for the current step
+  bool ArePairsSolved() const {
+    return this->pairs_solved;
+  }
+
+  /// \brief Whether the container solved a magnet's interactions with the
+  /// other magnets, with all magnets or with those of its cluster
+  bool ArePairsSolved(const Magnet& mag) const {
+    return this->pairs_solved || mag.pairs_solved;
+  }
+
+  /// \brief Simulation time of the current step, for code running on the
+  /// container's threads, which must not query the world
+  const common::Time& GetStepTime() const {
+    return this->step_time;
+  }
+
+  /// \brief Whether no magnet has a finite-size shape
+  bool ArePointDipoles() const {
+    return this->point_dipoles;
+  }
+
+  /// \brief Monotonic time in seconds at which the current step started
+  double GetStepStart() const {
+    return this->step_start;
+  }
+
+  /// \brief Whether the container already called every magnet's solve in
+  /// the current step
+  bool IsSolved() const {
+    return this->solved;
+  }
+
+  /// \brief Take a snapshot of the magnets and field sources
+  /// \param[out] checkpoint Snapshot
+  void Save(Checkpoint& checkpoint) const {
+    checkpoint.magnets.resize(this->magnets.size());
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      const Magnet& mag = *this->magnets[i];
+      MagnetState& state = checkpoint.magnets[i];
+      state.model_id = mag.model_id;
+      state.moment = mag.moment;
+    }
+    checkpoint.field_sources.resize(this->field_sources.size());
+    for (size_t i = 0; i < this->field_sources.size(); ++i)
+      checkpoint.field_sources[i] = this->field_sources[i]->SaveState();
+    checkpoint.induction_iterations = this->induction_iterations;
+  }
+
+  /// \brief Restore a snapshot taken with Save. Magnets are matched by
+  /// model id, since removals reorder the magnets.
+  ///
+  /// Only the moments, induced ones included, and the field sources are
+  /// rewound. Poses come from the links at the next step, which then solves
+  /// the wrenches and fields anew. The plugins' held wrenches follow from
+  /// that step once the governor and the energy monitor are reset, which is
+  /// left to the caller.
+  /// \param[in] checkpoint Snapshot
+  /// \return False, leaving the container untouched, if magnets or field
+  /// sources were added or removed since the snapshot was taken
+  bool Restore(const Checkpoint& checkpoint) {
+    if (checkpoint.magnets.size() != this->magnets.size() ||
+        checkpoint.field_sources.size() != this->field_sources.size())
+      return false;
+    std::multimap<std::uint32_t, size_t> saved;
+    for (size_t i = 0; i < checkpoint.magnets.size(); ++i)
+      saved.insert(std::make_pair(checkpoint.magnets[i].model_id, i));
+    std::vector<size_t> match(this->magnets.size());
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      std::multimap<std::uint32_t, size_t>::iterator it = saved.find(this->magnets[i]->model_id);
+      if (it == saved.end())
+        return false;
+      match[i] = it->second;
+      saved.erase(it);
+    }
+
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      Magnet& mag = *this->magnets[i];
+      const MagnetState& state = checkpoint.magnets[match[i]];
+      mag.moment = state.moment;
+    }
+    for (size_t i = 0; i < this->field_sources.size(); ++i)
+      this->field_sources[i]->RestoreState(checkpoint.field_sources[i]);
+    this->induction_iterations = checkpoint.induction_iterations;
+
+    // Aggregates and solved wrenches are rebuilt at the next step
+    this->refreshed = false;
+    this->WakeAll(this->refresh_time);
+    return true;
+  }
+
+  /// \brief Solve the induced moments of all soft magnetic bodies
+  ///
+  /// Jacobi iteration on m_i = a_i (B_ext(p_i) + sum_j D_ij m_j), where
+  /// B_ext is the field of the permanent magnets and field sources. The iteration is warm
+  /// started from the moments of the previous step so a slowly moving scene
+  /// converges in one or two sweeps.
+  void SolveInduced() {
+    std::vector<Magnet*> soft;
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      if (this->magnets[i]->polarizability > 0)
+        soft.push_back(this->magnets[i].get());
+    }
+    this->induction_iterations = 0;
+    if (soft.empty())
+      return;
+
+    const size_t n = soft.size();
+    std::vector<ignition::math::Vector3d> b_ext(n);
+    std::vector<ignition::math::Vector3d> m(n);
+    std::vector<ignition::math::Vector3d> m_next(n);
+    for (size_t i = 0; i < n; ++i) {
+      const ignition::math::Vector3d& p = soft[i]->pose.Pos();
+      for (size_t j = 0; j < this->magnets.size(); ++j) {
+        const Magnet& other = *this->magnets[j];
+        ignition::math::Vector3d r = p - other.pose.Pos();
+        if (other.polarizability > 0 || r.SquaredLength() == 0)
+          continue;
+        b_ext[i] += DipoleField(r, other.pose.Rot().RotateVector(other.moment));
+      }
+      for (size_t j = 0; j < this->field_sources.size(); ++j) {
+        ignition::math::Vector3d field;
+        ignition::math::Matrix3d gradient;
+        this->field_sources[j]->GetField(p, field, gradient);
+        b_ext[i] += field;
+      }
+      m[i] = soft[i]->pose.Rot().RotateVector(soft[i]->moment);
+    }
+
+    for (int k = 0; k < this->induction_max_iterations; ++k) {
+      double delta = 0;
+      double scale = 0;
+      for (size_t i = 0; i < n; ++i) {
+        const ignition::math::Vector3d& p = soft[i]->pose.Pos();
+        ignition::math::Vector3d B = b_ext[i];
+        for (size_t j = 0; j < n; ++j) {
+          ignition::math::Vector3d r = p - soft[j]->pose.Pos();
+          if (j == i || r.SquaredLength() == 0)
+            continue;
+          B += DipoleField(r, m[j]);
+        }
+        m_next[i] = B*soft[i]->polarizability;
+        delta = std::max(delta, (m_next[i] - m[i]).Length());
+        scale = std::max(scale, m_next[i].Length());
+      }
+      m.swap(m_next);
+      this->induction_iterations = k + 1;
+      if (delta <= this->induction_tolerance*scale)
+        break;
+    }
+
+    // Moments are stored in the body frame like those of permanent magnets
+    for (size_t i = 0; i < n; ++i)
+      soft[i]->moment = soft[i]->pose.Rot().RotateVectorReverse(m[i]);
+  }
+
+  /// \brief Magnets of the current step. Registrations made during a step
+  /// show up here at the start of the next one, so a magnet removed during
+  /// a step stays valid until then.
   MagnetPtrV magnets;
+  /// \brief Magnets grouped by owning model id
+  GroupMap groups;
+  /// \brief Ferromagnetic boundaries acting on every magnet through images
+  FerromagneticPlaneV planes;
+  /// \brief External field sources acting on every magnet
+  FieldSourcePtrV field_sources;
+  /// \brief Set to make the magnets periodic, solved with Ewald summation
+  std::shared_ptr<EwaldSolver> periodic;
+  /// \brief Set to solve all pairs of magnets exactly with a tiled kernel,
+  /// when all magnets are point dipoles
+  std::shared_ptr<TiledAllPairs> all_pairs;
+  /// \brief Set to adapt the solver accuracy to a time budget per step
+  std::shared_ptr<QualityGovernor> governor;
+  /// \brief Set to sum the magnetic energy and power of every step
+  std::shared_ptr<EnergyMonitor> energy;
+  /// \brief Set to put islands of magnets at rest to sleep. Not used with
+  /// periodic magnets, the all-pairs kernel or the solver process, which
+  /// solve all magnets at once.
+  std::shared_ptr<IslandSleep> sleep;
+  /// \brief Set to have a solver process compute the interactions between
+  /// magnets, when all magnets are point dipoles
+  std::shared_ptr<SharedExchange> exchange;
+
+  /// \brief Relative change of the induced moments at which the solve stops
+  double induction_tolerance;
+  /// \brief Maximum number of sweeps of the induced moment solve
+  int induction_max_iterations;
+  /// \brief Number of sweeps used by the last induced moment solve
+  int induction_iterations;
+  /// \brief Models that cannot produce a field above this at each other,
+  /// in T, are put in different clusters. 0 disables clustering.
+  double cluster_field;
+  /// \brief Set to solve clusters in parallel at the start of each step
+  std::shared_ptr<TaskPool> task_pool;
+  /// \brief Clusters up to this many magnets are batched into one task
+  size_t small_cluster;
+  /// \brief Clusters of point dipoles with at least this many magnets have
+  /// their pairs solved exactly by the tiled kernel on all threads. 0
+  /// leaves every cluster to the magnets' own loops.
+  size_t tiled_cluster;
+  /// \brief All groups, in the order of groups
+  GroupPtrV group_list;
+  /// \brief Clusters of the current step
+  std::vector<Cluster> clusters;
+  /// \brief Number of magnets asleep in the current step
+  size_t sleeping;
+
+  /// \brief Amount of registration logging
+  LogLevel log_level;
+
+ private:
+  std::uint64_t last_refresh;
+  /// \brief Monotonic time at which the current step was refreshed
+  double step_start;
+  /// \brief Simulation time of the current step
+  double refresh_time;
+  common::Time step_time;
+  bool refreshed;
+  /// \brief Set when groups no longer match magnets
+  bool groups_dirty;
+  bool update_step;
+  bool solved;
+  bool pairs_solved;
+  /// \brief Whether no magnet has a finite-size shape
+  bool point_dipoles;
+
+  /// \brief Update the sleep of one island. It sleeps once all of its
+  /// magnets have been quiet for long enough, and wakes up as a whole.
+  void UpdateIsland(const MagnetPtrV& mags, double time) {
+    const IslandSleep& sleep = *this->sleep;
+    bool quiet = true;
+    bool awake = false;
+    for (size_t i = 0; i < mags.size(); ++i) {
+      const Magnet& mag = *mags[i];
+      SleepState& state = mags[i]->sleep_state;
+      if (state.asleep) {
+        if (quiet && sleep.IsDisturbed(state, mag.pose, mag.moment,
+              this->GetExternalField(mag.pose.Pos())))
+          quiet = false;
+        continue;
+      }
+      awake = true;
+      if (!sleep.IsQuiet(state, mag.calculate))
+        state.quiet_since = time;
+      if (time - state.quiet_since < sleep.sleep_time)
+        quiet = false;
+    }
+
+    if (quiet && awake) {
+      for (size_t i = 0; i < mags.size(); ++i) {
+        const Magnet& mag = *mags[i];
+        if (!mag.sleep_state.asleep) {
+          sleep.Sleep(mags[i]->sleep_state, mag.pose, mag.moment,
+              this->GetExternalField(mag.pose.Pos()));
+        }
+      }
+      if (this->log_level >= LOG_VERBOSE)
+        gzdbg << "Island of " << mags.size() << " magnets fell asleep\n";
+    } else if (!quiet) {
+      size_t woken = 0;
+      for (size_t i = 0; i < mags.size(); ++i) {
+        if (mags[i]->sleep_state.asleep) {
+          IslandSleep::Wake(mags[i]->sleep_state, time);
+          ++woken;
+        }
+      }
+      if (woken > 0 && this->log_level >= LOG_VERBOSE)
+        gzdbg << "Island of " << mags.size() << " magnets woke up\n";
+    }
+    if (quiet)
+      this->sleeping += mags.size();
+  }
+
+  /// \brief Wake up every magnet, e.g. after its state was overwritten
+  void WakeAll(double time) {
+    this->sleeping = 0;
+    for (size_t i = 0; i < this->magnets.size(); ++i)
+      IslandSleep::Wake(this->magnets[i]->sleep_state, time);
+  }
+
+  /// \brief A registration or removal waiting for the next step
+  struct Registration {
+    Registration(const MagnetPtr& _magnet, bool _add) : magnet(_magnet), add(_add) {
+    }
+    MagnetPtr magnet;
+    bool add;
+  };
+
+  /// \brief Serializes writers. Steps only take it to collect the changes.
+  boost::mutex registration_lock;
+  /// \brief Changes made since the last step, and those being applied
+  std::vector<Registration> pending;
+  std::vector<Registration> applying;
+  /// \brief Counts calls that changed pending
+  std::atomic<std::uint64_t> version;
+  /// \brief Version applied to magnets
+  std::uint64_t synced_version;
+  /// \brief Whether the last step was solved by the solver process
+  bool remote_ok;
+  /// \brief One copy of a large cluster per thread of the task pool
+  std::vector<TiledAllPairs> cluster_kernels;
 };
 }  // namespace gazebo
 
@@ -27,9 +27,11 @@
 #include <geometry_msgs/WrenchStamped.h>
 #include <sensor_msgs/MagneticField.h>
 
+#include <functional>
 #include <memory>
 
 #include "storm_gazebo_ros_magnet/dipole_magnet_container.h"
+#include "storm_gazebo_ros_magnet/interaction_kernel.h"
 
 namespace gazebo {
 
@@ -54,6 +56,12 @@ class DipoleMagnetPair : public ModelPlugin {
   /// \brief Called by the world update start event
   void OnUpdate(const common::UpdateInfo & /*_info*/);
 
+  /// \brief Bind kernel to the interaction model
+  template <class Model>
+  void SelectKernel(const Model& model) {
+    this->kernel = InteractionKernel<Model, OUTPUT_FORCE | OUTPUT_TORQUE | OUTPUT_FIELD>(model);
+  }
+
 
   /// \brief Publishes data to ros topics
   /// \pram[in] force A vector of force that makes up the wrench to be published
@@ -64,27 +72,6 @@ class DipoleMagnetPair : public ModelPlugin {
       const ignition::math::Vector3d& torque,
       const ignition::math::Vector3d& mfs);
 
-  /// \brief Calculate force and torque of a magnet on another
-  /// \parama[in] p_self Pose of the first magnet
-  /// \parama[in] m_self Dipole moment of the first magnet
-  /// \parama[in] p_other Pose of the second magnet
-  /// \parama[in] m_other Dipole moment of the second magnet on which the force is calculated
-  /// \param[out] force Calculated force vector
-  /// \param[out] torque Calculated torque vector
-  void GetForceTorque(const ignition::math::Pose3d& p_self,  const ignition::math::Vector3d& m_self,
-      const ignition::math::Pose3d& p_other, const ignition::math::Vector3d& m_other,
-      ignition::math::Vector3d& force, ignition::math::Vector3d& torque);
-
-  /// \brief Calculate the magnetic field on all 6 sensors
-  /// \parama[in] p_self Pose of the first magnet
-  /// \parama[in] p_other Pose of the second magnet
-  /// \parama[in] m_other Dipole moment of the second magnet
-  /// \param[out] mfs magnetic field sensors
-  void GetMFS(const ignition::math::Pose3d& p_self,
-      const ignition::math::Pose3d& p_other,
-      const ignition::math::Vector3d& m_other,
-      ignition::math::Vector3d& mfs);
-
   // Pointer to the model
  private:
   physics::ModelPtr model;
@@ -99,6 +86,11 @@ class DipoleMagnetPair : public ModelPlugin {
   std::string topic_ns;
   std::uint32_t low_id;
 
+  /// \brief Interaction between the two magnets, chosen at load
+  std::function<void(const ignition::math::Vector3d&, const ignition::math::Vector3d&,
+      const ignition::math::Vector3d&, const ignition::math::Vector3d&,
+      Interaction&)> kernel;
+
   bool should_publish;
   ros::NodeHandle* rosnode;
   ros::Publisher wrench_pub;
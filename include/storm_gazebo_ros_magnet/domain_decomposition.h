@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_DOMAIN_DECOMPOSITION_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_DOMAIN_DECOMPOSITION_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <ignition/math/Matrix3.hh>
+#include <ignition/math/Vector3.hh>
+
+#include "storm_gazebo_ros_magnet/multipole.h"
+#include "storm_gazebo_ros_magnet/shared_exchange.h"
+#include "storm_gazebo_ros_magnet/task_pool.h"
+
+namespace gazebo {
+
+/// \brief One worker's share of a request that several worker processes
+/// solve together through a SharedExchange.
+///
+/// Every worker bisects the magnets recursively along the longest side of
+/// their bounding box into one spatial domain per worker. Ties are broken
+/// by slot, so all workers arrive at the same domains without talking to
+/// each other. Each worker then bisects its own domain further into a tree
+/// of cells of at most leaf_size magnets, and writes its magnets in tree
+/// order and the multipole of every cell into the exchange. After all
+/// workers have done so, each one walks the trees of all domains for every
+/// leaf of its own. Cells that are well separated from the leaf act
+/// through their multipole. The magnets of the remaining leaves, the halo,
+/// are read from the other workers' points and summed exactly. Magnets with
+/// equal ids do not interact: they are skipped in the exact sum, and their
+/// exact terms are taken back out of the multipoles that contain them. The
+/// outputs go straight into the slots of the worker's magnets.
+class DomainSolver {
+ public:
+  /// \param[in] _rank Index of this worker
+  /// \param[in] _pool Threads that solve the leaves of the domain, or NULL
+  DomainSolver(size_t _rank, TaskPool* _pool) : rank(_rank), pool(_pool) {
+  }
+
+  /// \brief Solve this worker's share of a request
+  /// \return False if the request was abandoned by another worker
+  bool Solve(SharedExchange& exchange, size_t count) {
+    const SharedExchange::Header& header = *exchange.header;
+    const size_t workers = header.workers;
+    this->leaf_size = header.leaf_size;
+    this->far_field_ratio = header.far_field_ratio;
+    this->slots = exchange.slots;
+
+    this->order.resize(count);
+    for (size_t i = 0; i < count; ++i)
+      this->order[i] = i;
+    this->domain_begin.assign(workers + 1, count);
+    this->Partition(0, count, 0, workers);
+
+    // Each domain's tree takes at most 4 n/leaf_size + 1 cells
+    this->cell_begin.assign(workers + 1, 0);
+    for (size_t r = 0; r < workers; ++r) {
+      size_t n = this->domain_begin[r + 1] - this->domain_begin[r];
+      this->cell_begin[r + 1] = this->cell_begin[r] + (n > 0 ? 4*n/this->leaf_size + 1 : 0);
+    }
+
+    this->points = exchange.points;
+    this->cells = exchange.cells;
+    size_t next_cell = this->cell_begin[this->rank];
+    if (this->domain_begin[this->rank] < this->domain_begin[this->rank + 1]) {
+      this->Build(this->domain_begin[this->rank], this->domain_begin[this->rank + 1],
+          next_cell);
+    }
+    if (!exchange.Synchronize())
+      return false;
+
+    // Multipoles of all cells, in the form the kernel evaluates
+    const size_t cell_count = this->cell_begin[workers];
+    this->multipoles.resize(cell_count);
+    for (size_t r = 0; r < workers; ++r) {
+      size_t n = this->domain_begin[r + 1] - this->domain_begin[r];
+      size_t used = n > 0 ? this->CountCells(this->cell_begin[r]) : 0;
+      for (size_t c = this->cell_begin[r]; c < this->cell_begin[r] + used; ++c)
+        this->LoadMultipole(this->cells[c], this->multipoles[c]);
+    }
+    this->GroupIds(count);
+
+    std::vector<TaskPool::Task> tasks;
+    for (size_t c = this->cell_begin[this->rank]; c < next_cell; ++c) {
+      if (this->cells[c].child[0] < 0)
+        tasks.push_back([this, c, workers]() { this->SolveLeaf(c, workers); });
+    }
+    if (this->pool) {
+      this->pool->Run(tasks);
+    } else {
+      for (size_t i = 0; i < tasks.size(); ++i)
+        tasks[i]();
+    }
+    return true;
+  }
+
+ private:
+  /// \brief Split the magnets order[begin, end) between workers [r0, r1)
+  void Partition(size_t begin, size_t end, size_t r0, size_t r1) {
+    if (r1 - r0 == 1) {
+      this->domain_begin[r0] = begin;
+      return;
+    }
+    size_t r_mid = r0 + (r1 - r0)/2;
+    size_t mid = begin + (end - begin)*(r_mid - r0)/(r1 - r0);
+    this->Split(begin, end, mid);
+    this->Partition(begin, mid, r0, r_mid);
+    this->Partition(mid, end, r_mid, r1);
+  }
+
+  /// \brief Reorder order[begin, end) so that the first mid - begin
+  /// magnets are the lowest along the longest side of their bounding box
+  void Split(size_t begin, size_t end, size_t mid) {
+    if (mid <= begin || mid >= end)
+      return;
+    double lo[3], hi[3];
+    for (int a = 0; a < 3; ++a) {
+      lo[a] = this->slots[this->order[begin]].position[a];
+      hi[a] = lo[a];
+    }
+    for (size_t i = begin + 1; i < end; ++i) {
+      const double* p = this->slots[this->order[i]].position;
+      for (int a = 0; a < 3; ++a) {
+        lo[a] = std::min(lo[a], p[a]);
+        hi[a] = std::max(hi[a], p[a]);
+      }
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; ++a) {
+      if (hi[a] - lo[a] > hi[axis] - lo[axis])
+        axis = a;
+    }
+
+    const SharedExchange::Slot* s = this->slots;
+    std::nth_element(this->order.begin() + begin, this->order.begin() + mid,
+        this->order.begin() + end, [s, axis](std::uint32_t a, std::uint32_t b) {
+          double pa = s[a].position[axis];
+          double pb = s[b].position[axis];
+          return pa < pb || (pa == pb && a < b);
+        });
+  }
+
+  /// \brief Build the cell of order[begin, end) and its subtree, writing
+  /// the points of leaves as they are completed
+  /// \return Index of the cell
+  std::int32_t Build(size_t begin, size_t end, size_t& next_cell) {
+    const std::int32_t index = next_cell++;
+    SharedExchange::Cell& cell = this->cells[index];
+    cell.begin = begin;
+    cell.end = end;
+    if (end - begin > this->leaf_size) {
+      size_t mid = begin + (end - begin)/2;
+      this->Split(begin, end, mid);
+      cell.child[0] = this->Build(begin, mid, next_cell);
+      cell.child[1] = this->Build(mid, end, next_cell);
+    } else {
+      cell.child[0] = -1;
+      cell.child[1] = -1;
+      for (size_t i = begin; i < end; ++i) {
+        const SharedExchange::Slot& slot = this->slots[this->order[i]];
+        SharedExchange::Point& point = this->points[i];
+        for (int a = 0; a < 3; ++a) {
+          point.position[a] = slot.position[a];
+          point.moment[a] = slot.moment[a];
+        }
+        point.id = slot.id;
+        point.slot = this->order[i];
+      }
+    }
+
+    std::vector<ignition::math::Vector3d> positions(end - begin);
+    std::vector<ignition::math::Vector3d> moments(end - begin);
+    cell.id_min = this->points[begin].id;
+    cell.id_max = cell.id_min;
+    for (size_t i = begin; i < end; ++i) {
+      const SharedExchange::Point& point = this->points[i];
+      positions[i - begin].Set(point.position[0], point.position[1], point.position[2]);
+      moments[i - begin].Set(point.moment[0], point.moment[1], point.moment[2]);
+      cell.id_min = std::min(cell.id_min, point.id);
+      cell.id_max = std::max(cell.id_max, point.id);
+    }
+    Multipole multipole;
+    multipole.Build(positions, moments);
+    for (int a = 0; a < 3; ++a) {
+      cell.center[a] = multipole.center[a];
+      cell.dipole[a] = multipole.dipole[a];
+    }
+    const ignition::math::Matrix3d& q = multipole.quadrupole;
+    cell.quadrupole[0] = q(0, 0);
+    cell.quadrupole[1] = q(0, 1);
+    cell.quadrupole[2] = q(0, 2);
+    cell.quadrupole[3] = q(1, 1);
+    cell.quadrupole[4] = q(1, 2);
+    cell.quadrupole[5] = q(2, 2);
+    cell.radius = multipole.radius;
+    return index;
+  }
+
+  /// \brief Number of cells in the tree rooted at a cell
+  size_t CountCells(size_t root) const {
+    const SharedExchange::Cell& cell = this->cells[root];
+    if (cell.child[0] < 0)
+      return 1;
+    return 1 + this->CountCells(cell.child[0]) + this->CountCells(cell.child[1]);
+  }
+
+  static void LoadMultipole(const SharedExchange::Cell& cell, Multipole& multipole) {
+    multipole.center.Set(cell.center[0], cell.center[1], cell.center[2]);
+    multipole.dipole.Set(cell.dipole[0], cell.dipole[1], cell.dipole[2]);
+    // Index of each element in the upper triangle
+    static const int kUpper[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+    for (int a = 0; a < 3; ++a)
+      for (int b = 0; b < 3; ++b)
+        multipole.quadrupole(a, b) = cell.quadrupole[kUpper[a][b]];
+    multipole.radius = cell.radius;
+  }
+
+  /// \brief Points of every id that more than one magnet carries, in
+  /// point order, so that the members of a group within a cell are one range
+  void GroupIds(size_t count) {
+    std::vector<std::uint32_t> by_id(count);
+    for (size_t i = 0; i < count; ++i)
+      by_id[i] = i;
+    const SharedExchange::Point* p = this->points;
+    std::sort(by_id.begin(), by_id.end(), [p](std::uint32_t a, std::uint32_t b) {
+      return p[a].id < p[b].id || (p[a].id == p[b].id && a < b);
+    });
+
+    this->group_points.clear();
+    this->group_of.assign(count, -1);
+    this->group_begin.assign(1, 0);
+    for (size_t i = 0; i < count;) {
+      size_t end = i + 1;
+      while (end < count && p[by_id[end]].id == p[by_id[i]].id)
+        ++end;
+      if (end - i > 1) {
+        for (size_t k = i; k < end; ++k) {
+          this->group_of[by_id[k]] = this->group_begin.size() - 1;
+          this->group_points.push_back(by_id[k]);
+        }
+        this->group_begin.push_back(this->group_points.size());
+      }
+      i = end;
+    }
+  }
+
+  /// \brief Whether two cells are far enough apart to interact through
+  /// their multipoles
+  bool IsFar(const SharedExchange::Cell& a, const SharedExchange::Cell& b) const {
+    if (this->far_field_ratio <= 0)
+      return false;
+    double d2 = 0;
+    for (int k = 0; k < 3; ++k)
+      d2 += (a.center[k] - b.center[k])*(a.center[k] - b.center[k]);
+    double reach = this->far_field_ratio*(a.radius + b.radius);
+    return d2 > reach*reach;
+  }
+
+  /// \brief Outputs of the magnets of one leaf of this worker's domain
+  void SolveLeaf(size_t leaf, size_t workers) {
+    const SharedExchange::Cell& target = this->cells[leaf];
+    const size_t n = target.end - target.begin;
+    std::vector<double> force(3*n, 0.0);
+    std::vector<double> field(3*n, 0.0);
+
+    std::vector<size_t> stack;
+    for (size_t r = 0; r < workers; ++r) {
+      if (this->domain_begin[r] < this->domain_begin[r + 1])
+        stack.push_back(this->cell_begin[r]);
+    }
+    while (!stack.empty()) {
+      size_t c = stack.back();
+      stack.pop_back();
+      const SharedExchange::Cell& source = this->cells[c];
+      if (this->IsFar(target, source)) {
+        this->AddFar(target, this->multipoles[c], force, field);
+        if (!(target.id_max < source.id_min || source.id_max < target.id_min))
+          this->RemoveSameId(target, source, force, field);
+      } else if (source.child[0] < 0) {
+        this->AddNear(target, source, force, field);
+      } else {
+        stack.push_back(source.child[0]);
+        stack.push_back(source.child[1]);
+      }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      const SharedExchange::Point& point = this->points[target.begin + i];
+      SharedExchange::Slot& slot = this->slots[point.slot];
+      const double* m = point.moment;
+      const double* b = &field[3*i];
+      for (int a = 0; a < 3; ++a) {
+        slot.force[a] = force[3*i + a];
+        slot.field[a] = b[a];
+      }
+      // The torque on a dipole is its moment crossed with the total field
+      slot.torque[0] = m[1]*b[2] - m[2]*b[1];
+      slot.torque[1] = m[2]*b[0] - m[0]*b[2];
+      slot.torque[2] = m[0]*b[1] - m[1]*b[0];
+    }
+  }
+
+  /// \brief Add the multipole of a far cell to the magnets of a leaf
+  void AddFar(const SharedExchange::Cell& target, const Multipole& source,
+      std::vector<double>& force, std::vector<double>& field) const {
+    ignition::math::Vector3d f, t, b;
+    for (size_t i = target.begin; i < target.end; ++i) {
+      const SharedExchange::Point& point = this->points[i];
+      ignition::math::Vector3d p(point.position[0], point.position[1], point.position[2]);
+      ignition::math::Vector3d m(point.moment[0], point.moment[1], point.moment[2]);
+      source.GetForceTorque(p, m, f, t, b);
+      const size_t k = 3*(i - target.begin);
+      for (int a = 0; a < 3; ++a) {
+        force[k + a] += f[a];
+        field[k + a] += b[a];
+      }
+    }
+  }
+
+  /// \brief Take the exact terms of the magnets of a far cell that share
+  /// an id with a magnet of the leaf back out of that magnet's outputs
+  void RemoveSameId(const SharedExchange::Cell& target, const SharedExchange::Cell& source,
+      std::vector<double>& force, std::vector<double>& field) const {
+    for (size_t i = target.begin; i < target.end; ++i) {
+      const std::int32_t group = this->group_of[i];
+      if (group < 0)
+        continue;
+      std::vector<std::uint32_t>::const_iterator first = this->group_points.begin() +
+          this->group_begin[group];
+      std::vector<std::uint32_t>::const_iterator last = this->group_points.begin() +
+          this->group_begin[group + 1];
+      first = std::lower_bound(first, last, source.begin);
+      double f[3] = {0, 0, 0};
+      double b[3] = {0, 0, 0};
+      for (; first != last && *first < source.end; ++first)
+        AddPair(this->points[i], this->points[*first], -1.0, f, b);
+      const size_t k = 3*(i - target.begin);
+      for (int a = 0; a < 3; ++a) {
+        force[k + a] += f[a];
+        field[k + a] += b[a];
+      }
+    }
+  }
+
+  /// \brief Add the force and field of one magnet on another, times a
+  /// weight. The terms are those of TiledAllPairs, applied to the target
+  /// only. Coincident magnets are skipped.
+  static void AddPair(const SharedExchange::Point& pi, const SharedExchange::Point& pj,
+      double weight, double f[3], double b[3]) {
+    const double* mi = pi.moment;
+    const double* mj = pj.moment;
+    const double r[3] = {pi.position[0] - pj.position[0],
+        pi.position[1] - pj.position[1], pi.position[2] - pj.position[2]};
+    const double r2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+    const bool skip = r2 == 0;
+    const double ir2 = 1.0/(skip ? 1.0 : r2);
+    const double scale = skip ? 0.0 : weight*1e-7*ir2*std::sqrt(ir2);
+
+    const double mir = mi[0]*r[0] + mi[1]*r[1] + mi[2]*r[2];
+    const double mjr = mj[0]*r[0] + mj[1]*r[1] + mj[2]*r[2];
+    const double mimj = mi[0]*mj[0] + mi[1]*mj[1] + mi[2]*mj[2];
+    const double ci = 3*mjr*ir2;
+    const double cf = mimj - 5*mir*mjr*ir2;
+    const double sf = 3*scale*ir2;
+    for (int a = 0; a < 3; ++a) {
+      f[a] += (mi[a]*mjr + mj[a]*mir + r[a]*cf)*sf;
+      b[a] += (r[a]*ci - mj[a])*scale;
+    }
+  }
+
+  /// \brief Add every magnet of a near leaf to the magnets of a leaf,
+  /// except those with the same id
+  void AddNear(const SharedExchange::Cell& target, const SharedExchange::Cell& source,
+      std::vector<double>& force, std::vector<double>& field) const {
+    for (size_t i = target.begin; i < target.end; ++i) {
+      const SharedExchange::Point& pi = this->points[i];
+      double f[3] = {0, 0, 0};
+      double b[3] = {0, 0, 0};
+      for (size_t j = source.begin; j < source.end; ++j) {
+        const SharedExchange::Point& pj = this->points[j];
+        AddPair(pi, pj, pi.id == pj.id ? 0.0 : 1.0, f, b);
+      }
+      const size_t k = 3*(i - target.begin);
+      for (int a = 0; a < 3; ++a) {
+        force[k + a] += f[a];
+        field[k + a] += b[a];
+      }
+    }
+  }
+
+  const size_t rank;
+  TaskPool* pool;
+  size_t leaf_size;
+  double far_field_ratio;
+  SharedExchange::Slot* slots;
+  SharedExchange::Point* points;
+  SharedExchange::Cell* cells;
+  /// \brief Slots in domain order, only the own domain in tree order
+  std::vector<std::uint32_t> order;
+  /// \brief First point and first cell of each domain
+  std::vector<size_t> domain_begin;
+  std::vector<size_t> cell_begin;
+  std::vector<Multipole> multipoles;
+  /// \brief Groups of points with a shared id, and the group of each
+  /// point or -1
+  std::vector<std::uint32_t> group_points;
+  std::vector<size_t> group_begin;
+  std::vector<std::int32_t> group_of;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_DOMAIN_DECOMPOSITION_H_
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ELECTROMAGNET_COIL_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ELECTROMAGNET_COIL_H_
+
+
+#include <gazebo/gazebo.hh>
+#include <gazebo/physics/physics.hh>
+#include <gazebo/common/common.hh>
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <std_msgs/Float64.h>
+
+#include <memory>
+
+#include "storm_gazebo_ros_magnet/coil_field.h"
+
+namespace gazebo {
+
+/// \brief Model plugin adding the field of an electromagnet coil attached to
+/// a link. The coil acts on every DipoleMagnet through the container.
+class ElectromagnetCoil : public ModelPlugin {
+ public:
+  ElectromagnetCoil();
+
+  ~ElectromagnetCoil();
+
+  /// \brief Loads the plugin
+  void Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf);
+
+  /// \brief Restores the loaded current
+  void Reset();
+
+  /// \brief Thread to interact with ROS
+  void QueueThread();
+
+  /// \brief Callback for current commands
+  void OnCurrent(const std_msgs::Float64::ConstPtr& msg);
+
+ private:
+  physics::ModelPtr model;
+  physics::LinkPtr link;
+
+  std::shared_ptr<CoilField> coil;
+  /// \brief Container of the magnets in this model's world
+  std::shared_ptr<DipoleMagnetContainer> container;
+  /// \brief Current as loaded, restored on reset
+  double initial_current;
+
+  std::string link_name;
+  std::string robot_namespace;
+  std::string topic_ns;
+  /// \brief Pose of the coil frame in the link frame
+  ignition::math::Pose3d offset;
+
+  ros::NodeHandle* rosnode;
+  ros::Subscriber current_sub;
+
+  // Custom Callback Queue
+  ros::CallbackQueue queue;
+  boost::thread callback_queue_thread;
+};
+
+}
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ELECTROMAGNET_COIL_H_
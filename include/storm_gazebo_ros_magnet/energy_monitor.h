@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ENERGY_MONITOR_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ENERGY_MONITOR_H_
+
+#include <algorithm>
+#include <cmath>
+
+namespace gazebo {
+
+/// \brief Balance of the magnetic energy against the work the magnetic
+/// wrenches do on the links.
+///
+/// For static sources the magnetic forces are conservative, so the energy
+/// plus the work done stays constant. The work is integrated from the
+/// power with the trapezoidal rule. A drift that grows over a run means the
+/// time step does not resolve the motion of the magnets.
+class EnergyMonitor {
+ public:
+  EnergyMonitor() : drift_tolerance(0.05) {
+    this->Reset();
+  }
+
+  /// \brief Forget the history, e.g. after a world reset
+  void Reset() {
+    this->step_energy = 0;
+    this->step_power = 0;
+    this->energy = 0;
+    this->power = 0;
+    this->work = 0;
+    this->drift = 0;
+    this->initial_energy = 0;
+    this->min_energy = 0;
+    this->max_energy = 0;
+    this->last_time = 0;
+    this->steps = 0;
+    this->pending = false;
+    this->warned = false;
+  }
+
+  /// \brief Add the share of a magnet in the current step
+  /// \param[in] _energy Interaction energy of the magnet, with pairs of
+  /// magnets split between them
+  /// \param[in] _power Power of the wrench applied to the magnet's link
+  void Add(double _energy, double _power) {
+    this->step_energy += _energy;
+    this->step_power += _power;
+    this->pending = true;
+  }
+
+  /// \brief Close the step whose shares were added. Steps in which no
+  /// magnet added a share are ignored.
+  /// \param[in] time Simulation time of that step in seconds
+  /// \return True the first time the relative drift exceeds the tolerance
+  bool EndStep(double time) {
+    if (!this->pending)
+      return false;
+    this->pending = false;
+    if (this->steps > 0) {
+      this->work += 0.5*(this->power + this->step_power)*(time - this->last_time);
+    } else {
+      this->initial_energy = this->step_energy;
+      this->min_energy = this->step_energy;
+      this->max_energy = this->step_energy;
+    }
+    this->energy = this->step_energy;
+    this->power = this->step_power;
+    this->min_energy = std::min(this->min_energy, this->energy);
+    this->max_energy = std::max(this->max_energy, this->energy);
+    this->drift = this->energy - this->initial_energy + this->work;
+    this->last_time = time;
+    ++this->steps;
+    this->step_energy = 0;
+    this->step_power = 0;
+
+    if (this->warned || std::abs(this->GetRelativeDrift()) <= this->drift_tolerance)
+      return false;
+    this->warned = true;
+    return true;
+  }
+
+  /// \brief Drift relative to the largest magnitude or range the energy
+  /// has had, so neither an energy that crosses zero nor one that barely
+  /// changes inflates it
+  double GetRelativeDrift() const {
+    double scale = std::max(this->max_energy - this->min_energy,
+        std::max(std::abs(this->min_energy), std::abs(this->max_energy)));
+    return scale > 0 ? this->drift/scale : 0.0;
+  }
+
+  /// \brief Total magnetic energy of the last step
+  double energy;
+  /// \brief Total power of the magnetic wrenches of the last step
+  double power;
+  /// \brief Work done by the magnetic wrenches since the first step
+  double work;
+  /// \brief Energy plus work, relative to the first step
+  double drift;
+  /// \brief Relative drift at which EndStep reports
+  double drift_tolerance;
+
+ private:
+  double step_energy;
+  double step_power;
+  double initial_energy;
+  double min_energy;
+  double max_energy;
+  double last_time;
+  long steps;
+  bool pending;
+  bool warned;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ENERGY_MONITOR_H_
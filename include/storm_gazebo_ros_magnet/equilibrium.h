@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_EQUILIBRIUM_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_EQUILIBRIUM_H_
+
+#include <cmath>
+#include <vector>
+
+#include <ignition/math/Matrix3.hh>
+#include <ignition/math/Quaternion.hh>
+#include <ignition/math/Vector3.hh>
+
+#include "storm_gazebo_ros_magnet/dipole_magnet_container.h"
+#include "storm_gazebo_ros_magnet/lbfgs.h"
+#include "storm_gazebo_ros_magnet/multipole.h"
+
+namespace gazebo {
+
+/// \brief Moves rigid bodies carrying point dipoles to a local minimum of
+/// their potential energy.
+///
+/// The energy is the dipole-dipole energy between magnets of different
+/// bodies, -m.B of the field sources, the image energy -m.B_image/2 of the
+/// ferromagnetic planes and the work of gravity. Bodies with a contact
+/// radius are kept apart, and in front of the contact planes, by a stiff
+/// penalty. Each free body has six unknowns, the displacement of its center
+/// and a rotation vector w with R = exp(w) R_0.
+class MagnetEquilibrium {
+ public:
+  struct Body {
+    Body() : fixed(false), rotate(true), translation_mask(1, 1, 1), contact_radius(0) {
+    }
+
+    /// \brief World pose of the point the wrench is taken about
+    ignition::math::Vector3d position;
+    ignition::math::Quaterniond rotation;
+    /// \brief Magnet positions and moments in the body frame
+    std::vector<ignition::math::Vector3d> magnet_positions;
+    std::vector<ignition::math::Vector3d> magnet_moments;
+    /// \brief Gravity force on the body
+    ignition::math::Vector3d weight;
+    bool fixed;
+    /// \brief Whether the body may rotate
+    bool rotate;
+    /// \brief 1 for the world axes the body may translate along, 0 otherwise
+    ignition::math::Vector3d translation_mask;
+    /// \brief Radius of the sphere used for contact, 0 for none
+    double contact_radius;
+  };
+
+  /// \brief Plane that bodies with a contact radius stay in front of
+  struct ContactPlane {
+    ignition::math::Vector3d point;
+    /// \brief Unit normal pointing to the free side
+    ignition::math::Vector3d normal;
+  };
+
+  MagnetEquilibrium() : contact_stiffness(1e4) {
+  }
+
+  /// \brief Move the free bodies to a local equilibrium
+  /// \return Potential energy at the equilibrium
+  double Solve() {
+    this->free_bodies.clear();
+    for (size_t i = 0; i < this->bodies.size(); ++i) {
+      if (!this->bodies[i].fixed)
+        this->free_bodies.push_back(i);
+    }
+    this->start = this->bodies;
+
+    std::vector<double> x(6*this->free_bodies.size(), 0.0);
+    if (x.empty())
+      return 0;
+    double energy = this->minimizer.Minimize(
+        std::bind(&MagnetEquilibrium::Evaluate, this, std::placeholders::_1,
+          std::placeholders::_2), x);
+    this->SetPoses(x);
+    return energy;
+  }
+
+  /// \brief Total potential energy of the bodies at their current poses
+  double Energy() {
+    std::vector<ignition::math::Vector3d> forces;
+    std::vector<ignition::math::Vector3d> torques;
+    return this->Wrenches(forces, torques);
+  }
+
+  std::vector<Body> bodies;
+  DipoleMagnetContainer::FerromagneticPlaneV planes;
+  DipoleMagnetContainer::FieldSourcePtrV field_sources;
+  std::vector<ContactPlane> contact_planes;
+  /// \brief Stiffness of the contact penalty in N/m
+  double contact_stiffness;
+  Lbfgs minimizer;
+
+ private:
+  /// \brief Objective of the minimizer
+  double Evaluate(const std::vector<double>& x, std::vector<double>& g) {
+    this->SetPoses(x);
+    std::vector<ignition::math::Vector3d> forces;
+    std::vector<ignition::math::Vector3d> torques;
+    double energy = this->Wrenches(forces, torques);
+
+    for (size_t k = 0; k < this->free_bodies.size(); ++k) {
+      const size_t b = this->free_bodies[k];
+      const Body& body = this->bodies[b];
+      for (int a = 0; a < 3; ++a)
+        g[6*k + a] = -forces[b][a]*body.translation_mask[a];
+
+      ignition::math::Vector3d g_rot(0, 0, 0);
+      if (body.rotate) {
+        // dU/dw = -J_l(w)^T tau, with J_l the left Jacobian of SO(3)
+        ignition::math::Vector3d w(x[6*k + 3], x[6*k + 4], x[6*k + 5]);
+        const ignition::math::Vector3d& tau = torques[b];
+        double theta = w.Length();
+        double c1 = 0.5;
+        double c2 = 1.0/6;
+        if (theta > 1e-4) {
+          c1 = (1 - std::cos(theta))/(theta*theta);
+          c2 = (theta - std::sin(theta))/(theta*theta*theta);
+        }
+        ignition::math::Vector3d wt = w.Cross(tau);
+        g_rot = -(tau - wt*c1 + w.Cross(wt)*c2);
+      }
+      for (int a = 0; a < 3; ++a)
+        g[6*k + 3 + a] = g_rot[a];
+    }
+    return energy;
+  }
+
+  /// \brief Set the poses of the free bodies from the unknowns
+  void SetPoses(const std::vector<double>& x) {
+    for (size_t k = 0; k < this->free_bodies.size(); ++k) {
+      const size_t b = this->free_bodies[k];
+      const Body& body0 = this->start[b];
+      Body& body = this->bodies[b];
+      body.position = body0.position +
+          ignition::math::Vector3d(x[6*k], x[6*k + 1], x[6*k + 2]);
+      ignition::math::Vector3d w(x[6*k + 3], x[6*k + 4], x[6*k + 5]);
+      double theta = w.Length();
+      if (theta > 0)
+        body.rotation = ignition::math::Quaterniond(w/theta, theta)*body0.rotation;
+      else
+        body.rotation = body0.rotation;
+    }
+  }
+
+  /// \brief Energy, and force and torque about each body's position
+  double Wrenches(std::vector<ignition::math::Vector3d>& forces,
+      std::vector<ignition::math::Vector3d>& torques) {
+    const size_t n_bodies = this->bodies.size();
+    forces.assign(n_bodies, ignition::math::Vector3d::Zero);
+    torques.assign(n_bodies, ignition::math::Vector3d::Zero);
+    double energy = 0;
+
+    // World positions and moments of all magnets
+    std::vector<size_t> owner;
+    std::vector<ignition::math::Vector3d> p;
+    std::vector<ignition::math::Vector3d> m;
+    for (size_t b = 0; b < n_bodies; ++b) {
+      const Body& body = this->bodies[b];
+      for (size_t i = 0; i < body.magnet_positions.size(); ++i) {
+        owner.push_back(b);
+        p.push_back(body.position + body.rotation.RotateVector(body.magnet_positions[i]));
+        m.push_back(body.rotation.RotateVector(body.magnet_moments[i]));
+      }
+    }
+
+    // Adds a force on magnet i, and its moment about the body's position
+    auto add_wrench = [&](size_t i, const ignition::math::Vector3d& f,
+        const ignition::math::Vector3d& tau) {
+      forces[owner[i]] += f;
+      torques[owner[i]] += tau + (p[i] - this->bodies[owner[i]].position).Cross(f);
+    };
+
+    for (size_t i = 0; i < p.size(); ++i) {
+      for (size_t j = i + 1; j < p.size(); ++j) {
+        if (owner[i] == owner[j] ||
+            (this->bodies[owner[i]].fixed && this->bodies[owner[j]].fixed))
+          continue;
+        ignition::math::Vector3d r = p[i] - p[j];
+        ignition::math::Vector3d b_j = DipoleField(r, m[j]);
+        ignition::math::Vector3d b_i = DipoleField(-r, m[i]);
+        ignition::math::Vector3d f = DipoleForce(r, m[j], m[i]);
+        energy -= m[i].Dot(b_j);
+        add_wrench(i, f, m[i].Cross(b_j));
+        add_wrench(j, -f, m[j].Cross(b_i));
+      }
+
+      if (this->bodies[owner[i]].fixed)
+        continue;
+
+      for (size_t s = 0; s < this->field_sources.size(); ++s) {
+        ignition::math::Vector3d field;
+        ignition::math::Matrix3d gradient;
+        this->field_sources[s]->GetField(p[i], field, gradient);
+        energy -= m[i].Dot(field);
+        add_wrench(i, gradient.Transposed()*m[i], m[i].Cross(field));
+      }
+
+      for (size_t s = 0; s < this->planes.size(); ++s) {
+        ignition::math::Vector3d p_image;
+        ignition::math::Vector3d m_image;
+        if (!this->planes[s].GetImage(p[i], m[i], p_image, m_image))
+          continue;
+        ignition::math::Vector3d field = DipoleField(p[i] - p_image, m_image);
+        energy -= 0.5*m[i].Dot(field);
+        add_wrench(i, DipoleForce(p[i] - p_image, m_image, m[i]), m[i].Cross(field));
+      }
+    }
+
+    const double k = this->contact_stiffness;
+    for (size_t a = 0; a < n_bodies; ++a) {
+      const Body& body = this->bodies[a];
+      if (body.fixed)
+        continue;
+      energy -= body.weight.Dot(body.position);
+      forces[a] += body.weight;
+
+      if (body.contact_radius <= 0)
+        continue;
+      for (size_t s = 0; s < this->contact_planes.size(); ++s) {
+        const ContactPlane& plane = this->contact_planes[s];
+        double depth = body.contact_radius - (body.position - plane.point).Dot(plane.normal);
+        if (depth > 0) {
+          energy += 0.5*k*depth*depth;
+          forces[a] += plane.normal*(k*depth);
+        }
+      }
+    }
+
+    for (size_t a = 0; a < n_bodies; ++a) {
+      for (size_t b = a + 1; b < n_bodies; ++b) {
+        const Body& body_a = this->bodies[a];
+        const Body& body_b = this->bodies[b];
+        if ((body_a.fixed && body_b.fixed) ||
+            body_a.contact_radius <= 0 || body_b.contact_radius <= 0)
+          continue;
+        ignition::math::Vector3d d = body_a.position - body_b.position;
+        double dist = d.Length();
+        double depth = body_a.contact_radius + body_b.contact_radius - dist;
+        if (depth <= 0 || dist <= 0)
+          continue;
+        energy += 0.5*k*depth*depth;
+        ignition::math::Vector3d f = d*(k*depth/dist);
+        forces[a] += f;
+        forces[b] -= f;
+      }
+    }
+
+    return energy;
+  }
+
+  /// \brief Indices of the bodies that are not fixed
+  std::vector<size_t> free_bodies;
+  /// \brief Bodies as they were when Solve was called
+  std::vector<Body> start;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_EQUILIBRIUM_H_
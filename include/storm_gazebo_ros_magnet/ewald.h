@@ -0,0 +1,485 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_EWALD_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_EWALD_H_
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <ignition/math/Vector3.hh>
+
+namespace gazebo {
+
+/// \brief Dipolar Ewald summation for a periodic box with a particle-mesh
+/// reciprocal part (smooth PME with cubic B-splines).
+///
+/// The dipole interaction is split into a short-range real-space sum, cut
+/// off at cutoff and evaluated with a cell list, and a smooth long-range
+/// part evaluated on a mesh with FFTs. Unless a cutoff is given, it is
+/// chosen from the number of dipoles so that both parts cost about the
+/// same, which keeps the total near O(N log N). The splitting parameter and
+/// mesh size follow from the cutoff and the requested relative tolerance.
+/// Tin-foil boundary conditions are used.
+class EwaldSolver {
+ public:
+  typedef std::complex<double> Complex;
+  typedef ignition::math::Vector3d Vector3d;
+
+  /// \brief Largest mesh size along any axis
+  static const int max_mesh = 128;
+
+  EwaldSolver() : alpha(0), cutoff(0), tolerance(0), requested_cutoff(0), tuned_count(0) {
+    this->mesh[0] = this->mesh[1] = this->mesh[2] = 0;
+  }
+
+  /// \brief Set up the box and choose the Ewald parameters for a number of
+  /// dipoles. Solve() chooses them again when the number changes.
+  /// \param[in] _box Edge lengths of the periodic box
+  /// \param[in] _tolerance Relative accuracy of the forces, e.g. 1e-4. The
+  /// mesh is capped at max_mesh nodes per axis, which limits the accuracy
+  /// reachable for very small tolerances.
+  /// \param[in] _cutoff Real-space cutoff, 0 to balance it against the mesh
+  /// for the number of dipoles. Values above half the shortest edge are
+  /// clamped to that.
+  /// \param[in] count Expected number of dipoles
+  void Configure(const Vector3d& _box, double _tolerance, double _cutoff, size_t count = 1) {
+    this->box = _box;
+    this->tolerance = _tolerance;
+    this->requested_cutoff = _cutoff;
+    this->Tune(count);
+  }
+
+  bool Configured() const {
+    return this->cutoff > 0;
+  }
+
+  const Vector3d& Box() const {
+    return this->box;
+  }
+
+  /// \brief Field, force and torque on every dipole
+  /// \param[in] positions Dipole positions, wrapped into the box internally
+  /// \param[in] moments World frame dipole moments
+  /// \param[in] ids Dipoles with equal ids do not interact directly, only
+  /// with each other's periodic images
+  /// \param[out] fields Magnetic field at each dipole from all others and
+  /// all periodic images
+  /// \param[out] forces Force on each dipole
+  /// \param[out] torques Torque on each dipole
+  void Solve(const std::vector<Vector3d>& positions,
+      const std::vector<Vector3d>& moments,
+      const std::vector<std::uint32_t>& ids,
+      std::vector<Vector3d>& fields,
+      std::vector<Vector3d>& forces,
+      std::vector<Vector3d>& torques) {
+    const size_t n = positions.size();
+    fields.assign(n, Vector3d::Zero);
+    forces.assign(n, Vector3d::Zero);
+    torques.assign(n, Vector3d::Zero);
+    if (n == 0 || !this->Configured())
+      return;
+    if (n != this->tuned_count)
+      this->Tune(n);
+
+    std::vector<Vector3d> wrapped(n);
+    for (size_t i = 0; i < n; ++i) {
+      for (int a = 0; a < 3; ++a) {
+        double x = std::fmod(positions[i][a], this->box[a]);
+        wrapped[i][a] = (x < 0) ? x + this->box[a] : x;
+      }
+    }
+
+    this->RealSpace(wrapped, moments, ids, fields, forces);
+    this->Reciprocal(wrapped, moments, fields, forces);
+    this->Exclude(wrapped, moments, ids, fields, forces);
+
+    // Remove the interaction of each smeared dipole with itself
+    const double self = 4*std::pow(this->alpha, 3)/(3*std::sqrt(M_PI));
+    const double mu0_4pi = 1e-7;
+    for (size_t i = 0; i < n; ++i) {
+      fields[i] = (fields[i] + moments[i]*self)*mu0_4pi;
+      forces[i] *= mu0_4pi;
+      torques[i] = moments[i].Cross(fields[i]);
+    }
+  }
+
+  double alpha;
+  double cutoff;
+  double tolerance;
+  int mesh[3];
+
+ private:
+  /// \brief Choose the cutoff, splitting parameter and mesh for n dipoles
+  void Tune(size_t n) {
+    this->tuned_count = n;
+    const double half_min = 0.5*this->box.Min();
+    if (this->requested_cutoff > 0) {
+      this->SetCutoff(std::min(this->requested_cutoff, half_min));
+      return;
+    }
+
+    // Try cutoffs that fit k cells into the shortest edge and keep the
+    // cheapest one whose mesh is not capped. The real-space sum costs about
+    // N^2 rc^3/V and the mesh V/rc^3, so the choice tends to L N^(-1/6).
+    double best_cutoff = half_min;
+    double best_cost = -1;
+    for (int k = 2; k <= max_mesh/2; ++k) {
+      double rc = 2*half_min/k;
+      if (!this->SetCutoff(rc))
+        break;
+      double cost = this->GetCost(n);
+      if (best_cost < 0 || cost < best_cost) {
+        best_cost = cost;
+        best_cutoff = rc;
+      }
+    }
+    this->SetCutoff(best_cutoff);
+  }
+
+  /// \brief Set the cutoff and derive the splitting parameter and mesh
+  /// \return False if the mesh was capped at max_mesh
+  bool SetCutoff(double rc) {
+    this->cutoff = rc;
+
+    // erfc(alpha rc) ~ exp(-k_max^2/4alpha^2) ~ tolerance
+    double s = std::sqrt(-std::log(this->tolerance));
+    this->alpha = s/this->cutoff;
+    double k_max = 2*this->alpha*s;
+
+    // The cubic spline interpolation error falls with the fourth power of the
+    // mesh spacing and is about 2e-3 when k_max sits at the Nyquist frequency
+    double oversample = std::max(1.0, std::pow(2e-3/this->tolerance, 0.25));
+    bool capped = false;
+    for (int a = 0; a < 3; ++a) {
+      int needed = static_cast<int>(std::ceil(oversample*k_max*this->box[a]/M_PI));
+      int m = 8;
+      while (m < needed && m < max_mesh)
+        m *= 2;
+      this->mesh[a] = m;
+      capped = capped || m < needed;
+    }
+    return !capped;
+  }
+
+  /// \brief Estimated cost of a step with the current parameters, in pair
+  /// evaluations. The weight of the mesh was measured against the pairs.
+  double GetCost(size_t n) const {
+    double pairs = 0.5*n*n;
+    int cells[3];
+    for (int a = 0; a < 3; ++a)
+      cells[a] = static_cast<int>(this->box[a]/this->cutoff);
+    if (cells[0] >= 3 && cells[1] >= 3 && cells[2] >= 3)
+      pairs *= 27.0/(static_cast<double>(cells[0])*cells[1]*cells[2]);
+    double grid = static_cast<double>(this->mesh[0])*this->mesh[1]*this->mesh[2];
+    return pairs + 64.0*n + 3*grid*std::log2(grid);
+  }
+
+  /// \brief Minimum image displacement
+  Vector3d MinimumImage(Vector3d r) const {
+    for (int a = 0; a < 3; ++a)
+      r[a] -= this->box[a]*std::floor(r[a]/this->box[a] + 0.5);
+    return r;
+  }
+
+  /// \brief Apply the pair terms with radial coefficients B, C and D
+  static void AddPair(const Vector3d& r, const Vector3d& mi, const Vector3d& mj,
+      double B, double C, double D, Vector3d& field_i, Vector3d& field_j,
+      Vector3d& force_i, Vector3d& force_j) {
+    double mir = mi.Dot(r);
+    double mjr = mj.Dot(r);
+    field_i += r*(C*mjr) - mj*B;
+    field_j += r*(C*mir) - mi*B;
+    Vector3d f = (r*mi.Dot(mj) + mi*mjr + mj*mir)*C - r*(D*mir*mjr);
+    force_i += f;
+    force_j -= f;
+  }
+
+  /// \brief Radial coefficients of the screened real-space interaction
+  void Screened(double r2, double& B, double& C, double& D) const {
+    const double a2 = this->alpha*this->alpha;
+    double r1 = std::sqrt(r2);
+    double g = 2*this->alpha/std::sqrt(M_PI)*std::exp(-a2*r2);
+    B = (std::erfc(this->alpha*r1)/r1 + g)/r2;
+    C = (3*B + 2*a2*g)/r2;
+    D = (5*C + 4*a2*a2*g)/r2;
+  }
+
+  /// \brief Remove the direct interaction of dipoles with equal ids. The
+  /// reciprocal sum contains its smooth part for every pair, so the
+  /// difference of the screened and the bare interaction is applied to
+  /// those pairs at any distance. The real-space sum skipped them.
+  void Exclude(const std::vector<Vector3d>& pos, const std::vector<Vector3d>& mom,
+      const std::vector<std::uint32_t>& ids, std::vector<Vector3d>& fields,
+      std::vector<Vector3d>& forces) const {
+    std::map<std::uint32_t, std::vector<size_t> > groups;
+    for (size_t i = 0; i < pos.size(); ++i)
+      groups[ids[i]].push_back(i);
+    for (std::map<std::uint32_t, std::vector<size_t> >::const_iterator it = groups.begin();
+        it != groups.end(); ++it) {
+      const std::vector<size_t>& group = it->second;
+      for (size_t a = 0; a < group.size(); ++a) {
+        for (size_t b = a + 1; b < group.size(); ++b) {
+          size_t i = group[a], j = group[b];
+          Vector3d r = this->MinimumImage(pos[i] - pos[j]);
+          double r2 = r.SquaredLength();
+          if (r2 == 0)
+            continue;
+          double B, C, D;
+          this->Screened(r2, B, C, D);
+          double ir1 = 1/std::sqrt(r2);
+          double ir3 = ir1/r2;
+          B -= ir3;
+          C -= 3*ir3/r2;
+          D -= 15*ir3/(r2*r2);
+          AddPair(r, mom[i], mom[j], B, C, D, fields[i], fields[j], forces[i], forces[j]);
+        }
+      }
+    }
+  }
+
+  void RealSpace(const std::vector<Vector3d>& pos, const std::vector<Vector3d>& mom,
+      const std::vector<std::uint32_t>& ids, std::vector<Vector3d>& fields,
+      std::vector<Vector3d>& forces) const {
+    const size_t n = pos.size();
+    const double rc2 = this->cutoff*this->cutoff;
+
+    // Cell list with cells no smaller than the cutoff
+    int cells[3];
+    for (int a = 0; a < 3; ++a)
+      cells[a] = std::max(1, static_cast<int>(this->box[a]/this->cutoff));
+    const bool use_cells = cells[0] >= 3 && cells[1] >= 3 && cells[2] >= 3;
+
+    std::vector<int> head;
+    std::vector<int> next(n, -1);
+    if (use_cells) {
+      head.assign(cells[0]*cells[1]*cells[2], -1);
+      for (size_t i = 0; i < n; ++i) {
+        int c = this->CellIndex(pos[i], cells);
+        next[i] = head[c];
+        head[c] = static_cast<int>(i);
+      }
+    }
+
+    // Pairs with equal ids are handled by Exclude()
+    auto interact = [&](size_t i, size_t j) {
+      if (ids[i] == ids[j])
+        return;
+      Vector3d r = this->MinimumImage(pos[i] - pos[j]);
+      double r2 = r.SquaredLength();
+      if (r2 >= rc2 || r2 == 0)
+        return;
+      double B, C, D;
+      this->Screened(r2, B, C, D);
+      AddPair(r, mom[i], mom[j], B, C, D, fields[i], fields[j], forces[i], forces[j]);
+    };
+
+    if (!use_cells) {
+      for (size_t i = 0; i < n; ++i)
+        for (size_t j = i + 1; j < n; ++j)
+          interact(i, j);
+      return;
+    }
+
+    // Visit each unordered pair of neighbouring cells once
+    for (int cx = 0; cx < cells[0]; ++cx)
+      for (int cy = 0; cy < cells[1]; ++cy)
+        for (int cz = 0; cz < cells[2]; ++cz) {
+          int c = (cx*cells[1] + cy)*cells[2] + cz;
+          for (int d = 0; d < 27; ++d) {
+            int nx = (cx + d/9 - 1 + cells[0]) % cells[0];
+            int ny = (cy + (d/3)%3 - 1 + cells[1]) % cells[1];
+            int nz = (cz + d%3 - 1 + cells[2]) % cells[2];
+            int nc = (nx*cells[1] + ny)*cells[2] + nz;
+            if (nc < c)
+              continue;
+            for (int i = head[c]; i >= 0; i = next[i])
+              for (int j = head[nc]; j >= 0; j = next[j])
+                if (nc != c || j > i)
+                  interact(i, j);
+          }
+        }
+  }
+
+  int CellIndex(const Vector3d& p, const int* cells) const {
+    int idx[3];
+    for (int a = 0; a < 3; ++a)
+      idx[a] = std::min(cells[a] - 1, static_cast<int>(p[a]/this->box[a]*cells[a]));
+    return (idx[0]*cells[1] + idx[1])*cells[2] + idx[2];
+  }
+
+  /// \brief Cubic B-spline weights of the 4 nodes around fractional coordinate u
+  static void Spline(double u, int& base, double* w) {
+    double fl = std::floor(u);
+    double t = u - fl;
+    base = static_cast<int>(fl) - 1;
+    w[0] = (1 - t)*(1 - t)*(1 - t)/6;
+    w[1] = (3*t*t*t - 6*t*t + 4)/6;
+    w[2] = (-3*t*t*t + 3*t*t + 3*t + 1)/6;
+    w[3] = t*t*t/6;
+  }
+
+  void Reciprocal(const std::vector<Vector3d>& pos, const std::vector<Vector3d>& mom,
+      std::vector<Vector3d>& fields, std::vector<Vector3d>& forces) {
+    const int M0 = this->mesh[0], M1 = this->mesh[1], M2 = this->mesh[2];
+    const size_t grid_size = static_cast<size_t>(M0)*M1*M2;
+    const size_t n = pos.size();
+
+    // Precompute spline support of every dipole
+    std::vector<int> base(3*n);
+    std::vector<double> weight(12*n);
+    for (size_t i = 0; i < n; ++i)
+      for (int a = 0; a < 3; ++a)
+        Spline(pos[i][a]/this->box[a]*this->mesh[a], base[3*i + a], &weight[12*i + 4*a]);
+
+    auto node = [&](size_t i, int p, int q, int r) {
+      int x = (base[3*i] + p + M0) % M0;
+      int y = (base[3*i + 1] + q + M1) % M1;
+      int z = (base[3*i + 2] + r + M2) % M2;
+      return (static_cast<size_t>(x)*M1 + y)*M2 + z;
+    };
+    auto node_weight = [&](size_t i, int p, int q, int r) {
+      return weight[12*i + p]*weight[12*i + 4 + q]*weight[12*i + 8 + r];
+    };
+
+    // Spread the moments
+    std::vector<std::vector<Complex> > Q(3, std::vector<Complex>(grid_size));
+    for (size_t i = 0; i < n; ++i)
+      for (int p = 0; p < 4; ++p)
+        for (int q = 0; q < 4; ++q)
+          for (int r = 0; r < 4; ++r) {
+            size_t g = node(i, p, q, r);
+            double w = node_weight(i, p, q, r);
+            for (int a = 0; a < 3; ++a)
+              Q[a][g] += mom[i][a]*w;
+          }
+    for (int a = 0; a < 3; ++a)
+      this->FFT3(Q[a], false);
+
+    // Influence function applied to k.Q(k)
+    const double volume = this->box[0]*this->box[1]*this->box[2];
+    const double inv_4a2 = 1.0/(4*this->alpha*this->alpha);
+    std::vector<std::vector<Complex> > E(3, std::vector<Complex>(grid_size));
+    std::vector<std::vector<Complex> > G(6, std::vector<Complex>(grid_size));
+    static const int ga[6] = {0, 1, 2, 0, 0, 1};
+    static const int gb[6] = {0, 1, 2, 1, 2, 2};
+    for (int x = 0; x < M0; ++x)
+      for (int y = 0; y < M1; ++y)
+        for (int z = 0; z < M2; ++z) {
+          size_t g = (static_cast<size_t>(x)*M1 + y)*M2 + z;
+          int idx[3] = {x, y, z};
+          Vector3d k;
+          double spline = 1;
+          for (int a = 0; a < 3; ++a) {
+            int m = (idx[a] <= this->mesh[a]/2) ? idx[a] : idx[a] - this->mesh[a];
+            k[a] = 2*M_PI*m/this->box[a];
+            double d = (4 + 2*std::cos(2*M_PI*idx[a]/this->mesh[a]))/6;
+            spline *= d*d;
+          }
+          double k2 = k.SquaredLength();
+          if (k2 == 0)
+            continue;
+          Complex kq = k[0]*Q[0][g] + k[1]*Q[1][g] + k[2]*Q[2][g];
+          Complex T = kq*(4*M_PI/volume*std::exp(-k2*inv_4a2)/k2/spline);
+          for (int a = 0; a < 3; ++a)
+            E[a][g] = k[a]*T;
+          for (int c = 0; c < 6; ++c)
+            G[c][g] = k[ga[c]]*k[gb[c]]*T;
+        }
+    for (int a = 0; a < 3; ++a)
+      this->FFT3(E[a], true);
+    for (int c = 0; c < 6; ++c)
+      this->FFT3(G[c], true);
+
+    // Gather field and field gradient at the dipoles
+    for (size_t i = 0; i < n; ++i) {
+      Vector3d e;
+      double grad[6] = {0, 0, 0, 0, 0, 0};
+      for (int p = 0; p < 4; ++p)
+        for (int q = 0; q < 4; ++q)
+          for (int r = 0; r < 4; ++r) {
+            size_t g = node(i, p, q, r);
+            double w = node_weight(i, p, q, r);
+            for (int a = 0; a < 3; ++a)
+              e[a] += w*E[a][g].real();
+            for (int c = 0; c < 6; ++c)
+              grad[c] += w*G[c][g].imag();
+          }
+      fields[i] -= e;
+      // F_a = m_b dH_b/dx_a with the symmetric gradient stored as 6 values
+      const Vector3d& m = mom[i];
+      forces[i] += Vector3d(
+          grad[0]*m[0] + grad[3]*m[1] + grad[4]*m[2],
+          grad[3]*m[0] + grad[1]*m[1] + grad[5]*m[2],
+          grad[4]*m[0] + grad[5]*m[1] + grad[2]*m[2]);
+    }
+  }
+
+  /// \brief In-place radix-2 FFT of a strided sequence. Inverse is unnormalized.
+  static void FFT1(Complex* data, int n, size_t stride, bool inverse) {
+    for (int i = 1, j = 0; i < n; ++i) {
+      int bit = n >> 1;
+      for (; j & bit; bit >>= 1)
+        j ^= bit;
+      j ^= bit;
+      if (i < j)
+        std::swap(data[i*stride], data[j*stride]);
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+      double angle = 2*M_PI/len*(inverse ? 1 : -1);
+      Complex wlen(std::cos(angle), std::sin(angle));
+      for (int i = 0; i < n; i += len) {
+        Complex w(1);
+        for (int j = 0; j < len/2; ++j) {
+          Complex u = data[(i + j)*stride];
+          Complex v = data[(i + j + len/2)*stride]*w;
+          data[(i + j)*stride] = u + v;
+          data[(i + j + len/2)*stride] = u - v;
+          w *= wlen;
+        }
+      }
+    }
+  }
+
+  void FFT3(std::vector<Complex>& grid, bool inverse) const {
+    const int M0 = this->mesh[0], M1 = this->mesh[1], M2 = this->mesh[2];
+    for (int x = 0; x < M0; ++x)
+      for (int y = 0; y < M1; ++y)
+        FFT1(&grid[(static_cast<size_t>(x)*M1 + y)*M2], M2, 1, inverse);
+    for (int x = 0; x < M0; ++x)
+      for (int z = 0; z < M2; ++z)
+        FFT1(&grid[static_cast<size_t>(x)*M1*M2 + z], M1, M2, inverse);
+    for (int y = 0; y < M1; ++y)
+      for (int z = 0; z < M2; ++z)
+        FFT1(&grid[static_cast<size_t>(y)*M2 + z], M0, static_cast<size_t>(M1)*M2, inverse);
+  }
+
+  Vector3d box;
+  /// \brief Cutoff given to Configure(), 0 to choose it
+  double requested_cutoff;
+  /// \brief Number of dipoles the parameters were chosen for
+  size_t tuned_count;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_EWALD_H_
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_INTERACTION_KERNEL_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_INTERACTION_KERNEL_H_
+
+#include <cmath>
+
+#include <ignition/math/Matrix3.hh>
+#include <ignition/math/Vector3.hh>
+
+namespace gazebo {
+
+/// \brief Outputs of an interaction kernel, combined as bit flags
+enum InteractionOutput {
+  /// \brief Force on the target magnet
+  OUTPUT_FORCE = 1,
+  /// \brief Torque on the target magnet about its center
+  OUTPUT_TORQUE = 2,
+  /// \brief Field of the source at the center of the target
+  OUTPUT_FIELD = 4,
+  /// \brief Field gradient of the source at the center of the target,
+  /// gradient(a, b) = dB_a/dx_b
+  OUTPUT_GRADIENT = 8,
+  /// \brief Interaction energy of the pair
+  OUTPUT_ENERGY = 16
+};
+
+/// \brief Result of one interaction. Outputs that were not requested are
+/// left untouched.
+struct Interaction {
+  ignition::math::Vector3d force;
+  ignition::math::Vector3d torque;
+  ignition::math::Vector3d field;
+  ignition::math::Matrix3d gradient;
+  double energy;
+};
+
+/// \brief Dipole with its distance softened to sqrt(r^2 + epsilon^2). The
+/// field stays the gradient of a potential, so forces remain conservative
+/// and finite when magnets overlap. epsilon = 0 is the point dipole.
+struct SoftenedDipoleModel {
+  explicit SoftenedDipoleModel(double _epsilon = 0) : epsilon(_epsilon) {
+  }
+
+  /// \param[in] r Center of the target relative to the source
+  /// \param[in] m_self World frame moment of the target
+  /// \param[in] m_other World frame moment of the source
+  /// \param[out] out Requested outputs
+  template <unsigned Outputs>
+  inline void Evaluate(const ignition::math::Vector3d& r,
+      const ignition::math::Vector3d& m_self,
+      const ignition::math::Vector3d& m_other, Interaction& out) const {
+    const double s2 = r.SquaredLength() + this->epsilon*this->epsilon;
+    const double is2 = 1.0/s2;
+    const double is3 = 1e-7*is2*std::sqrt(is2);
+    const double mr = m_other.Dot(r);
+
+    if (Outputs & (OUTPUT_FIELD | OUTPUT_TORQUE | OUTPUT_ENERGY)) {
+      ignition::math::Vector3d field = (r*(3*mr*is2) - m_other)*is3;
+      if (Outputs & OUTPUT_FIELD)
+        out.field = field;
+      if (Outputs & OUTPUT_TORQUE)
+        out.torque = m_self.Cross(field);
+      // The field is the gradient of a potential, so this is the energy
+      // whose gradient is the force
+      if (Outputs & OUTPUT_ENERGY)
+        out.energy = -m_self.Dot(field);
+    }
+    if (Outputs & OUTPUT_FORCE) {
+      const double sr = m_self.Dot(r);
+      out.force = (m_self*mr + m_other*sr + r*(m_self.Dot(m_other) - 5*mr*sr*is2))*(3*is3*is2);
+    }
+    if (Outputs & OUTPUT_GRADIENT) {
+      const double k = 3*is3*is2;
+      for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+          out.gradient(a, b) = k*(m_other[b]*r[a] + m_other[a]*r[b] +
+              (a == b ? mr : 0.0) - 5*mr*r[a]*r[b]*is2);
+        }
+      }
+    }
+  }
+
+  double epsilon;
+};
+
+/// \brief Point dipole, the model the plugins have always used
+struct PointDipoleModel : public SoftenedDipoleModel {
+  PointDipoleModel() : SoftenedDipoleModel(0) {
+  }
+};
+
+/// \brief Gilbert model: each magnet is a pair of magnetic charges
+/// +-|m|/l placed l/2 from its center along its moment. Unlike the point
+/// dipole it stays finite at short range and captures the torque of
+/// elongated magnets on each other.
+struct GilbertModel {
+  explicit GilbertModel(double _length = 0.01) : length(_length) {
+  }
+
+  template <unsigned Outputs>
+  inline void Evaluate(const ignition::math::Vector3d& r,
+      const ignition::math::Vector3d& m_self,
+      const ignition::math::Vector3d& m_other, Interaction& out) const {
+    // Charge q sits at +lever and -q at -lever, with q*lever = m/2
+    const double n_self = m_self.Length();
+    const double n_other = m_other.Length();
+    const ignition::math::Vector3d lever_self = m_self*(n_self > 0 ? 0.5*this->length/n_self : 0.0);
+    const ignition::math::Vector3d lever_other = m_other*(n_other > 0 ? 0.5*this->length/n_other : 0.0);
+    const double q_self = n_self/this->length;
+    const double q_other = n_other/this->length;
+
+    if (Outputs & (OUTPUT_FORCE | OUTPUT_TORQUE)) {
+      ignition::math::Vector3d force(0, 0, 0);
+      ignition::math::Vector3d torque(0, 0, 0);
+      for (int i = 0; i < 2; ++i) {
+        const double sign_i = i == 0 ? 1.0 : -1.0;
+        const ignition::math::Vector3d lever = lever_self*sign_i;
+        ignition::math::Vector3d field(0, 0, 0);
+        for (int j = 0; j < 2; ++j) {
+          const double sign_j = j == 0 ? 1.0 : -1.0;
+          field += ChargeField(r + lever - lever_other*sign_j, q_other*sign_j);
+        }
+        const ignition::math::Vector3d f = field*(q_self*sign_i);
+        force += f;
+        torque += lever.Cross(f);
+      }
+      if (Outputs & OUTPUT_FORCE)
+        out.force = force;
+      if (Outputs & OUTPUT_TORQUE)
+        out.torque = torque;
+    }
+    if (Outputs & OUTPUT_FIELD) {
+      out.field = ChargeField(r - lever_other, q_other) +
+          ChargeField(r + lever_other, -q_other);
+    }
+    if (Outputs & OUTPUT_GRADIENT) {
+      out.gradient = ChargeGradient(r - lever_other, q_other) +
+          ChargeGradient(r + lever_other, -q_other);
+    }
+    if (Outputs & OUTPUT_ENERGY) {
+      double energy = 0;
+      for (int i = 0; i < 2; ++i) {
+        const double sign_i = i == 0 ? 1.0 : -1.0;
+        for (int j = 0; j < 2; ++j) {
+          const double sign_j = j == 0 ? 1.0 : -1.0;
+          const ignition::math::Vector3d d = r + lever_self*sign_i - lever_other*sign_j;
+          energy += sign_i*sign_j/d.Length();
+        }
+      }
+      out.energy = 1e-7*q_self*q_other*energy;
+    }
+  }
+
+  /// \brief Field of a magnetic charge q at displacement d
+  static inline ignition::math::Vector3d ChargeField(
+      const ignition::math::Vector3d& d, double q) {
+    const double d2 = d.SquaredLength();
+    return d*(1e-7*q/(d2*std::sqrt(d2)));
+  }
+
+  /// \brief Field gradient of a magnetic charge q at displacement d
+  static inline ignition::math::Matrix3d ChargeGradient(
+      const ignition::math::Vector3d& d, double q) {
+    const double d2 = d.SquaredLength();
+    const double k = 1e-7*q/(d2*std::sqrt(d2));
+    ignition::math::Matrix3d gradient;
+    for (int a = 0; a < 3; ++a)
+      for (int b = 0; b < 3; ++b)
+        gradient(a, b) = k*((a == b ? 1.0 : 0.0) - 3*d[a]*d[b]/d2);
+    return gradient;
+  }
+
+  /// \brief Distance between the two charges of a magnet
+  double length;
+};
+
+/// \brief Interaction of a source magnet on a target magnet, fully
+/// specialized at compile time for a model and a set of outputs.
+///
+/// Outputs is a combination of InteractionOutput flags. Every test on it is
+/// a constant expression, so an instantiation contains no branches on the
+/// outputs and none of the arithmetic of the outputs it does not produce.
+template <class Model, unsigned Outputs>
+class InteractionKernel {
+ public:
+  static const unsigned outputs = Outputs;
+
+  explicit InteractionKernel(const Model& _model = Model()) : model(_model) {
+  }
+
+  /// \param[in] p_self World position of the target
+  /// \param[in] m_self World frame moment of the target
+  /// \param[in] p_other World position of the source
+  /// \param[in] m_other World frame moment of the source
+  /// \param[out] out Requested outputs
+  inline void operator()(const ignition::math::Vector3d& p_self,
+      const ignition::math::Vector3d& m_self,
+      const ignition::math::Vector3d& p_other,
+      const ignition::math::Vector3d& m_other, Interaction& out) const {
+    this->model.template Evaluate<Outputs>(p_self - p_other, m_self, m_other, out);
+  }
+
+  Model model;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_INTERACTION_KERNEL_H_
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ISLAND_SLEEP_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ISLAND_SLEEP_H_
+
+#include <algorithm>
+#include <cmath>
+
+#include <ignition/math/Pose3.hh>
+#include <ignition/math/Vector3.hh>
+
+namespace gazebo {
+
+/// \brief Activity of one magnet, as seen by IslandSleep
+struct SleepState {
+  SleepState() : asleep(false), wrench_steady(false), quiet_since(0) {
+  }
+
+  /// \brief Whether the magnet is asleep. Its wrench is held instead of
+  /// solved.
+  bool asleep;
+  /// \brief Whether the last two solved wrenches agreed within tolerance
+  bool wrench_steady;
+  /// \brief Simulation time since which the magnet has been quiet
+  double quiet_since;
+  /// \brief World frame velocities of the link, set with the pose
+  ignition::math::Vector3d linear_velocity;
+  ignition::math::Vector3d angular_velocity;
+  /// \brief Last solved wrench
+  ignition::math::Vector3d force;
+  ignition::math::Vector3d torque;
+  /// \brief Pose, body frame moment and external field when it fell asleep
+  ignition::math::Pose3d pose;
+  ignition::math::Vector3d moment;
+  ignition::math::Vector3d field;
+};
+
+/// \brief Puts islands of magnets that are at rest to sleep.
+///
+/// A magnet is quiet while its link moves slower than the velocity
+/// thresholds and its solved wrench stays within a relative tolerance from
+/// one solve to the next. An island whose magnets have all been quiet for
+/// sleep_time falls asleep: its magnets hold their last wrench and are no
+/// longer solved. The whole island wakes up as soon as one of its magnets
+/// is disturbed, i.e. its link moves or is moved, its moment changes or the
+/// external field at it changes, or an awake magnet joins the island.
+class IslandSleep {
+ public:
+  IslandSleep() : linear_velocity(1e-3), angular_velocity(1e-2), tolerance(1e-3),
+      field_tolerance(1e-6), wake_distance(1e-4), wake_angle(1e-3), sleep_time(1.0) {
+  }
+
+  /// \brief Record the wrench solved for a magnet
+  void RecordWrench(SleepState& state, const ignition::math::Vector3d& force,
+      const ignition::math::Vector3d& torque) const {
+    state.wrench_steady =
+        (force - state.force).Length() <= this->tolerance*force.Length() &&
+        (torque - state.torque).Length() <= this->tolerance*torque.Length();
+    state.force = force;
+    state.torque = torque;
+  }
+
+  /// \brief Whether an awake magnet is at rest and its wrench steady
+  /// \param[in] solved Whether the magnet's wrench is solved at all
+  bool IsQuiet(const SleepState& state, bool solved) const {
+    return (state.wrench_steady || !solved) &&
+        state.linear_velocity.Length() <= this->linear_velocity &&
+        state.angular_velocity.Length() <= this->angular_velocity;
+  }
+
+  /// \brief Whether a sleeping magnet must wake up
+  /// \param[in] pose Current pose of the magnet
+  /// \param[in] moment Current body frame moment
+  /// \param[in] field Current external field at the magnet
+  bool IsDisturbed(const SleepState& state, const ignition::math::Pose3d& pose,
+      const ignition::math::Vector3d& moment, const ignition::math::Vector3d& field) const {
+    if (state.linear_velocity.Length() > this->linear_velocity ||
+        state.angular_velocity.Length() > this->angular_velocity)
+      return true;
+    if (pose.Pos().Distance(state.pose.Pos()) > this->wake_distance)
+      return true;
+    // Angle of the relative rotation, from the scalar part of its quaternion
+    double w = std::min(1.0, std::abs((state.pose.Rot().Inverse()*pose.Rot()).W()));
+    if (2*std::acos(w) > this->wake_angle)
+      return true;
+    if ((moment - state.moment).Length() > this->tolerance*state.moment.Length())
+      return true;
+    return (field - state.field).Length() > this->field_tolerance;
+  }
+
+  /// \brief Put a magnet to sleep, remembering what disturbs it
+  void Sleep(SleepState& state, const ignition::math::Pose3d& pose,
+      const ignition::math::Vector3d& moment, const ignition::math::Vector3d& field) const {
+    state.asleep = true;
+    state.pose = pose;
+    state.moment = moment;
+    state.field = field;
+  }
+
+  /// \brief Wake a magnet up. It must be quiet for sleep_time again before
+  /// it can fall asleep.
+  static void Wake(SleepState& state, double time) {
+    state.asleep = false;
+    state.wrench_steady = false;
+    state.quiet_since = time;
+  }
+
+  /// \brief Speeds in m/s and rad/s below which a link is at rest
+  double linear_velocity;
+  double angular_velocity;
+  /// \brief Relative change of the wrench between solves, and of the
+  /// moment, below which a magnet is steady
+  double tolerance;
+  /// \brief Change of the external field in T that wakes a magnet
+  double field_tolerance;
+  /// \brief Displacement in m and rotation in rad that wake a magnet
+  double wake_distance;
+  double wake_angle;
+  /// \brief Seconds of simulation time an island must be quiet to sleep
+  double sleep_time;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_ISLAND_SLEEP_H_
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LATENCY_PROBE_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LATENCY_PROBE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace gazebo {
+
+/// \brief Seconds of the monotonic clock, which processes on the same host
+/// share
+inline double MonotonicSeconds() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// \brief Latency of the samples of one topic, from the physics step that
+/// produced them to their receipt.
+///
+/// The publisher sends a stamp for every sample with its sequence number,
+/// the start of the step and the time of sending. Stamps and samples are
+/// matched by the simulation time in their headers, in whatever order they
+/// arrive. A stamp whose sample has not arrived within the timeout counts
+/// as a dropped sample.
+class LatencyProbe {
+ public:
+  /// \brief Fields of a stamp message, in this order
+  enum StampField {STAMP_SEQ, STAMP_SIM_TIME, STAMP_STEP_TIME, STAMP_SEND_TIME,
+      STAMP_FIELD_COUNT};
+
+  /// \brief Statistics since the previous report
+  struct Report {
+    Report() : received(0), dropped(0), missing(0), step_p50(0), step_p90(0),
+        step_p99(0), step_max(0), send_p50(0), send_p99(0), jitter(0),
+        interarrival_mean(0), interarrival_stddev(0) {
+    }
+
+    /// \brief Samples matched to their stamp
+    long received;
+    /// \brief Stamps whose sample never arrived
+    long dropped;
+    /// \brief Gaps in the stamp sequence, i.e. samples of which not even
+    /// the stamp arrived
+    long missing;
+    /// \brief Percentiles of the time from the start of the step to receipt
+    double step_p50;
+    double step_p90;
+    double step_p99;
+    double step_max;
+    /// \brief Percentiles of the time from sending to receipt
+    double send_p50;
+    double send_p99;
+    /// \brief Interarrival jitter as in RFC 3550: the smoothed deviation of
+    /// the receipt intervals from the send intervals
+    double jitter;
+    /// \brief Time between receipts
+    double interarrival_mean;
+    double interarrival_stddev;
+  };
+
+  explicit LatencyProbe(double _timeout = 1.0) : timeout(_timeout) {
+    this->Clear();
+  }
+
+  /// \brief Forget everything, e.g. after the publisher restarted
+  void Clear() {
+    this->stamps.clear();
+    this->samples.clear();
+    this->stamp_order.clear();
+    this->sample_order.clear();
+    this->step_latency.clear();
+    this->send_latency.clear();
+    this->last_seq = -1;
+    this->last_send = 0;
+    this->last_receipt = -1;
+    this->jitter = 0;
+    this->interarrival_sum = 0;
+    this->interarrival_sq_sum = 0;
+    this->interarrivals = 0;
+    this->dropped = 0;
+    this->missing = 0;
+  }
+
+  /// \brief Handle a stamp
+  /// \param[in] sim_time Simulation time of the sample in nanoseconds
+  /// \param[in] now Monotonic time of receipt in seconds
+  void AddStamp(std::int64_t seq, std::int64_t sim_time, double step_time,
+      double send_time, double now) {
+    // A sequence that starts over is a restarted publisher
+    if (seq <= this->last_seq)
+      this->Clear();
+    if (this->last_seq >= 0)
+      this->missing += seq - this->last_seq - 1;
+    this->last_seq = seq;
+
+    Stamp stamp;
+    stamp.step_time = step_time;
+    stamp.send_time = send_time;
+    std::map<std::int64_t, double>::iterator sample = this->samples.find(sim_time);
+    if (sample != this->samples.end()) {
+      this->Match(stamp, sample->second);
+      this->samples.erase(sample);
+    } else {
+      this->stamps[sim_time] = stamp;
+      this->stamp_order.push_back(std::make_pair(send_time, sim_time));
+    }
+    this->Expire(now);
+  }
+
+  /// \brief Handle a sample
+  /// \param[in] sim_time Simulation time of its header in nanoseconds
+  /// \param[in] receipt Monotonic time of receipt in seconds
+  void AddSample(std::int64_t sim_time, double receipt) {
+    std::map<std::int64_t, Stamp>::iterator stamp = this->stamps.find(sim_time);
+    if (stamp != this->stamps.end()) {
+      this->Match(stamp->second, receipt);
+      this->stamps.erase(stamp);
+    } else {
+      this->samples[sim_time] = receipt;
+      this->sample_order.push_back(std::make_pair(receipt, sim_time));
+    }
+    this->Expire(receipt);
+  }
+
+  /// \brief Statistics since the previous call, which starts a new window
+  Report GetReport(double now) {
+    this->Expire(now);
+    Report report;
+    report.received = this->step_latency.size();
+    report.dropped = this->dropped;
+    report.missing = this->missing;
+    if (!this->step_latency.empty()) {
+      report.step_p50 = Quantile(this->step_latency, 0.5);
+      report.step_p90 = Quantile(this->step_latency, 0.9);
+      report.step_p99 = Quantile(this->step_latency, 0.99);
+      report.step_max = *std::max_element(this->step_latency.begin(), this->step_latency.end());
+      report.send_p50 = Quantile(this->send_latency, 0.5);
+      report.send_p99 = Quantile(this->send_latency, 0.99);
+    }
+    report.jitter = this->jitter;
+    if (this->interarrivals > 0) {
+      double n = this->interarrivals;
+      report.interarrival_mean = this->interarrival_sum/n;
+      double var = this->interarrival_sq_sum/n - report.interarrival_mean*report.interarrival_mean;
+      report.interarrival_stddev = std::sqrt(std::max(0.0, var));
+    }
+
+    this->step_latency.clear();
+    this->send_latency.clear();
+    this->interarrival_sum = 0;
+    this->interarrival_sq_sum = 0;
+    this->interarrivals = 0;
+    this->dropped = 0;
+    this->missing = 0;
+    return report;
+  }
+
+  /// \brief Seconds after which an unmatched stamp or sample is given up
+  double timeout;
+
+ private:
+  struct Stamp {
+    double step_time;
+    double send_time;
+  };
+
+  void Match(const Stamp& stamp, double receipt) {
+    this->step_latency.push_back(receipt - stamp.step_time);
+    this->send_latency.push_back(receipt - stamp.send_time);
+    if (this->last_receipt >= 0) {
+      double interval = receipt - this->last_receipt;
+      double deviation = std::abs(interval - (stamp.send_time - this->last_send));
+      this->jitter += (deviation - this->jitter)/16;
+      this->interarrival_sum += interval;
+      this->interarrival_sq_sum += interval*interval;
+      ++this->interarrivals;
+    }
+    this->last_receipt = receipt;
+    this->last_send = stamp.send_time;
+  }
+
+  /// \brief Give up on stamps and samples that waited longer than the
+  /// timeout. Stamps are sent right after their sample, so an expired stamp
+  /// is a dropped sample.
+  ///
+  /// Only the fronts of the queues are looked at, as they are in the order
+  /// of their deadlines. Entries matched meanwhile are no longer in the maps,
+  /// or were replaced by a later one with the same time, and are skipped.
+  void Expire(double now) {
+    while (!this->stamp_order.empty() &&
+        now - this->stamp_order.front().first > this->timeout) {
+      std::map<std::int64_t, Stamp>::iterator it =
+          this->stamps.find(this->stamp_order.front().second);
+      if (it != this->stamps.end() &&
+          it->second.send_time == this->stamp_order.front().first) {
+        ++this->dropped;
+        this->stamps.erase(it);
+      }
+      this->stamp_order.pop_front();
+    }
+    while (!this->sample_order.empty() &&
+        now - this->sample_order.front().first > this->timeout) {
+      std::map<std::int64_t, double>::iterator it =
+          this->samples.find(this->sample_order.front().second);
+      if (it != this->samples.end() && it->second == this->sample_order.front().first)
+        this->samples.erase(it);
+      this->sample_order.pop_front();
+    }
+  }
+
+  /// \brief Nearest-rank quantile, reordering v
+  static double Quantile(std::vector<double>& v, double q) {
+    size_t k = std::min(v.size() - 1, static_cast<size_t>(q*(v.size() - 1) + 0.5));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+  }
+
+  /// \brief Stamps waiting for their sample, by simulation time
+  std::map<std::int64_t, Stamp> stamps;
+  /// \brief Receipt times of samples waiting for their stamp
+  std::map<std::int64_t, double> samples;
+  /// \brief Send times of the stamps and receipt times of the samples that
+  /// were left waiting, with their simulation times, in arrival order. The
+  /// publisher sends in sequence and a restart clears them, so the times
+  /// never decrease.
+  std::deque<std::pair<double, std::int64_t> > stamp_order;
+  std::deque<std::pair<double, std::int64_t> > sample_order;
+  std::vector<double> step_latency;
+  std::vector<double> send_latency;
+  std::int64_t last_seq;
+  double last_send;
+  double last_receipt;
+  double jitter;
+  double interarrival_sum;
+  double interarrival_sq_sum;
+  long interarrivals;
+  long dropped;
+  long missing;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LATENCY_PROBE_H_
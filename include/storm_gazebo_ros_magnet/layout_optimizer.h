@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LAYOUT_OPTIMIZER_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LAYOUT_OPTIMIZER_H_
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <ignition/math/Vector3.hh>
+
+#include "storm_gazebo_ros_magnet/lbfgs.h"
+#include "storm_gazebo_ros_magnet/task_pool.h"
+
+namespace gazebo {
+
+/// \brief Places point dipoles of fixed strength to maximize a weighted
+/// sum of field, field gradient and force components at target points.
+///
+/// Every magnet has six unknowns, its position and a direction vector u
+/// with m = |m| u/|u|. The objective and its gradient are analytic: the
+/// field of a dipole is linear in its moment, and derivatives with respect
+/// to its position are derivatives of the dipole kernel up to third order.
+/// Bounds, a minimum spacing between magnets and a clearance around the
+/// target points are enforced by quadratic penalties. The field of a dipole
+/// grows without bound towards it, so a positive clearance is needed for
+/// the problem to have a maximum.
+class MagnetLayout {
+ public:
+  struct Magnet {
+    Magnet() : fix_position(false), fix_direction(false) {
+    }
+
+    std::string name;
+    ignition::math::Vector3d position;
+    /// \brief World frame moment. Its magnitude stays fixed.
+    ignition::math::Vector3d moment;
+    bool fix_position;
+    bool fix_direction;
+  };
+
+  enum TermType {
+    /// \brief direction . B
+    FIELD,
+    /// \brief direction . G second, with G(a, b) = dB_a/dx_b
+    GRADIENT,
+    /// \brief direction . F on a probe dipole, F = G probe
+    FORCE
+  };
+
+  /// \brief Component of the field, gradient or force at a target point,
+  /// weighted in the sum that is maximized
+  struct Term {
+    TermType type;
+    ignition::math::Vector3d point;
+    ignition::math::Vector3d direction;
+    /// \brief Second direction of GRADIENT, probe moment of FORCE
+    ignition::math::Vector3d second;
+    double weight;
+  };
+
+  MagnetLayout() : has_bounds(false), min_distance(0), clearance(0),
+      penalty(1e6), pool(NULL) {
+    // Positions are in meters, so unlimited first steps overshoot
+    this->minimizer.max_step = 0.01;
+  }
+
+  /// \brief Optimize the magnets
+  /// \return Weighted sum of the terms at the optimum
+  double Optimize() {
+    std::vector<double> x(6*this->magnets.size());
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      const Magnet& mag = this->magnets[i];
+      ignition::math::Vector3d u = mag.moment.Normalized();
+      for (int a = 0; a < 3; ++a) {
+        x[6*i + a] = mag.position[a];
+        x[6*i + 3 + a] = u[a];
+      }
+    }
+    if (!x.empty()) {
+      this->minimizer.Minimize(std::bind(&MagnetLayout::Evaluate, this,
+            std::placeholders::_1, std::placeholders::_2), x);
+      this->Unpack(x);
+    }
+    return this->Objective();
+  }
+
+  /// \brief Weighted sum of the terms for the current magnets
+  double Objective() const {
+    double sum = 0;
+    for (size_t t = 0; t < this->terms.size(); ++t) {
+      for (size_t i = 0; i < this->magnets.size(); ++i) {
+        ignition::math::Vector3d r = this->terms[t].point - this->magnets[i].position;
+        ignition::math::Vector3d d_r, d_m;
+        if (r.SquaredLength() > 0)
+          sum += this->terms[t].weight*TermValue(this->terms[t], r, this->magnets[i].moment, d_r, d_m);
+      }
+    }
+    return sum;
+  }
+
+  /// \brief Penalty energy of the constraints for the current magnets
+  double Violation() const {
+    std::vector<double> g(6*this->magnets.size(), 0.0);
+    return this->Penalties(g);
+  }
+
+  /// \brief Objective to minimize, the negated weighted sum plus penalties
+  double Evaluate(const std::vector<double>& x, std::vector<double>& g) {
+    this->Unpack(x);
+    const size_t n = this->magnets.size();
+    std::fill(g.begin(), g.end(), 0.0);
+
+    // Each task owns a range of magnets and their gradient entries. The
+    // partial sums are added in a fixed order, so results do not depend on
+    // the thread count.
+    std::vector<double> partial(n, 0.0);
+    std::vector<TaskPool::Task> tasks;
+    const size_t threads = this->pool ? this->pool->GetThreadCount() : 1;
+    const size_t chunk = std::max<size_t>(1, (n + 4*threads - 1)/(4*threads));
+    for (size_t begin = 0; begin < n; begin += chunk) {
+      const size_t end = std::min(begin + chunk, n);
+      tasks.push_back([this, &x, &g, &partial, begin, end]() {
+        for (size_t i = begin; i < end; ++i)
+          partial[i] = this->MagnetTerms(i, x, g);
+      });
+    }
+    if (this->pool) {
+      this->pool->Run(tasks);
+    } else {
+      for (size_t t = 0; t < tasks.size(); ++t)
+        tasks[t]();
+    }
+
+    double value = 0;
+    for (size_t i = 0; i < n; ++i)
+      value += partial[i];
+    value += this->Penalties(g);
+
+    for (size_t i = 0; i < n; ++i) {
+      for (int a = 0; a < 3; ++a) {
+        if (this->magnets[i].fix_position)
+          g[6*i + a] = 0;
+        if (this->magnets[i].fix_direction)
+          g[6*i + 3 + a] = 0;
+      }
+    }
+    return value;
+  }
+
+  /// \brief Write the magnets as static models with a dipole_magnet plugin.
+  /// The cylinder axis of each model is along its moment.
+  void WriteWorldSnippet(std::ostream& out, double radius, double length) const {
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      const Magnet& mag = this->magnets[i];
+      ignition::math::Vector3d u = mag.moment.Normalized();
+      double pitch = std::acos(std::max(-1.0, std::min(1.0, u.Z())));
+      double yaw = std::atan2(u.Y(), u.X());
+      out << "    <model name=\"" << mag.name << "\">\n"
+          << "      <pose>" << mag.position.X() << " " << mag.position.Y() << " "
+          << mag.position.Z() << " 0 " << pitch << " " << yaw << "</pose>\n"
+          << "      <static>true</static>\n"
+          << "      <link name=\"magnet\">\n";
+      const char* elements[] = {"collision", "visual"};
+      for (int e = 0; e < 2; ++e) {
+        out << "        <" << elements[e] << " name=\"" << elements[e] << "\">\n"
+            << "          <geometry>\n"
+            << "            <cylinder>\n"
+            << "              <radius>" << radius << "</radius>\n"
+            << "              <length>" << length << "</length>\n"
+            << "            </cylinder>\n"
+            << "          </geometry>\n"
+            << "        </" << elements[e] << ">\n";
+      }
+      out << "      </link>\n"
+          << "      <plugin name=\"dipole_magnet\" filename=\"libstorm_gazebo_dipole_magnet.so\">\n"
+          << "        <bodyName>magnet</bodyName>\n"
+          << "        <dipole_moment>0 0 " << mag.moment.Length() << "</dipole_moment>\n"
+          << "      </plugin>\n"
+          << "    </model>\n";
+    }
+  }
+
+  /// \brief Value of a term for one dipole, with its derivatives
+  /// \param[in] term Term
+  /// \param[in] r Target point relative to the dipole
+  /// \param[in] m World frame moment of the dipole
+  /// \param[out] d_r Derivative with respect to r
+  /// \param[out] d_m Derivative with respect to m
+  static double TermValue(const Term& term, const ignition::math::Vector3d& r,
+      const ignition::math::Vector3d& m, ignition::math::Vector3d& d_r,
+      ignition::math::Vector3d& d_m) {
+    const double k = 1e-7;
+    const double r2 = r.SquaredLength();
+    const double ir2 = 1.0/r2;
+    const double ir3 = ir2/std::sqrt(r2);
+    const double ir5 = ir3*ir2;
+    const double ir7 = ir5*ir2;
+    const double mr = m.Dot(r);
+    const ignition::math::Vector3d& d1 = term.direction;
+
+    if (term.type == FIELD) {
+      // S = d.B = k (3 (m.r)(d.r)/r^5 - m.d/r^3)
+      const double dr = d1.Dot(r);
+      d_m = (r*(3*dr*ir5) - d1*ir3)*k;
+      d_r = (m*(3*k*dr*ir5) + d1*(3*k*mr*ir5) + r*(3*k*m.Dot(d1)*ir5 - 15*k*mr*dr*ir7));
+      return k*(3*mr*dr*ir5 - m.Dot(d1)*ir3);
+    }
+
+    // S = d1.G d2, the same for a gradient component and the force on a
+    // probe dipole since G is symmetric
+    const ignition::math::Vector3d& d2 = term.second;
+    const double ir9 = ir7*ir2;
+    const double d1r = d1.Dot(r);
+    const double d2r = d2.Dot(r);
+    const double d12 = d1.Dot(d2);
+    const double md1 = m.Dot(d1);
+    const double md2 = m.Dot(d2);
+    d_m = (d2*d1r + d1*d2r + r*d12)*(3*k*ir5) - r*(15*k*d1r*d2r*ir7);
+    d_r = (d1*md2 + d2*md1 + m*d12)*(3*k*ir5) -
+        r*(15*k*(md2*d1r + md1*d2r + mr*d12)*ir7) -
+        (m*(d1r*d2r) + d1*(mr*d2r) + d2*(mr*d1r))*(15*k*ir7) +
+        r*(105*k*mr*d1r*d2r*ir9);
+    return 3*k*(md2*d1r + md1*d2r + mr*d12)*ir5 - 15*k*mr*d1r*d2r*ir7;
+  }
+
+  std::vector<Magnet> magnets;
+  std::vector<Term> terms;
+
+  /// \brief Box the magnet positions stay in, when has_bounds is set
+  bool has_bounds;
+  ignition::math::Vector3d lower;
+  ignition::math::Vector3d upper;
+  /// \brief Smallest distance between two magnets
+  double min_distance;
+  /// \brief Smallest distance between a magnet and a target point
+  double clearance;
+  /// \brief Stiffness of the constraint penalties
+  double penalty;
+
+  Lbfgs minimizer;
+  /// \brief Pool to evaluate magnets in parallel, or NULL
+  TaskPool* pool;
+
+ private:
+  /// \brief Set positions and moments from the unknowns
+  void Unpack(const std::vector<double>& x) {
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      Magnet& mag = this->magnets[i];
+      ignition::math::Vector3d u(x[6*i + 3], x[6*i + 4], x[6*i + 5]);
+      mag.position.Set(x[6*i], x[6*i + 1], x[6*i + 2]);
+      mag.moment = u.Normalized()*mag.moment.Length();
+    }
+  }
+
+  /// \brief Negated weighted terms of magnet i, with their gradient
+  double MagnetTerms(size_t i, const std::vector<double>& x, std::vector<double>& g) const {
+    const Magnet& mag = this->magnets[i];
+    ignition::math::Vector3d g_p(0, 0, 0);
+    ignition::math::Vector3d g_m(0, 0, 0);
+    double value = 0;
+    for (size_t t = 0; t < this->terms.size(); ++t) {
+      const Term& term = this->terms[t];
+      ignition::math::Vector3d r = term.point - mag.position;
+      double dist = r.Length();
+      if (dist == 0)
+        continue;
+      // Inside the clearance the term is taken on the clearance sphere, so
+      // the singularity of the dipole cannot outgrow the penalty
+      double shrink = dist < this->clearance ? this->clearance/dist : 1.0;
+      ignition::math::Vector3d d_r, d_m;
+      value -= term.weight*TermValue(term, r*shrink, mag.moment, d_r, d_m);
+      if (shrink > 1) {
+        ignition::math::Vector3d r_hat = r/dist;
+        d_r = (d_r - r_hat*r_hat.Dot(d_r))*shrink;
+      }
+      // r = point - position
+      g_p += d_r*term.weight;
+      g_m -= d_m*term.weight;
+    }
+
+    // m = |m| u/|u|, so only the part of g_m normal to u remains
+    ignition::math::Vector3d u(x[6*i + 3], x[6*i + 4], x[6*i + 5]);
+    double u_len = u.Length();
+    ignition::math::Vector3d u_hat = u/u_len;
+    ignition::math::Vector3d g_u = (g_m - u_hat*u_hat.Dot(g_m))*(mag.moment.Length()/u_len);
+    for (int a = 0; a < 3; ++a) {
+      g[6*i + a] += g_p[a];
+      g[6*i + 3 + a] += g_u[a];
+    }
+    return value;
+  }
+
+  /// \brief Penalty energy of the constraints, with its gradient added to g
+  double Penalties(std::vector<double>& g) const {
+    const double k = this->penalty;
+    double energy = 0;
+    for (size_t i = 0; i < this->magnets.size(); ++i) {
+      const ignition::math::Vector3d& p = this->magnets[i].position;
+      if (this->has_bounds) {
+        for (int a = 0; a < 3; ++a) {
+          double below = this->lower[a] - p[a];
+          double above = p[a] - this->upper[a];
+          if (below > 0) {
+            energy += 0.5*k*below*below;
+            g[6*i + a] -= k*below;
+          }
+          if (above > 0) {
+            energy += 0.5*k*above*above;
+            g[6*i + a] += k*above;
+          }
+        }
+      }
+
+      for (size_t t = 0; t < this->terms.size() && this->clearance > 0; ++t) {
+        ignition::math::Vector3d d = p - this->terms[t].point;
+        double dist = d.Length();
+        double depth = this->clearance - dist;
+        if (depth > 0 && dist > 0) {
+          energy += 0.5*k*depth*depth;
+          for (int a = 0; a < 3; ++a)
+            g[6*i + a] -= k*depth*d[a]/dist;
+        }
+      }
+
+      for (size_t j = i + 1; j < this->magnets.size() && this->min_distance > 0; ++j) {
+        ignition::math::Vector3d d = p - this->magnets[j].position;
+        double dist = d.Length();
+        double depth = this->min_distance - dist;
+        if (depth > 0 && dist > 0) {
+          energy += 0.5*k*depth*depth;
+          for (int a = 0; a < 3; ++a) {
+            g[6*i + a] -= k*depth*d[a]/dist;
+            g[6*j + a] += k*depth*d[a]/dist;
+          }
+        }
+      }
+    }
+    return energy;
+  }
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LAYOUT_OPTIMIZER_H_
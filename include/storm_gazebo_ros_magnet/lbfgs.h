@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LBFGS_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LBFGS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace gazebo {
+
+/// \brief Limited memory BFGS minimizer with a backtracking line search.
+///
+/// The objective returns its value at x and writes its gradient into g,
+/// which has the size of x.
+class Lbfgs {
+ public:
+  typedef std::function<double(const std::vector<double>& x, std::vector<double>& g)> Objective;
+
+  Lbfgs() : history(8), max_iterations(200), gradient_tolerance(1e-6),
+      max_step(0), iterations(0), converged(false) {
+  }
+
+  /// \brief Minimize the objective starting from x
+  /// \param[in] f Objective
+  /// \param[in,out] x Start point, replaced by the minimizer found
+  /// \return Objective value at x
+  double Minimize(const Objective& f, std::vector<double>& x) {
+    const size_t n = x.size();
+    std::vector<double> g(n);
+    std::vector<double> d(n);
+    std::vector<double> x_new(n);
+    std::vector<double> g_new(n);
+    std::deque<std::vector<double> > s_hist;
+    std::deque<std::vector<double> > y_hist;
+    std::deque<double> rho_hist;
+    std::vector<double> alpha(this->history);
+
+    double fx = f(x, g);
+    this->iterations = 0;
+    this->converged = false;
+
+    while (this->iterations < this->max_iterations) {
+      if (NormInf(g) <= this->gradient_tolerance) {
+        this->converged = true;
+        break;
+      }
+
+      // Two-loop recursion for d = -H g
+      for (size_t i = 0; i < n; ++i)
+        d[i] = -g[i];
+      for (int k = static_cast<int>(s_hist.size()) - 1; k >= 0; --k) {
+        alpha[k] = rho_hist[k]*Dot(s_hist[k], d);
+        Axpy(-alpha[k], y_hist[k], d);
+      }
+      if (!s_hist.empty()) {
+        const std::vector<double>& s = s_hist.back();
+        const std::vector<double>& y = y_hist.back();
+        double gamma = Dot(s, y)/Dot(y, y);
+        for (size_t i = 0; i < n; ++i)
+          d[i] *= gamma;
+      }
+      for (size_t k = 0; k < s_hist.size(); ++k) {
+        double beta = rho_hist[k]*Dot(y_hist[k], d);
+        Axpy(alpha[k] - beta, s_hist[k], d);
+      }
+
+      double slope = Dot(g, d);
+      if (slope >= 0) {
+        // Not a descent direction, start over from steepest descent
+        s_hist.clear();
+        y_hist.clear();
+        rho_hist.clear();
+        for (size_t i = 0; i < n; ++i)
+          d[i] = -g[i];
+        slope = Dot(g, d);
+      }
+
+      // Without curvature information the first step has unit length
+      double step = s_hist.empty() ? 1.0/std::max(NormInf(d), 1e-300) : 1.0;
+      if (this->max_step > 0)
+        step = std::min(step, this->max_step/std::max(NormInf(d), 1e-300));
+
+      double f_new = fx;
+      bool accepted = false;
+      for (int k = 0; k < 40; ++k) {
+        for (size_t i = 0; i < n; ++i)
+          x_new[i] = x[i] + step*d[i];
+        f_new = f(x_new, g_new);
+        if (f_new <= fx + 1e-4*step*slope) {
+          accepted = true;
+          break;
+        }
+        step *= 0.5;
+      }
+      ++this->iterations;
+      if (!accepted) {
+        if (s_hist.empty())
+          break;
+        s_hist.clear();
+        y_hist.clear();
+        rho_hist.clear();
+        continue;
+      }
+
+      std::vector<double> s(n);
+      std::vector<double> y(n);
+      for (size_t i = 0; i < n; ++i) {
+        s[i] = x_new[i] - x[i];
+        y[i] = g_new[i] - g[i];
+      }
+      double sy = Dot(s, y);
+      if (sy > 1e-12*std::sqrt(Dot(s, s)*Dot(y, y))) {
+        if (s_hist.size() == this->history) {
+          s_hist.pop_front();
+          y_hist.pop_front();
+          rho_hist.pop_front();
+        }
+        s_hist.push_back(s);
+        y_hist.push_back(y);
+        rho_hist.push_back(1.0/sy);
+      }
+
+      x.swap(x_new);
+      g.swap(g_new);
+      fx = f_new;
+    }
+    return fx;
+  }
+
+  /// \brief Number of correction pairs kept
+  size_t history;
+  int max_iterations;
+  /// \brief Stop once no gradient component is larger than this
+  double gradient_tolerance;
+  /// \brief Largest change of any variable in one iteration, 0 for no limit
+  double max_step;
+  /// \brief Number of iterations of the last minimization
+  int iterations;
+  /// \brief Whether the last minimization met the gradient tolerance
+  bool converged;
+
+ private:
+  static double Dot(const std::vector<double>& a, const std::vector<double>& b) {
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+      sum += a[i]*b[i];
+    return sum;
+  }
+
+  static double NormInf(const std::vector<double>& a) {
+    double norm = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+      norm = std::max(norm, std::abs(a[i]));
+    return norm;
+  }
+
+  static void Axpy(double a, const std::vector<double>& x, std::vector<double>& y) {
+    for (size_t i = 0; i < x.size(); ++i)
+      y[i] += a*x[i];
+  }
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_LBFGS_H_
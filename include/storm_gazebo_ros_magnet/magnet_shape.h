@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MAGNET_SHAPE_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MAGNET_SHAPE_H_
+
+#include <cmath>
+#include <vector>
+
+#include <ignition/math/Vector3.hh>
+
+namespace gazebo {
+
+/// \brief Volume of a uniformly magnetized magnet, discretized for quadrature.
+///
+/// The moment of the magnet is split over quadrature points of its volume,
+/// which turns the finite-size interaction of two magnets into a weighted
+/// sum of dipole interactions. Points are given in the magnet frame, the
+/// cylinder axis is its z axis. A uniformly magnetized sphere is exactly a
+/// dipole outside its volume and is represented by a single point.
+struct MagnetShape {
+  enum Type {
+    POINT,
+    SPHERE,
+    CYLINDER,
+    BOX
+  };
+
+  MagnetShape() : type(POINT), radius(0) {
+    this->Build();
+  }
+
+  /// \brief Set up a point dipole
+  void SetPoint() {
+    this->type = POINT;
+    this->size = ignition::math::Vector3d::Zero;
+    this->Build();
+  }
+
+  /// \brief Set up a sphere
+  void SetSphere(double _radius) {
+    this->type = SPHERE;
+    this->size.Set(_radius, _radius, _radius);
+    this->Build();
+  }
+
+  /// \brief Set up a cylinder along z
+  void SetCylinder(double _radius, double _length) {
+    this->type = CYLINDER;
+    this->size.Set(_radius, _radius, _length);
+    this->Build();
+  }
+
+  /// \brief Set up a box with edge lengths _size
+  void SetBox(const ignition::math::Vector3d& _size) {
+    this->type = BOX;
+    this->size = _size;
+    this->Build();
+  }
+
+  Type type;
+  /// \brief Box edges, cylinder (radius, radius, length) or sphere radius
+  ignition::math::Vector3d size;
+  /// \brief Radius of the bounding sphere
+  double radius;
+  /// \brief Quadrature points in the magnet frame
+  std::vector<ignition::math::Vector3d> points;
+  /// \brief Fraction of the moment carried by each point, sums to 1
+  std::vector<double> weights;
+
+ private:
+  void Build() {
+    // 3 point Gauss-Legendre rule on [-1, 1]
+    static const double gl3_x[3] = {-std::sqrt(0.6), 0.0, std::sqrt(0.6)};
+    static const double gl3_w[3] = {5.0/9, 8.0/9, 5.0/9};
+    // 2 point Gauss-Legendre rule on [-1, 1]
+    static const double gl2_x[2] = {-1/std::sqrt(3.0), 1/std::sqrt(3.0)};
+    static const int n_theta = 6;
+
+    this->points.clear();
+    this->weights.clear();
+    switch (this->type) {
+      case BOX:
+        this->radius = 0.5*this->size.Length();
+        for (int i = 0; i < 3; ++i)
+          for (int j = 0; j < 3; ++j)
+            for (int k = 0; k < 3; ++k) {
+              this->points.push_back(ignition::math::Vector3d(
+                    0.5*this->size.X()*gl3_x[i],
+                    0.5*this->size.Y()*gl3_x[j],
+                    0.5*this->size.Z()*gl3_x[k]));
+              this->weights.push_back(gl3_w[i]*gl3_w[j]*gl3_w[k]/8);
+            }
+        break;
+      case CYLINDER: {
+        double r = this->size.X();
+        double h = this->size.Z();
+        this->radius = std::sqrt(r*r + 0.25*h*h);
+        // Gauss in z, Gauss in r^2 (uniform area measure) and uniform in angle
+        for (int k = 0; k < 3; ++k)
+          for (int i = 0; i < 2; ++i) {
+            double rho = r*std::sqrt(0.5*(gl2_x[i] + 1));
+            for (int t = 0; t < n_theta; ++t) {
+              double theta = (2*M_PI*t)/n_theta;
+              this->points.push_back(ignition::math::Vector3d(
+                    rho*std::cos(theta), rho*std::sin(theta), 0.5*h*gl3_x[k]));
+              this->weights.push_back(0.5*gl3_w[k]*0.5/n_theta);
+            }
+          }
+        break;
+      }
+      case SPHERE:
+        this->radius = this->size.X();
+        this->points.push_back(ignition::math::Vector3d::Zero);
+        this->weights.push_back(1.0);
+        break;
+      case POINT:
+      default:
+        this->radius = 0;
+        this->points.push_back(ignition::math::Vector3d::Zero);
+        this->weights.push_back(1.0);
+        break;
+    }
+  }
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MAGNET_SHAPE_H_
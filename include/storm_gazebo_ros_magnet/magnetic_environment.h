@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MAGNETIC_ENVIRONMENT_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MAGNETIC_ENVIRONMENT_H_
+
+
+#include <gazebo/gazebo.hh>
+#include <gazebo/physics/physics.hh>
+#include <gazebo/common/common.hh>
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <geometry_msgs/Vector3.h>
+#include <std_msgs/Float64MultiArray.h>
+#include <std_srvs/Trigger.h>
+
+#include <memory>
+#include <vector>
+
+#include "storm_gazebo_ros_magnet/background_field.h"
+#include "storm_gazebo_ros_magnet/dipole_magnet_container.h"
+
+namespace gazebo {
+
+/// \brief World plugin holding the parts of the magnetic scene that are not
+/// attached to a DipoleMagnet model, such as ferromagnetic boundaries and
+/// background fields.
+class MagneticEnvironment : public WorldPlugin {
+ public:
+  MagneticEnvironment();
+
+  ~MagneticEnvironment();
+
+  /// \brief Loads the plugin
+  void Load(physics::WorldPtr _world, sdf::ElementPtr _sdf);
+
+  /// \brief Resets the field sources to their loaded state
+  void Reset();
+
+  /// \brief Thread to interact with ROS
+  void QueueThread();
+
+  /// \brief Called by the world update start event, before any magnet
+  void OnUpdate(const common::UpdateInfo & /*_info*/);
+
+ private:
+  /// \brief Create the ROS node on first use
+  /// \return False if ROS is not initialized
+  bool InitRos();
+
+  /// \brief Service callback scheduling a checkpoint at the next step
+  bool OnSaveCheckpoint(std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res);
+
+  /// \brief Service callback scheduling a restore at the next step
+  bool OnRestoreCheckpoint(std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res);
+
+  /// \brief Move free magnet models to a local magnetostatic equilibrium
+  /// as described by the <equilibrium> element
+  void SolveEquilibrium();
+
+  /// \brief Parse a <governor> element and advertise its topic
+  void LoadGovernor(sdf::ElementPtr _sdf);
+
+  /// \brief Publish the governor settings and error estimates
+  void PublishGovernor();
+
+  /// \brief Parse an <energy> element and advertise its topic
+  void LoadEnergy(sdf::ElementPtr _sdf);
+
+  /// \brief Close the energy balance of the previous step and publish it
+  void UpdateEnergy();
+
+  /// \brief Parse a <ferromagnetic_plane> element
+  /// \param[in] _sdf The element to parse
+  /// \param[out] plane Parsed plane
+  /// \return False if the element is invalid
+  bool LoadPlane(sdf::ElementPtr _sdf, DipoleMagnetContainer::FerromagneticPlane& plane);
+
+  /// \brief Parse a <background_field> element and subscribe to its topics
+  /// \param[in] _sdf The element to parse
+  /// \return The parsed field
+  std::shared_ptr<BackgroundField> LoadBackgroundField(sdf::ElementPtr _sdf);
+
+  /// \brief Callback for runtime field commands
+  void OnField(const geometry_msgs::Vector3::ConstPtr& msg,
+      std::shared_ptr<BackgroundField> field);
+
+  /// \brief Callback for runtime gradient commands, 9 values in row-major order
+  void OnGradient(const std_msgs::Float64MultiArray::ConstPtr& msg,
+      std::shared_ptr<BackgroundField> field);
+
+  physics::WorldPtr world;
+
+  /// \brief Container of the magnets in this world
+  std::shared_ptr<DipoleMagnetContainer> container;
+
+  /// \brief Field sources added to the container by this plugin
+  DipoleMagnetContainer::FieldSourcePtrV field_sources;
+  /// \brief State of field_sources right after loading
+  std::vector<std::shared_ptr<const void> > initial_states;
+
+  /// \brief <equilibrium> element, solved before the first step
+  sdf::ElementPtr equilibrium_sdf;
+
+  /// \brief Checkpoint used by the checkpoint services
+  DipoleMagnetContainer::Checkpoint checkpoint;
+  bool has_checkpoint;
+  bool save_requested;
+  bool restore_requested;
+  boost::mutex checkpoint_lock;
+
+  std::string robot_namespace;
+  ros::NodeHandle* rosnode;
+  std::vector<ros::Subscriber> subscribers;
+  std::vector<ros::ServiceServer> services;
+  ros::Publisher governor_pub;
+  std_msgs::Float64MultiArray governor_msg;
+  double governor_rate;
+  common::Time governor_time;
+  ros::Publisher energy_pub;
+  std_msgs::Float64MultiArray energy_msg;
+  double energy_rate;
+  common::Time energy_time;
+  /// \brief Simulation time of the step the magnets last added their
+  /// energy in
+  common::Time energy_step_time;
+
+  // Custom Callback Queue
+  ros::CallbackQueue queue;
+  boost::thread callback_queue_thread;
+
+  // Pointer to the update event connection
+  event::ConnectionPtr update_connection;
+};
+
+}
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MAGNETIC_ENVIRONMENT_H_
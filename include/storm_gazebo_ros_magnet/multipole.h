@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MULTIPOLE_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MULTIPOLE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <ignition/math/Matrix3.hh>
+#include <ignition/math/Vector3.hh>
+
+namespace gazebo {
+
+/// \brief Field of a point dipole
+/// \param[in] r Field point relative to the dipole
+/// \param[in] m Dipole moment
+/// \return Magnetic field at r
+inline ignition::math::Vector3d DipoleField(const ignition::math::Vector3d& r,
+    const ignition::math::Vector3d& m) {
+  double r2 = r.SquaredLength();
+  double r1 = std::sqrt(r2);
+  return (r*(3*m.Dot(r)/r2) - m)*(1e-7/(r2*r1));
+}
+
+/// \brief Force between two point dipoles
+/// \param[in] r Position of the second dipole relative to the first
+/// \param[in] m1 Moment of the first dipole
+/// \param[in] m2 Moment of the second dipole
+/// \return Force on the second dipole, grad(m2.B1)
+inline ignition::math::Vector3d DipoleForce(const ignition::math::Vector3d& r,
+    const ignition::math::Vector3d& m1, const ignition::math::Vector3d& m2) {
+  double r2 = r.SquaredLength();
+  double r1 = std::sqrt(r2);
+  double m1r = m1.Dot(r);
+  double m2r = m2.Dot(r);
+  return (m2*m1r + m1*m2r + r*(m1.Dot(m2) - 5*m1r*m2r/r2))*(3e-7/(r2*r2*r1));
+}
+
+/// \brief Dipole plus quadrupole expansion of a rigid set of point dipoles.
+///
+/// The expansion is taken about the geometric center of the set. With
+/// r measured from the center the reduced scalar potential is
+///   psi(r) = M.r/|r|^3 + r.Q.r/|r|^5
+/// and the field is B = -mu_0/(4 pi) grad(psi).
+struct Multipole {
+  Multipole() : radius(0) {
+  }
+
+  /// \brief Rebuild the expansion
+  /// \param[in] positions World positions of the dipoles
+  /// \param[in] moments World frame dipole moments
+  void Build(const std::vector<ignition::math::Vector3d>& positions,
+      const std::vector<ignition::math::Vector3d>& moments) {
+    this->center = ignition::math::Vector3d::Zero;
+    this->dipole = ignition::math::Vector3d::Zero;
+    this->quadrupole = ignition::math::Matrix3d::Zero;
+    this->radius = 0;
+    if (positions.empty())
+      return;
+
+    for (size_t i = 0; i < positions.size(); ++i)
+      this->center += positions[i];
+    this->center /= static_cast<double>(positions.size());
+
+    // S is the symmetric part of sum(m_i d_i^T). The antisymmetric part does
+    // not contribute to the potential outside the sources.
+    ignition::math::Matrix3d S = ignition::math::Matrix3d::Zero;
+    for (size_t i = 0; i < positions.size(); ++i) {
+      ignition::math::Vector3d d = positions[i] - this->center;
+      const ignition::math::Vector3d& m = moments[i];
+      this->dipole += m;
+      this->radius = std::max(this->radius, d.Length());
+      for (int a = 0; a < 3; ++a)
+        for (int b = 0; b < 3; ++b)
+          S(a, b) += 0.5*(m[a]*d[b] + m[b]*d[a]);
+    }
+
+    double trace = S(0, 0) + S(1, 1) + S(2, 2);
+    this->quadrupole = S*3.0 - ignition::math::Matrix3d::Identity*trace;
+  }
+
+  /// \brief Field and force/torque on a point dipole outside the sources
+  /// \param[in] p Position of the dipole
+  /// \param[in] m World frame moment of the dipole
+  /// \param[out] force Force on the dipole
+  /// \param[out] torque Torque on the dipole
+  /// \param[out] field Magnetic field at p
+  void GetForceTorque(const ignition::math::Vector3d& p,
+      const ignition::math::Vector3d& m,
+      ignition::math::Vector3d& force,
+      ignition::math::Vector3d& torque,
+      ignition::math::Vector3d& field) const {
+    const double mu0_4pi = 1e-7;
+    ignition::math::Vector3d r = p - this->center;
+    double r2 = r.SquaredLength();
+    double r1 = std::sqrt(r2);
+    double ir3 = 1.0/(r2*r1);
+    double ir5 = ir3/r2;
+    double ir7 = ir5/r2;
+    double ir9 = ir7/r2;
+
+    const ignition::math::Vector3d& M = this->dipole;
+    const ignition::math::Matrix3d& Q = this->quadrupole;
+    ignition::math::Vector3d Qr = Q*r;
+    double Mr = M.Dot(r);
+    double rQr = r.Dot(Qr);
+
+    // grad(psi)
+    ignition::math::Vector3d grad = M*ir3 - r*(3*Mr*ir5) +
+        Qr*(2*ir5) - r*(5*rQr*ir7);
+
+    // Hessian of psi
+    ignition::math::Matrix3d H;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        double delta = (i == j) ? 1.0 : 0.0;
+        H(i, j) = -3*(M[i]*r[j] + M[j]*r[i] + Mr*delta)*ir5 +
+            15*Mr*r[i]*r[j]*ir7 +
+            2*Q(i, j)*ir5 - 10*(Qr[i]*r[j] + r[i]*Qr[j])*ir7 -
+            5*rQr*delta*ir7 + 35*rQr*r[i]*r[j]*ir9;
+      }
+    }
+
+    field = grad*(-mu0_4pi);
+    force = (H*m)*(-mu0_4pi);
+    torque = m.Cross(field);
+  }
+
+  ignition::math::Vector3d center;
+  ignition::math::Vector3d dipole;
+  ignition::math::Matrix3d quadrupole;
+  /// \brief Largest distance of a constituent dipole from the center
+  double radius;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_MULTIPOLE_H_
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_QUALITY_GOVERNOR_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_QUALITY_GOVERNOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+namespace gazebo {
+
+/// \brief Trades accuracy of the magnet solver for time to stay within a
+/// per-step budget.
+///
+/// The time spent in magnet updates is summed over each step and smoothed.
+/// While it is above the budget the governor moves one level down a ladder
+/// of cheaper settings, and while it is well below the budget one level back
+/// up. Every level changes a single knob, in order of increasing harm:
+/// publishing less often, a wider far-field opening angle, a shorter cutoff
+/// radius and finally holding forces for several steps.
+class QualityGovernor {
+ public:
+  /// \brief Solver settings of one level
+  struct Settings {
+    Settings() : far_field_ratio(0), cutoff(0), update_interval(1), publish_interval(1) {
+    }
+
+    /// \brief Overrides the plugins' farFieldRatio when lower, 0 for no
+    /// override. The opening angle is its inverse.
+    double far_field_ratio;
+    /// \brief Models farther than this are ignored, 0 for no cutoff
+    double cutoff;
+    /// \brief Interactions are solved every update_interval steps and held
+    /// in between
+    int update_interval;
+    /// \brief Plugins publish every publish_interval steps
+    int publish_interval;
+  };
+
+  /// \brief Measures the time until it goes out of scope
+  class Timer {
+   public:
+    explicit Timer(QualityGovernor* _governor) : governor(_governor) {
+      if (this->governor)
+        this->start = std::chrono::steady_clock::now();
+    }
+
+    ~Timer() {
+      if (this->governor) {
+        this->governor->step_time += std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - this->start).count();
+      }
+    }
+
+   private:
+    QualityGovernor* governor;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  QualityGovernor() : budget(1000), smoothing(0.1), lower_fraction(0.6),
+      settle_steps(20), level(0), step_time(0), average_time(0),
+      steps_since_change(0), steps_since_update(0), climb_wait(20),
+      climbed(false), cutoff_field(0),
+      max_cutoff_field(0) {
+    this->ladder.push_back(Settings());
+  }
+
+  /// \brief Build the ladder of settings
+  /// \param[in] _budget Time budget per step in microseconds
+  /// \param[in] min_far_field_ratio Smallest far-field ratio to use, 0 to
+  /// never force aggregation
+  /// \param[in] cutoff Longest cutoff radius to use, 0 to never cut off
+  /// \param[in] max_update_interval Largest number of steps to hold forces
+  /// \param[in] max_publish_interval Largest number of steps between
+  /// publications
+  void Configure(double _budget, double min_far_field_ratio, double cutoff,
+      int max_update_interval, int max_publish_interval) {
+    this->budget = _budget;
+    this->ladder.assign(1, Settings());
+    Settings settings;
+    for (int interval = 2; interval <= max_publish_interval; interval *= 2) {
+      settings.publish_interval = interval;
+      this->ladder.push_back(settings);
+    }
+    if (min_far_field_ratio > 0) {
+      for (double ratio = 8; ratio > min_far_field_ratio; ratio /= 2) {
+        settings.far_field_ratio = ratio;
+        this->ladder.push_back(settings);
+      }
+      settings.far_field_ratio = min_far_field_ratio;
+      this->ladder.push_back(settings);
+    }
+    if (cutoff > 0) {
+      for (double scale = 1; scale >= 0.25; scale /= 2) {
+        settings.cutoff = cutoff*scale;
+        this->ladder.push_back(settings);
+      }
+    }
+    for (int interval = 2; interval <= max_update_interval; ++interval) {
+      settings.update_interval = interval;
+      this->ladder.push_back(settings);
+    }
+    this->level = 0;
+    this->climb_wait = this->settle_steps;
+    this->climbed = false;
+  }
+
+  /// \brief Go back to the best level and forget the timing, e.g. after
+  /// the simulation was reset or restored. The next step is solved.
+  void Reset() {
+    this->level = 0;
+    this->step_time = 0;
+    this->average_time = 0;
+    this->steps_since_change = 0;
+    this->steps_since_update = 0;
+    this->climb_wait = this->settle_steps;
+    this->climbed = false;
+    this->cutoff_field = 0;
+    this->max_cutoff_field = 0;
+  }
+
+  /// \brief Close the timing of the previous step and start a new one
+  /// \return Whether interactions are solved in the new step
+  bool NextStep() {
+    this->average_time = this->average_time > 0 ?
+        this->average_time + this->smoothing*(this->step_time - this->average_time) :
+        this->step_time;
+    this->step_time = 0;
+    this->cutoff_field = this->max_cutoff_field;
+    this->max_cutoff_field = 0;
+
+    // A level that was too slow right after climbing to it is retried
+    // after exponentially longer waits, so the governor does not oscillate
+    // between two levels
+    ++this->steps_since_change;
+    if (this->average_time > this->budget && this->level + 1 < this->ladder.size() &&
+        this->steps_since_change >= this->settle_steps) {
+      if (this->climbed)
+        this->climb_wait = std::min(2*this->climb_wait, 100*this->settle_steps);
+      else
+        this->climb_wait = this->settle_steps;
+      ++this->level;
+      this->steps_since_change = 0;
+      this->climbed = false;
+    } else if (this->average_time < this->lower_fraction*this->budget && this->level > 0 &&
+        this->steps_since_change >= this->climb_wait) {
+      --this->level;
+      this->steps_since_change = 0;
+      this->climbed = true;
+    }
+
+    if (++this->steps_since_update >= this->GetSettings().update_interval) {
+      this->steps_since_update = 0;
+      return true;
+    }
+    return false;
+  }
+
+  /// \brief Current settings
+  const Settings& GetSettings() const {
+    return this->ladder[this->level];
+  }
+
+  /// \brief Report the field of a model that was ignored by the cutoff.
+  /// Safe to call from several threads.
+  /// \param[in] field Upper bound on the magnitude of the ignored field
+  void ReportCutoffField(double field) {
+    double current = this->max_cutoff_field.load();
+    while (field > current && !this->max_cutoff_field.compare_exchange_weak(current, field)) {
+    }
+  }
+
+  /// \brief Relative force error of models evaluated through their
+  /// dipole plus quadrupole expansion, which scales with the square of the
+  /// opening angle
+  double GetFarFieldError(double far_field_ratio) const {
+    return far_field_ratio > 0 ? 1.0/(far_field_ratio*far_field_ratio) : 0.0;
+  }
+
+  /// \brief Largest field ignored by the cutoff in the last step, in T
+  double GetCutoffField() const {
+    return this->cutoff_field;
+  }
+
+  /// \brief Smoothed time per step in microseconds
+  double GetAverageTime() const {
+    return this->average_time;
+  }
+
+  size_t GetLevel() const {
+    return this->level;
+  }
+
+  size_t GetLevelCount() const {
+    return this->ladder.size();
+  }
+
+  /// \brief Time budget per step in microseconds
+  double budget;
+  /// \brief Weight of the newest step in the smoothed step time
+  double smoothing;
+  /// \brief Quality goes back up once the step time is below this fraction
+  /// of the budget
+  double lower_fraction;
+  /// \brief Steps to wait after a change before the next one
+  int settle_steps;
+
+ private:
+  std::vector<Settings> ladder;
+  size_t level;
+  /// \brief Time spent in the current step so far
+  double step_time;
+  double average_time;
+  int steps_since_change;
+  int steps_since_update;
+  /// \brief Steps to wait before going back up a level
+  int climb_wait;
+  /// \brief Whether the last change went back up a level
+  bool climbed;
+  double cutoff_field;
+  std::atomic<double> max_cutoff_field;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_QUALITY_GOVERNOR_H_
@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_SHARED_EXCHANGE_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_SHARED_EXCHANGE_H_
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+
+namespace gazebo {
+
+/// \brief Magnets of one step in shared memory, for solvers running in
+/// other processes on the same host.
+///
+/// The simulator writes the inputs of every slot, bumps the request word
+/// and wakes the solvers. One or more worker processes compute the outputs.
+/// The last worker to finish sets the reply word to the same sequence
+/// number and wakes the simulator. Both words are futexes, so a side that
+/// waits sleeps in the kernel, after spinning for a configurable number of
+/// checks. A reply is only accepted for the latest request, so workers that
+/// fall behind never deliver stale wrenches.
+///
+/// Workers that split the magnets between them also share the sorted
+/// points and cell summaries of their domains through the segment, and
+/// wait for each other with Synchronize() once those are written.
+class SharedExchange {
+ public:
+  static const std::uint32_t kMagic = 0x4d414758;
+  static const std::uint32_t kLayoutVersion = 2;
+  /// \brief Largest number of worker processes
+  static const std::uint32_t kMaxWorkers = 64;
+
+  /// \brief Start of the segment
+  struct Header {
+    std::uint32_t magic;
+    std::uint32_t layout_version;
+    std::uint32_t capacity;
+    /// \brief Magnets in the current request
+    std::uint32_t count;
+    /// \brief Sequence number of the latest request
+    std::atomic<std::uint32_t> request;
+    /// \brief Sequence number of the latest reply
+    std::atomic<std::uint32_t> reply;
+    /// \brief Worker processes that solve each request together
+    std::uint32_t workers;
+    /// \brief Most points in a leaf cell of a domain
+    std::uint32_t leaf_size;
+    /// \brief Cells farther apart than this times the sum of their radii
+    /// interact through their multipoles, 0 to solve all pairs exactly
+    double far_field_ratio;
+    /// \brief Arrivals at the summary barrier and at the end of the
+    /// request, as the sequence number in the high and the count in the
+    /// low 32 bits
+    std::atomic<std::uint64_t> summary_arrivals;
+    std::atomic<std::uint64_t> finish_arrivals;
+    /// \brief Sequence number of the latest request whose summaries are
+    /// all written
+    std::atomic<std::uint32_t> summarized;
+    std::uint32_t reserved;
+    /// \brief Process id of each attached worker, 0 if there is none
+    std::atomic<std::uint32_t> worker_pid[kMaxWorkers];
+    /// \brief Seconds each worker spent on the latest request
+    double solve_time[kMaxWorkers];
+  };
+
+  /// \brief One magnet. Inputs are written by the simulator, outputs by
+  /// the solver.
+  struct Slot {
+    /// \brief World position and world frame moment
+    double position[3];
+    double moment[3];
+    /// \brief Magnets with equal ids do not interact
+    std::uint32_t id;
+    std::uint32_t reserved;
+    /// \brief Force, torque and field of all other magnets
+    double force[3];
+    double torque[3];
+    double field[3];
+  };
+
+  /// \brief A magnet in domain order, written by the worker that owns it
+  struct Point {
+    double position[3];
+    double moment[3];
+    std::uint32_t id;
+    /// \brief Slot of the magnet
+    std::uint32_t slot;
+  };
+
+  /// \brief Node of the tree of cells of a domain, with the multipole of
+  /// its points, written by the worker that owns the domain
+  struct Cell {
+    double center[3];
+    double dipole[3];
+    /// \brief xx, xy, xz, yy, yz and zz of the symmetric quadrupole
+    double quadrupole[6];
+    double radius;
+    /// \brief Points [begin, end)
+    std::uint32_t begin;
+    std::uint32_t end;
+    /// \brief Range of the ids of the points
+    std::uint32_t id_min;
+    std::uint32_t id_max;
+    /// \brief Indices of the children, -1 for a leaf
+    std::int32_t child[2];
+  };
+
+  static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t) &&
+      ATOMIC_INT_LOCK_FREE == 2, "futex words must be plain lock-free 32 bit integers");
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "arrival counters must be lock-free");
+
+  ~SharedExchange() {
+    if (this->header)
+      munmap(this->header, this->size);
+    if (this->owner)
+      shm_unlink(this->name.c_str());
+  }
+
+  /// \brief Most cells of the trees of all domains
+  static size_t GetCellCapacity(size_t capacity, size_t leaf_size) {
+    return 4*capacity/leaf_size + kMaxWorkers;
+  }
+
+  /// \brief Create the segment, replacing one left behind by a previous
+  /// run. It is removed again when the exchange is destroyed.
+  /// \param[in] workers Worker processes that solve each request
+  /// \param[in] leaf_size Most points in a leaf cell
+  /// \param[in] far_field_ratio Separation ratio of cells that interact
+  /// through their multipoles, 0 to solve all pairs exactly
+  /// \return NULL with errno set on failure
+  static std::unique_ptr<SharedExchange> Create(const std::string& name, size_t capacity,
+      size_t workers = 1, size_t leaf_size = 64, double far_field_ratio = 0) {
+    if (workers < 1 || workers > kMaxWorkers || leaf_size < 1 || far_field_ratio < 0) {
+      errno = EINVAL;
+      return std::unique_ptr<SharedExchange>();
+    }
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0)
+      return std::unique_ptr<SharedExchange>();
+    size_t size = GetSize(capacity, leaf_size);
+    void* mem = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+      mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    if (mem == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      errno = error;
+      return std::unique_ptr<SharedExchange>();
+    }
+
+    Header* header = new (mem) Header();
+    header->magic = kMagic;
+    header->layout_version = kLayoutVersion;
+    header->capacity = capacity;
+    header->count = 0;
+    header->request = 0;
+    header->reply = 0;
+    header->workers = workers;
+    header->leaf_size = leaf_size;
+    header->far_field_ratio = far_field_ratio;
+    header->summary_arrivals = 0;
+    header->finish_arrivals = 0;
+    header->summarized = 0;
+    for (size_t k = 0; k < kMaxWorkers; ++k) {
+      header->worker_pid[k] = 0;
+      header->solve_time[k] = 0;
+    }
+    return std::unique_ptr<SharedExchange>(new SharedExchange(name, header, size, true));
+  }
+
+  /// \brief Attach to a segment created by the simulator
+  /// \return NULL on failure, with errno set to EPROTO if the segment is
+  /// not an exchange of this layout
+  static std::unique_ptr<SharedExchange> Open(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      return std::unique_ptr<SharedExchange>();
+    struct stat st;
+    void* mem = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header))
+      mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    else
+      errno = EPROTO;
+    int error = errno;
+    close(fd);
+    if (mem == MAP_FAILED) {
+      errno = error;
+      return std::unique_ptr<SharedExchange>();
+    }
+
+    Header* header = static_cast<Header*>(mem);
+    if (header->magic != kMagic || header->layout_version != kLayoutVersion ||
+        header->workers < 1 || header->workers > kMaxWorkers || header->leaf_size < 1 ||
+        GetSize(header->capacity, header->leaf_size) > static_cast<size_t>(st.st_size)) {
+      munmap(mem, st.st_size);
+      errno = EPROTO;
+      return std::unique_ptr<SharedExchange>();
+    }
+    return std::unique_ptr<SharedExchange>(new SharedExchange(name, header, st.st_size, false));
+  }
+
+  size_t GetCapacity() const {
+    return this->header->capacity;
+  }
+
+  /// \brief Whether every worker is attached
+  bool IsAttached() const {
+    for (size_t k = 0; k < this->header->workers; ++k) {
+      if (this->header->worker_pid[k].load() == 0)
+        return false;
+    }
+    return true;
+  }
+
+  /// \brief Post the request written to the slots and wait for its reply.
+  /// Called by the simulator.
+  /// \return False if a worker is not attached or they did not reply in
+  /// time
+  bool Call() {
+    if (!this->IsAttached())
+      return false;
+    std::uint32_t seq = this->header->request.load(std::memory_order_relaxed) + 1;
+    this->header->request.store(seq, std::memory_order_release);
+    Wake(this->header->request);
+    if (this->WaitFor(this->header->reply, seq))
+      return true;
+
+    // Workers that died without detaching are not waited for again
+    for (size_t k = 0; k < this->header->workers; ++k) {
+      std::uint32_t pid = this->header->worker_pid[k].load();
+      if (pid != 0 && kill(pid, 0) != 0 && errno == ESRCH)
+        this->header->worker_pid[k].compare_exchange_strong(pid, 0);
+    }
+    return false;
+  }
+
+  /// \brief Wait for a request, solve it and, as the last worker to
+  /// finish, reply. Called by the workers.
+  /// \param[in] rank Index of the calling worker
+  /// \param[in] solve Computes the outputs of this worker's share of the
+  /// first count slots. Returns false if the request was abandoned.
+  /// \return False if no request arrived within the timeout or it was
+  /// abandoned
+  bool Serve(size_t rank, const std::function<bool(size_t count)>& solve) {
+    std::uint32_t seq = this->header->request.load(std::memory_order_acquire);
+    if (seq == this->served) {
+      if (!this->WaitWhile(this->header->request, seq))
+        return false;
+      seq = this->header->request.load(std::memory_order_acquire);
+    }
+    this->served = seq;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool solved = solve(std::min<size_t>(this->header->count, this->header->capacity));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    this->header->solve_time[rank] =
+        (end.tv_sec - start.tv_sec) + 1e-9*(end.tv_nsec - start.tv_nsec);
+    if (!solved)
+      return false;
+
+    if (Arrive(this->header->finish_arrivals, seq, this->header->workers)) {
+      this->header->reply.store(seq, std::memory_order_release);
+      Wake(this->header->reply);
+    }
+    return true;
+  }
+
+  /// \brief Wait until every worker has called this for the request being
+  /// served, so the points and cells they wrote before can be read
+  /// \return False if the request was abandoned or a worker detached
+  bool Synchronize() {
+    const std::uint32_t seq = this->served;
+    if (Arrive(this->header->summary_arrivals, seq, this->header->workers)) {
+      this->header->summarized.store(seq, std::memory_order_release);
+      Wake(this->header->summarized);
+      return true;
+    }
+    while (!this->WaitFor(this->header->summarized, seq)) {
+      if (this->header->request.load() != seq || !this->IsAttached())
+        return false;
+    }
+    return true;
+  }
+
+  /// \brief Register or unregister the calling process as a worker
+  /// \return False if the rank is taken or out of range
+  bool Attach(size_t rank, bool attach) {
+    if (rank >= this->header->workers)
+      return false;
+    this->served = this->header->request.load();
+    if (!attach) {
+      this->header->worker_pid[rank] = 0;
+      return true;
+    }
+    std::uint32_t none = 0;
+    return this->header->worker_pid[rank].compare_exchange_strong(none, getpid());
+  }
+
+  Header* header;
+  Slot* slots;
+  /// \brief Magnets in domain order, capacity of them
+  Point* points;
+  /// \brief Trees of the domains, GetCellCapacity() of them
+  Cell* cells;
+  /// \brief Seconds a call or serve waits before giving up
+  double timeout;
+  /// \brief Checks of a futex word before sleeping on it
+  int spin;
+
+ private:
+  SharedExchange(const std::string& _name, Header* _header, size_t _size, bool _owner)
+      : header(_header), slots(reinterpret_cast<Slot*>(_header + 1)),
+        points(reinterpret_cast<Point*>(this->slots + _header->capacity)),
+        cells(reinterpret_cast<Cell*>(this->points + _header->capacity)), timeout(1.0),
+        spin(0), name(_name), size(_size), owner(_owner), served(0) {
+  }
+
+  static size_t GetSize(size_t capacity, size_t leaf_size) {
+    return sizeof(Header) + capacity*(sizeof(Slot) + sizeof(Point)) +
+        GetCellCapacity(capacity, leaf_size)*sizeof(Cell);
+  }
+
+  /// \brief Count one arrival of workers at a request
+  /// \return Whether it was the last of them
+  static bool Arrive(std::atomic<std::uint64_t>& arrivals, std::uint32_t seq,
+      std::uint32_t workers) {
+    std::uint64_t current = arrivals.load();
+    while (true) {
+      // A late arrival at an abandoned request must not disturb the count
+      // of a newer one, while the first arrival at a newer request starts
+      // the count over. Sequence numbers compare modulo 2^32.
+      const std::uint32_t tag = current >> 32;
+      if (static_cast<std::int32_t>(seq - tag) < 0)
+        return false;
+      std::uint64_t next = tag == seq ? current + 1 :
+          (static_cast<std::uint64_t>(seq) << 32 | 1);
+      if (arrivals.compare_exchange_weak(current, next))
+        return (next & 0xffffffff) == workers;
+    }
+  }
+
+  static std::uint32_t* Word(std::atomic<std::uint32_t>& word) {
+    return reinterpret_cast<std::uint32_t*>(&word);
+  }
+
+  static void Wake(std::atomic<std::uint32_t>& word) {
+    syscall(SYS_futex, Word(word), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+
+  /// \brief Wait until word equals value
+  bool WaitFor(std::atomic<std::uint32_t>& word, std::uint32_t value) {
+    return this->Wait(word, [value](std::uint32_t current) { return current == value; });
+  }
+
+  /// \brief Wait until word differs from value
+  bool WaitWhile(std::atomic<std::uint32_t>& word, std::uint32_t value) {
+    return this->Wait(word, [value](std::uint32_t current) { return current != value; });
+  }
+
+  bool Wait(std::atomic<std::uint32_t>& word, const std::function<bool(std::uint32_t)>& done) {
+    for (int i = 0; i < this->spin; ++i) {
+      if (done(word.load(std::memory_order_acquire)))
+        return true;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    double whole;
+    double fraction = std::modf(this->timeout, &whole);
+    deadline.tv_sec += static_cast<time_t>(whole);
+    deadline.tv_nsec += static_cast<long>(fraction*1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (true) {
+      std::uint32_t current = word.load(std::memory_order_acquire);
+      if (done(current))
+        return true;
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      struct timespec left;
+      left.tv_sec = deadline.tv_sec - now.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (left.tv_nsec < 0) {
+        left.tv_sec -= 1;
+        left.tv_nsec += 1000000000L;
+      }
+      if (left.tv_sec < 0)
+        return false;
+      // Returns at once if the word changed since it was read
+      syscall(SYS_futex, Word(word), FUTEX_WAIT, current, &left, NULL, 0);
+    }
+  }
+
+  std::string name;
+  size_t size;
+  /// \brief Whether this side created the segment and removes it
+  bool owner;
+  /// \brief Sequence number of the last request served
+  std::uint32_t served;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_SHARED_EXCHANGE_H_
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TASK_POOL_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TASK_POOL_H_
+
+#include <functional>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace gazebo {
+
+/// \brief Fixed set of worker threads that run batches of tasks. The
+/// calling thread takes part in every batch, so a pool of n threads has
+/// n - 1 workers.
+class TaskPool {
+ public:
+  typedef std::function<void()> Task;
+
+  /// \param[in] threads Number of threads running tasks, including the
+  /// caller
+  explicit TaskPool(size_t threads) : tasks(NULL), next(0), pending(0),
+      generation(0), stop(false) {
+    for (size_t i = 1; i < threads; ++i)
+      this->workers.push_back(new boost::thread(boost::bind(&TaskPool::Work, this)));
+  }
+
+  ~TaskPool() {
+    {
+      boost::mutex::scoped_lock lock(this->lock);
+      this->stop = true;
+    }
+    this->start_cond.notify_all();
+    for (size_t i = 0; i < this->workers.size(); ++i) {
+      this->workers[i]->join();
+      delete this->workers[i];
+    }
+  }
+
+  /// \brief Number of threads running tasks, including the caller
+  size_t GetThreadCount() const {
+    return this->workers.size() + 1;
+  }
+
+  /// \brief Run all tasks and wait for them to finish. Tasks are started in
+  /// order, so the most expensive should come first.
+  void Run(const std::vector<Task>& _tasks) {
+    if (_tasks.empty())
+      return;
+    {
+      boost::mutex::scoped_lock lock(this->lock);
+      this->tasks = &_tasks;
+      this->next = 0;
+      this->pending = _tasks.size();
+      ++this->generation;
+    }
+    this->start_cond.notify_all();
+
+    this->RunTasks();
+
+    boost::mutex::scoped_lock lock(this->lock);
+    while (this->pending > 0)
+      this->done_cond.wait(lock);
+    this->tasks = NULL;
+  }
+
+ private:
+  void Work() {
+    size_t seen = 0;
+    while (true) {
+      {
+        boost::mutex::scoped_lock lock(this->lock);
+        while (!this->stop && this->generation == seen)
+          this->start_cond.wait(lock);
+        if (this->stop)
+          return;
+        seen = this->generation;
+      }
+      this->RunTasks();
+    }
+  }
+
+  /// \brief Take tasks of the current batch until none are left
+  void RunTasks() {
+    while (true) {
+      const Task* task = NULL;
+      {
+        boost::mutex::scoped_lock lock(this->lock);
+        if (!this->tasks || this->next >= this->tasks->size())
+          return;
+        task = &(*this->tasks)[this->next++];
+      }
+      (*task)();
+      boost::mutex::scoped_lock lock(this->lock);
+      if (--this->pending == 0)
+        this->done_cond.notify_all();
+    }
+  }
+
+  std::vector<boost::thread*> workers;
+  boost::mutex lock;
+  boost::condition_variable start_cond;
+  boost::condition_variable done_cond;
+  const std::vector<Task>* tasks;
+  size_t next;
+  size_t pending;
+  size_t generation;
+  bool stop;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TASK_POOL_H_
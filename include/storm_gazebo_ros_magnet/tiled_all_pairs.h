@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TILED_ALL_PAIRS_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TILED_ALL_PAIRS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace gazebo {
+
+/// \brief Exact field, force and torque between all pairs of point dipoles.
+///
+/// The dipoles are stored as structure of arrays and processed in square
+/// tiles of targets and sources that stay in cache while they are swept.
+/// Each pair is evaluated once and applied to both dipoles, so only tiles
+/// on and above the diagonal are visited. Within a tile a block of targets
+/// is swept over the sources together, which keeps the target sums in
+/// registers and loads every source once per block.
+class TiledAllPairs {
+ public:
+  /// \param[in] _tile_size Dipoles per tile
+  explicit TiledAllPairs(size_t _tile_size = 64) : tile_size(_tile_size) {
+  }
+
+  /// \brief Set the number of dipoles
+  void Resize(size_t n) {
+    this->x.resize(n);
+    this->y.resize(n);
+    this->z.resize(n);
+    this->mx.resize(n);
+    this->my.resize(n);
+    this->mz.resize(n);
+    this->id.resize(n);
+    this->fx.resize(n);
+    this->fy.resize(n);
+    this->fz.resize(n);
+    this->bx.resize(n);
+    this->by.resize(n);
+    this->bz.resize(n);
+    this->tx.resize(n);
+    this->ty.resize(n);
+    this->tz.resize(n);
+  }
+
+  /// \brief Number of dipoles
+  size_t Size() const {
+    return this->x.size();
+  }
+
+  /// \brief Compute the outputs from the positions, moments and ids
+  void Solve() {
+    this->SolveRows(0, 1);
+    this->SolveTorques();
+  }
+
+  /// \brief Force and field of the tile rows first, first + stride, ...
+  /// only, without the torques. Instances holding the same dipoles can
+  /// split the work this way, with their forces and fields summed after.
+  void SolveRows(size_t first, size_t stride) {
+    const size_t n = this->x.size();
+    std::fill(this->fx.begin(), this->fx.end(), 0.0);
+    std::fill(this->fy.begin(), this->fy.end(), 0.0);
+    std::fill(this->fz.begin(), this->fz.end(), 0.0);
+    std::fill(this->bx.begin(), this->bx.end(), 0.0);
+    std::fill(this->by.begin(), this->by.end(), 0.0);
+    std::fill(this->bz.begin(), this->bz.end(), 0.0);
+
+    // Tiles hold whole blocks, so only the last tile has a ragged end.
+    // Interleaving the rows balances the triangle of tiles.
+    const size_t tile = std::max<size_t>(1, (this->tile_size + kBlock - 1)/kBlock)*kBlock;
+    for (size_t i0 = first*tile; i0 < n; i0 += stride*tile) {
+      const size_t i1 = std::min(i0 + tile, n);
+      for (size_t j0 = i0; j0 < n; j0 += tile)
+        this->Tile(i0, i1, j0, std::min(j0 + tile, n));
+    }
+  }
+
+  /// \brief Torques from the moments and the total fields
+  void SolveTorques() {
+    const size_t n = this->x.size();
+    // The torque on a dipole is its moment crossed with the total field
+    for (size_t i = 0; i < n; ++i) {
+      this->tx[i] = this->my[i]*this->bz[i] - this->mz[i]*this->by[i];
+      this->ty[i] = this->mz[i]*this->bx[i] - this->mx[i]*this->bz[i];
+      this->tz[i] = this->mx[i]*this->by[i] - this->my[i]*this->bx[i];
+    }
+  }
+
+  /// \brief Dipoles per tile, rounded up to a multiple of the block size
+  size_t tile_size;
+
+  /// \brief World positions
+  std::vector<double> x, y, z;
+  /// \brief World frame moments
+  std::vector<double> mx, my, mz;
+  /// \brief Dipoles with equal ids do not interact
+  std::vector<std::uint32_t> id;
+
+  /// \brief Force on each dipole
+  std::vector<double> fx, fy, fz;
+  /// \brief Field of all other dipoles at each dipole
+  std::vector<double> bx, by, bz;
+  /// \brief Torque on each dipole
+  std::vector<double> tx, ty, tz;
+
+ private:
+  /// \brief Targets swept over the sources together
+  static const size_t kBlock = 4;
+
+  /// \brief Terms of one pair
+  /// \param[in] r Position of the target relative to the source
+  /// \param[in] mi Moment of the target
+  /// \param[in] mj Moment of the source
+  /// \param[in] scale 1e-7/|r|^3, or 0 to ignore the pair
+  /// \param[in] ir2 1/|r|^2
+  /// \param[out] f Force on the target, the source gets -f
+  /// \param[out] bi Field of the source at the target
+  /// \param[out] bj Field of the target at the source
+  static inline void PairTerms(const double r[3], const double mi[3],
+      const double mj[3], double scale, double ir2,
+      double f[3], double bi[3], double bj[3]) {
+    const double mir = mi[0]*r[0] + mi[1]*r[1] + mi[2]*r[2];
+    const double mjr = mj[0]*r[0] + mj[1]*r[1] + mj[2]*r[2];
+    const double mimj = mi[0]*mj[0] + mi[1]*mj[1] + mi[2]*mj[2];
+    const double ci = 3*mjr*ir2;
+    const double cj = 3*mir*ir2;
+    const double cf = mimj - 5*mir*mjr*ir2;
+    const double sf = 3*scale*ir2;
+    for (int a = 0; a < 3; ++a) {
+      bi[a] = (r[a]*ci - mj[a])*scale;
+      bj[a] = (r[a]*cj - mi[a])*scale;
+      f[a] = (mi[a]*mjr + mj[a]*mir + r[a]*cf)*sf;
+    }
+  }
+
+  /// \brief Scale and inverse squared distance of a pair, with coincident
+  /// dipoles and dipoles of equal ids ignored
+  static inline void PairScale(const double r[3], bool same, double& scale, double& ir2) {
+    double r2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+    const bool skip = same || r2 == 0;
+    ir2 = 1.0/(skip ? 1.0 : r2);
+    scale = skip ? 0.0 : 1e-7*ir2*std::sqrt(ir2);
+  }
+
+  /// \brief Apply a single pair to both dipoles
+  void Pair(size_t i, size_t j) {
+    const double r[3] = {this->x[i] - this->x[j], this->y[i] - this->y[j], this->z[i] - this->z[j]};
+    const double mi[3] = {this->mx[i], this->my[i], this->mz[i]};
+    const double mj[3] = {this->mx[j], this->my[j], this->mz[j]};
+    double scale, ir2;
+    PairScale(r, this->id[i] == this->id[j], scale, ir2);
+    double f[3], bi[3], bj[3];
+    PairTerms(r, mi, mj, scale, ir2, f, bi, bj);
+    this->fx[i] += f[0]; this->fy[i] += f[1]; this->fz[i] += f[2];
+    this->fx[j] -= f[0]; this->fy[j] -= f[1]; this->fz[j] -= f[2];
+    this->bx[i] += bi[0]; this->by[i] += bi[1]; this->bz[i] += bi[2];
+    this->bx[j] += bj[0]; this->by[j] += bj[1]; this->bz[j] += bj[2];
+  }
+
+  /// \brief All pairs of targets [i0, i1) and sources [j0, j1), or only
+  /// pairs with i < j on the diagonal
+  void Tile(size_t i0, size_t i1, size_t j0, size_t j1) {
+    const bool diagonal = i0 == j0;
+    size_t i = i0;
+    for (; i + kBlock <= i1; i += kBlock) {
+      size_t j_begin = j0;
+      if (diagonal) {
+        for (size_t a = 0; a < kBlock; ++a)
+          for (size_t b = a + 1; b < kBlock; ++b)
+            this->Pair(i + a, i + b);
+        j_begin = i + kBlock;
+      }
+      this->Block(i, j_begin, j1);
+    }
+    for (; i < i1; ++i) {
+      for (size_t j = diagonal ? i + 1 : j0; j < j1; ++j)
+        this->Pair(i, j);
+    }
+  }
+
+  /// \brief Targets [i, i + kBlock) against sources [j_begin, j_end). The
+  /// targets are lanes of fixed size arrays, so the compiler can map the
+  /// block onto vector registers. The contributions to a source are summed
+  /// over the lanes after each sweep instead of inside it, which would be a
+  /// reduction the compiler may not reorder.
+  void Block(size_t i, size_t j_begin, size_t j_end) {
+    double pix[kBlock], piy[kBlock], piz[kBlock];
+    double mix[kBlock], miy[kBlock], miz[kBlock];
+    double fix[kBlock] = {}, fiy[kBlock] = {}, fiz[kBlock] = {};
+    double bix[kBlock] = {}, biy[kBlock] = {}, biz[kBlock] = {};
+    double idi[kBlock];
+    for (size_t a = 0; a < kBlock; ++a) {
+      pix[a] = this->x[i + a];
+      piy[a] = this->y[i + a];
+      piz[a] = this->z[i + a];
+      mix[a] = this->mx[i + a];
+      miy[a] = this->my[i + a];
+      miz[a] = this->mz[i + a];
+      idi[a] = this->id[i + a];
+    }
+
+    for (size_t j = j_begin; j < j_end; ++j) {
+      const double xj = this->x[j], yj = this->y[j], zj = this->z[j];
+      const double mxj = this->mx[j], myj = this->my[j], mzj = this->mz[j];
+      const double idj = this->id[j];
+      double fjx[kBlock], fjy[kBlock], fjz[kBlock];
+      double bjx[kBlock], bjy[kBlock], bjz[kBlock];
+      for (size_t a = 0; a < kBlock; ++a) {
+        const double rx = pix[a] - xj, ry = piy[a] - yj, rz = piz[a] - zj;
+        const double r2 = rx*rx + ry*ry + rz*rz;
+        const bool skip = idi[a] == idj || r2 == 0;
+        const double ir2 = 1.0/(skip ? 1.0 : r2);
+        const double scale = skip ? 0.0 : 1e-7*ir2*std::sqrt(ir2);
+
+        const double mir = mix[a]*rx + miy[a]*ry + miz[a]*rz;
+        const double mjr = mxj*rx + myj*ry + mzj*rz;
+        const double mimj = mix[a]*mxj + miy[a]*myj + miz[a]*mzj;
+        const double ci = 3*mjr*ir2;
+        const double cj = 3*mir*ir2;
+        const double cf = mimj - 5*mir*mjr*ir2;
+        const double sf = 3*scale*ir2;
+
+        const double fx_a = (mix[a]*mjr + mxj*mir + rx*cf)*sf;
+        const double fy_a = (miy[a]*mjr + myj*mir + ry*cf)*sf;
+        const double fz_a = (miz[a]*mjr + mzj*mir + rz*cf)*sf;
+        fix[a] += fx_a;
+        fiy[a] += fy_a;
+        fiz[a] += fz_a;
+        bix[a] += (rx*ci - mxj)*scale;
+        biy[a] += (ry*ci - myj)*scale;
+        biz[a] += (rz*ci - mzj)*scale;
+        fjx[a] = -fx_a;
+        fjy[a] = -fy_a;
+        fjz[a] = -fz_a;
+        bjx[a] = (rx*cj - mix[a])*scale;
+        bjy[a] = (ry*cj - miy[a])*scale;
+        bjz[a] = (rz*cj - miz[a])*scale;
+      }
+      this->fx[j] += LaneSum(fjx);
+      this->fy[j] += LaneSum(fjy);
+      this->fz[j] += LaneSum(fjz);
+      this->bx[j] += LaneSum(bjx);
+      this->by[j] += LaneSum(bjy);
+      this->bz[j] += LaneSum(bjz);
+    }
+
+    for (size_t a = 0; a < kBlock; ++a) {
+      this->fx[i + a] += fix[a];
+      this->fy[i + a] += fiy[a];
+      this->fz[i + a] += fiz[a];
+      this->bx[i + a] += bix[a];
+      this->by[i + a] += biy[a];
+      this->bz[i + a] += biz[a];
+    }
+  }
+
+  static inline double LaneSum(const double v[kBlock]) {
+    return (v[0] + v[1]) + (v[2] + v[3]);
+  }
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TILED_ALL_PAIRS_H_
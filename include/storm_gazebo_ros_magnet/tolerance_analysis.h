@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TOLERANCE_ANALYSIS_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TOLERANCE_ANALYSIS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <ignition/math/Matrix3.hh>
+#include <ignition/math/Pose3.hh>
+#include <ignition/math/Vector3.hh>
+
+#include "storm_gazebo_ros_magnet/task_pool.h"
+
+namespace gazebo {
+
+/// \brief Perturbed body frame moments of one magnet, one per draw. Draw k
+/// of every magnet belongs to the same realization of the world.
+struct MomentSamples {
+  std::vector<double> x, y, z;
+
+  size_t Size() const {
+    return this->x.size();
+  }
+
+  /// \brief Draw moments whose strength is uniform within +-strength of
+  /// the nominal one and whose direction is uniform within a cone of
+  /// half-angle angle around it
+  /// \param[in] nominal Nominal body frame moment
+  /// \param[in] samples Number of draws
+  /// \param[in] strength Relative strength tolerance, e.g. 0.1 for 10%
+  /// \param[in] angle Direction tolerance in radians
+  /// \param[in] seed Seed of the draws, so runs are repeatable
+  static std::shared_ptr<MomentSamples> Draw(const ignition::math::Vector3d& nominal,
+      size_t samples, double strength, double angle, std::uint32_t seed) {
+    std::shared_ptr<MomentSamples> draws = std::make_shared<MomentSamples>();
+    draws->x.resize(samples);
+    draws->y.resize(samples);
+    draws->z.resize(samples);
+
+    const double length = nominal.Length();
+    if (length == 0)
+      return draws;
+    const ignition::math::Vector3d axis = nominal/length;
+    // Two directions perpendicular to the axis
+    ignition::math::Vector3d e1 = axis.Cross(std::abs(axis.X()) < 0.9 ?
+        ignition::math::Vector3d(1, 0, 0) : ignition::math::Vector3d(0, 1, 0)).Normalized();
+    ignition::math::Vector3d e2 = axis.Cross(e1);
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const double cos_max = std::cos(angle);
+    for (size_t k = 0; k < samples; ++k) {
+      double scale = length*(1 + strength*(2*unit(rng) - 1));
+      // Uniform over the spherical cap
+      double cos_tilt = 1 - unit(rng)*(1 - cos_max);
+      double sin_tilt = std::sqrt(std::max(0.0, 1 - cos_tilt*cos_tilt));
+      double azimuth = 2*M_PI*unit(rng);
+      ignition::math::Vector3d m = (axis*cos_tilt +
+          (e1*std::cos(azimuth) + e2*std::sin(azimuth))*sin_tilt)*scale;
+      draws->x[k] = m.X();
+      draws->y[k] = m.Y();
+      draws->z[k] = m.Z();
+    }
+    return draws;
+  }
+};
+
+/// \brief Wrench and field on one magnet for every draw of the moments of
+/// all magnets, evaluated against one pose snapshot.
+///
+/// The draws are structure of arrays and the inner loops run over draws
+/// with the pair geometry fixed, so they vectorize. Ranges of draws run as
+/// tasks on a pool shared with the caller. Interactions use the point
+/// dipole model.
+class ToleranceAnalysis {
+ public:
+  /// \brief Another magnet acting on the analyzed one
+  struct Source {
+    ignition::math::Pose3d pose;
+    /// \brief Nominal body frame moment, used when samples is NULL
+    ignition::math::Vector3d moment;
+    /// \brief Draws of the source. Sources with fewer draws than the
+    /// analyzed magnet reuse them cyclically.
+    std::shared_ptr<const MomentSamples> samples;
+  };
+
+  /// \brief Order of the statistics of each output
+  enum Statistic { MEAN, STDDEV, P05, P50, P95, STATISTIC_COUNT };
+
+  /// \brief Number of outputs: force, torque and body frame field
+  static const size_t kOutputs = 9;
+
+  /// \brief Evaluate every draw
+  /// \param[in] pose Pose of the analyzed magnet
+  /// \param[in] self Draws of the analyzed magnet
+  /// \param[in] sources Magnets acting on it
+  /// \param[in] field Field of all other sources at the magnet, world frame
+  /// \param[in] gradient Gradient of that field, gradient(i, j) = dB_i/dx_j
+  /// \param[in] pool Pool to evaluate on, NULL for the calling thread
+  void Evaluate(const ignition::math::Pose3d& pose, const MomentSamples& self,
+      const std::vector<Source>& sources, const ignition::math::Vector3d& field,
+      const ignition::math::Matrix3d& gradient, TaskPool* pool = NULL) {
+    const size_t n = self.Size();
+    for (size_t c = 0; c < kOutputs; ++c)
+      this->outputs[c].resize(n);
+
+    std::vector<TaskPool::Task> tasks;
+    const size_t threads = pool ? pool->GetThreadCount() : 1;
+    const size_t chunk = std::max<size_t>(256, (n + threads - 1)/threads);
+    for (size_t begin = 0; begin < n; begin += chunk) {
+      const size_t end = std::min(begin + chunk, n);
+      tasks.push_back([this, &pose, &self, &sources, &field, &gradient, begin, end]() {
+        this->EvaluateRange(pose, self, sources, field, gradient, begin, end);
+      });
+    }
+    if (pool) {
+      pool->Run(tasks);
+    } else {
+      for (size_t t = 0; t < tasks.size(); ++t)
+        tasks[t]();
+    }
+  }
+
+  /// \brief Statistics of the last evaluation
+  /// \param[out] stats kOutputs rows of STATISTIC_COUNT values: fx, fy, fz,
+  /// tx, ty, tz, bx, by, bz
+  void GetStatistics(std::vector<double>& stats) {
+    stats.assign(kOutputs*STATISTIC_COUNT, 0.0);
+    for (size_t c = 0; c < kOutputs; ++c) {
+      std::vector<double>& v = this->outputs[c];
+      const size_t n = v.size();
+      if (n == 0)
+        continue;
+      double sum = 0;
+      for (size_t k = 0; k < n; ++k)
+        sum += v[k];
+      double mean = sum/n;
+      double var = 0;
+      for (size_t k = 0; k < n; ++k)
+        var += (v[k] - mean)*(v[k] - mean);
+
+      double* row = &stats[c*STATISTIC_COUNT];
+      row[MEAN] = mean;
+      row[STDDEV] = n > 1 ? std::sqrt(var/(n - 1)) : 0.0;
+      this->sorted = v;
+      row[P05] = Quantile(this->sorted, 0.05);
+      row[P50] = Quantile(this->sorted, 0.5);
+      row[P95] = Quantile(this->sorted, 0.95);
+    }
+  }
+
+  /// \brief Per draw outputs of the last evaluation, in the order of
+  /// GetStatistics
+  std::vector<double> outputs[kOutputs];
+
+ private:
+  /// \brief Columns of the rotation of a pose
+  static void GetRotation(const ignition::math::Pose3d& pose, double rot[9]) {
+    ignition::math::Vector3d cols[3] = {
+      pose.Rot().RotateVector(ignition::math::Vector3d(1, 0, 0)),
+      pose.Rot().RotateVector(ignition::math::Vector3d(0, 1, 0)),
+      pose.Rot().RotateVector(ignition::math::Vector3d(0, 0, 1))};
+    for (int a = 0; a < 3; ++a)
+      for (int b = 0; b < 3; ++b)
+        rot[3*a + b] = cols[b][a];
+  }
+
+  /// \brief Nearest rank quantile, reorders v
+  static double Quantile(std::vector<double>& v, double q) {
+    size_t k = std::min(v.size() - 1, static_cast<size_t>(q*(v.size() - 1) + 0.5));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+  }
+
+  void EvaluateRange(const ignition::math::Pose3d& pose, const MomentSamples& self,
+      const std::vector<Source>& sources, const ignition::math::Vector3d& field,
+      const ignition::math::Matrix3d& gradient, size_t begin, size_t end) {
+    double* fx = this->outputs[0].data();
+    double* fy = this->outputs[1].data();
+    double* fz = this->outputs[2].data();
+    double* tx = this->outputs[3].data();
+    double* ty = this->outputs[4].data();
+    double* tz = this->outputs[5].data();
+    double* bx = this->outputs[6].data();
+    double* by = this->outputs[7].data();
+    double* bz = this->outputs[8].data();
+
+    // World frame moments of this magnet, and the external field and force
+    double rot[9];
+    GetRotation(pose, rot);
+    std::vector<double> mx(end - begin), my(end - begin), mz(end - begin);
+    for (size_t k = begin; k < end; ++k) {
+      const double sx = self.x[k], sy = self.y[k], sz = self.z[k];
+      const size_t i = k - begin;
+      mx[i] = rot[0]*sx + rot[1]*sy + rot[2]*sz;
+      my[i] = rot[3]*sx + rot[4]*sy + rot[5]*sz;
+      mz[i] = rot[6]*sx + rot[7]*sy + rot[8]*sz;
+      fx[k] = gradient(0, 0)*mx[i] + gradient(1, 0)*my[i] + gradient(2, 0)*mz[i];
+      fy[k] = gradient(0, 1)*mx[i] + gradient(1, 1)*my[i] + gradient(2, 1)*mz[i];
+      fz[k] = gradient(0, 2)*mx[i] + gradient(1, 2)*my[i] + gradient(2, 2)*mz[i];
+      bx[k] = field.X();
+      by[k] = field.Y();
+      bz[k] = field.Z();
+    }
+
+    std::vector<double> ox(end - begin), oy(end - begin), oz(end - begin);
+    for (size_t s = 0; s < sources.size(); ++s) {
+      const Source& source = sources[s];
+      const ignition::math::Vector3d d = pose.Pos() - source.pose.Pos();
+      const double r2 = d.SquaredLength();
+      if (r2 == 0)
+        continue;
+      const double rx = d.X(), ry = d.Y(), rz = d.Z();
+      const double ir2 = 1.0/r2;
+      const double scale = 1e-7*ir2*std::sqrt(ir2);
+
+      // World frame moments of the source for the same draws
+      double src_rot[9];
+      GetRotation(source.pose, src_rot);
+      const MomentSamples* samples = source.samples.get();
+      const size_t count = samples ? samples->Size() : 0;
+      if (count == 0) {
+        const double sx = source.moment.X(), sy = source.moment.Y(), sz = source.moment.Z();
+        std::fill(ox.begin(), ox.end(), src_rot[0]*sx + src_rot[1]*sy + src_rot[2]*sz);
+        std::fill(oy.begin(), oy.end(), src_rot[3]*sx + src_rot[4]*sy + src_rot[5]*sz);
+        std::fill(oz.begin(), oz.end(), src_rot[6]*sx + src_rot[7]*sy + src_rot[8]*sz);
+      }
+      // Runs of draws that do not wrap around the source's draws
+      for (size_t k0 = begin; count > 0 && k0 < end;) {
+        const size_t j0 = k0 % count;
+        const size_t k1 = std::min(end, k0 + count - j0);
+        const double* sx = &samples->x[j0];
+        const double* sy = &samples->y[j0];
+        const double* sz = &samples->z[j0];
+        const size_t i0 = k0 - begin;
+        for (size_t j = 0; j < k1 - k0; ++j) {
+          ox[i0 + j] = src_rot[0]*sx[j] + src_rot[1]*sy[j] + src_rot[2]*sz[j];
+          oy[i0 + j] = src_rot[3]*sx[j] + src_rot[4]*sy[j] + src_rot[5]*sz[j];
+          oz[i0 + j] = src_rot[6]*sx[j] + src_rot[7]*sy[j] + src_rot[8]*sz[j];
+        }
+        k0 = k1;
+      }
+
+      // Point dipole field and force, as in the interaction kernel
+      for (size_t k = begin; k < end; ++k) {
+        const size_t i = k - begin;
+        const double mir = mx[i]*rx + my[i]*ry + mz[i]*rz;
+        const double mjr = ox[i]*rx + oy[i]*ry + oz[i]*rz;
+        const double mimj = mx[i]*ox[i] + my[i]*oy[i] + mz[i]*oz[i];
+        const double cb = 3*mjr*ir2;
+        const double cf = mimj - 5*mir*mjr*ir2;
+        const double sf = 3*scale*ir2;
+        bx[k] += (rx*cb - ox[i])*scale;
+        by[k] += (ry*cb - oy[i])*scale;
+        bz[k] += (rz*cb - oz[i])*scale;
+        fx[k] += (mx[i]*mjr + ox[i]*mir + rx*cf)*sf;
+        fy[k] += (my[i]*mjr + oy[i]*mir + ry*cf)*sf;
+        fz[k] += (mz[i]*mjr + oz[i]*mir + rz*cf)*sf;
+      }
+    }
+
+    // Torque from the total field, then the field into the body frame
+    for (size_t k = begin; k < end; ++k) {
+      const size_t i = k - begin;
+      tx[k] = my[i]*bz[k] - mz[i]*by[k];
+      ty[k] = mz[i]*bx[k] - mx[i]*bz[k];
+      tz[k] = mx[i]*by[k] - my[i]*bx[k];
+      const double wx = bx[k], wy = by[k], wz = bz[k];
+      bx[k] = rot[0]*wx + rot[3]*wy + rot[6]*wz;
+      by[k] = rot[1]*wx + rot[4]*wy + rot[7]*wz;
+      bz[k] = rot[2]*wx + rot[5]*wy + rot[8]*wz;
+    }
+  }
+
+  /// \brief Scratch copy for the quantiles
+  std::vector<double> sorted;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TOLERANCE_ANALYSIS_H_
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#ifndef INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TOP_CONTRIBUTIONS_H_
+#define INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TOP_CONTRIBUTIONS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <ignition/math/Vector3.hh>
+
+namespace gazebo {
+
+/// \brief The k largest contributions to the wrench on a magnet, kept in a
+/// bounded min-heap so that adding a contribution costs O(log k)
+class TopContributions {
+ public:
+  /// \brief What a contribution comes from
+  enum Kind {
+    /// \brief Another magnet, identified by its model_id
+    MAGNET = 0,
+    /// \brief The far-field expansion of a model, identified by its owner_id
+    AGGREGATE = 1,
+    /// \brief A ferromagnetic plane, identified by its index
+    PLANE = 2,
+    /// \brief A field source, identified by its index
+    FIELD_SOURCE = 3,
+    /// \brief All magnets and periodic images, solved together
+    PERIODIC = 4,
+    /// \brief All magnets, solved together by the tiled all-pairs kernel
+    ALL_PAIRS = 5
+  };
+
+  struct Entry {
+    /// \brief Magnitude used for ranking
+    double magnitude;
+    Kind kind;
+    std::uint32_t id;
+    ignition::math::Vector3d force;
+    ignition::math::Vector3d torque;
+
+    bool operator>(const Entry& other) const {
+      return this->magnitude > other.magnitude;
+    }
+  };
+
+  /// \param[in] _k Number of contributions to keep
+  /// \param[in] _rank_by_torque Rank by torque instead of force magnitude
+  explicit TopContributions(size_t _k = 5, bool _rank_by_torque = false)
+      : k(_k), rank_by_torque(_rank_by_torque) {
+    this->heap.reserve(this->k);
+  }
+
+  void Clear() {
+    this->heap.clear();
+  }
+
+  void Add(Kind kind, std::uint32_t id, const ignition::math::Vector3d& force,
+      const ignition::math::Vector3d& torque) {
+    if (this->k == 0)
+      return;
+    double magnitude = this->rank_by_torque ? torque.Length() : force.Length();
+    if (this->heap.size() == this->k) {
+      if (magnitude <= this->heap.front().magnitude)
+        return;
+      std::pop_heap(this->heap.begin(), this->heap.end(), std::greater<Entry>());
+      this->heap.pop_back();
+    }
+    Entry entry;
+    entry.magnitude = magnitude;
+    entry.kind = kind;
+    entry.id = id;
+    entry.force = force;
+    entry.torque = torque;
+    this->heap.push_back(entry);
+    std::push_heap(this->heap.begin(), this->heap.end(), std::greater<Entry>());
+  }
+
+  /// \brief Contributions in order of decreasing magnitude
+  void GetSorted(std::vector<Entry>& entries) const {
+    entries = this->heap;
+    std::sort(entries.begin(), entries.end(), std::greater<Entry>());
+  }
+
+ private:
+  size_t k;
+  bool rank_by_torque;
+  std::vector<Entry> heap;
+};
+
+}  // namespace gazebo
+
+#endif  // INCLUDE_MAC_GAZEBO_DIPOLE_MAGNET_TOP_CONTRIBUTIONS_H_
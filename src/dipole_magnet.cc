@@ -17,6 +17,7 @@
  */
 
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 
@@ -25,6 +26,7 @@
 #include <ros/ros.h>
 
 #include <iostream>
+#include <map>
 #include <vector>
 #include <cstdint>
 #include <functional>
@@ -33,21 +35,34 @@
 
 namespace gazebo {
 
-DipoleMagnet::DipoleMagnet(): ModelPlugin() {
+DipoleMagnet::DipoleMagnet() {
   this->connect_count = 0;
+  this->recording = NULL;
+  this->contributions_rate = 1.0;
+  this->tolerance_rate = 1.0;
+  this->held_energy = 0;
+  this->mfs_seq = 0;
 }
 
 DipoleMagnet::~DipoleMagnet() {
   this->update_connection.reset();
-  if (this->should_publish) {
-    this->queue.clear();
-    this->queue.disable();
-    this->rosnode->shutdown();
-    this->callback_queue_thread.join();
-    delete this->rosnode;
+  if (this->rosnode) {
+    this->wrench_pub.shutdown();
+    this->mfs_pub.shutdown();
+    this->mfs_stamp_pub.shutdown();
+    this->contributions_pub.shutdown();
+    this->tolerance_pub.shutdown();
+    // Connect and Disconnect run on the shared node's thread and hold the
+    // tracked object while they run. Once it is released no new call
+    // starts, and it expires when a running one returns.
+    ros::VoidWPtr tracked = this->tracked_object;
+    this->tracked_object.reset();
+    while (!tracked.expired())
+      boost::this_thread::yield();
+    this->rosnode.reset();
   }
-  if (this->mag){
-    DipoleMagnetContainer::Get().Remove(this->mag);
+  if (this->mag && this->container){
+    this->container->Remove(this->mag);
   }
 }
 
@@ -102,6 +117,24 @@ void DipoleMagnet::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf) {
     this->mag->moment = _sdf->Get<ignition::math::Vector3d>("dipole_moment");
   }
 
+  // Soft magnetic bodies are treated as spheres of the same volume
+  if (_sdf->HasElement("soft_magnetic")){
+    sdf::ElementPtr soft = _sdf->GetElement("soft_magnetic");
+    double volume = 0;
+    double mu_r = 1;
+    if (soft->HasElement("volume"))
+      volume = soft->Get<double>("volume");
+    if (soft->HasElement("relative_permeability"))
+      mu_r = soft->Get<double>("relative_permeability");
+    if (volume <= 0 || mu_r <= 1) {
+      gzerr << "DipoleMagnet <soft_magnetic> needs a positive <volume> and a "
+          "<relative_permeability> greater than 1" << std::endl;
+    } else {
+      const double mu_0 = 4*M_PI*1e-7;
+      this->mag->polarizability = 3*volume/mu_0 * (mu_r - 1)/(mu_r + 2);
+    }
+  }
+
   if (_sdf->HasElement("xyzOffset")){
     this->mag->offset.Pos() = _sdf->Get<ignition::math::Vector3d>("xyzOffset");
   }
@@ -111,6 +144,118 @@ void DipoleMagnet::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf) {
     this->mag->offset.Rot() = ignition::math::Quaterniond(rpy_offset);
   }
 
+  if (_sdf->HasElement("shape")){
+    sdf::ElementPtr shape = _sdf->GetElement("shape");
+    if (shape->HasElement("cylinder")) {
+      sdf::ElementPtr cyl = shape->GetElement("cylinder");
+      if (cyl->HasElement("radius") && cyl->HasElement("length") &&
+          cyl->Get<double>("radius") > 0 && cyl->Get<double>("length") > 0)
+        this->mag->shape.SetCylinder(cyl->Get<double>("radius"), cyl->Get<double>("length"));
+      else
+        gzerr << "DipoleMagnet <cylinder> needs a positive <radius> and <length>, "
+            "using a point dipole" << std::endl;
+    } else if (shape->HasElement("box")) {
+      sdf::ElementPtr box = shape->GetElement("box");
+      if (box->HasElement("size") && box->Get<ignition::math::Vector3d>("size").Min() > 0)
+        this->mag->shape.SetBox(box->Get<ignition::math::Vector3d>("size"));
+      else
+        gzerr << "DipoleMagnet <box> needs a <size> with positive edges, "
+            "using a point dipole" << std::endl;
+    } else if (shape->HasElement("sphere")) {
+      sdf::ElementPtr sphere = shape->GetElement("sphere");
+      if (sphere->HasElement("radius") && sphere->Get<double>("radius") > 0)
+        this->mag->shape.SetSphere(sphere->Get<double>("radius"));
+      else
+        gzerr << "DipoleMagnet <sphere> needs a positive <radius>, using a point dipole"
+            << std::endl;
+    } else {
+      gzerr << "DipoleMagnet <shape> needs a <cylinder>, <box> or <sphere>, "
+          "using a point dipole" << std::endl;
+    }
+  }
+
+  // Manufacturing tolerance of the moment. The draws are fixed at load so
+  // that draw k of every magnet belongs to the same realization.
+  sdf::ElementPtr tolerance_sdf;
+  if (_sdf->HasElement("tolerance")) {
+    tolerance_sdf = _sdf->GetElement("tolerance");
+    size_t samples = 1000;
+    double strength = 0;
+    double angle = 0;
+    std::uint32_t seed = std::hash<std::string>()(
+        this->model->GetName() + "::" + this->link_name);
+    if (tolerance_sdf->HasElement("samples"))
+      samples = tolerance_sdf->Get<unsigned int>("samples");
+    if (tolerance_sdf->HasElement("strength"))
+      strength = tolerance_sdf->Get<double>("strength");
+    if (tolerance_sdf->HasElement("angle"))
+      angle = tolerance_sdf->Get<double>("angle")*M_PI/180;
+    if (tolerance_sdf->HasElement("seed"))
+      seed ^= tolerance_sdf->Get<unsigned int>("seed");
+    if (samples == 0 || this->mag->polarizability > 0) {
+      gzerr << "DipoleMagnet <tolerance> needs a positive <samples> and a "
+          "permanent magnet, ignoring it" << std::endl;
+      tolerance_sdf.reset();
+    } else {
+      this->mag->moment_samples = MomentSamples::Draw(this->mag->moment, samples,
+          strength, angle, seed);
+    }
+  }
+
+  this->mag->lod_near_ratio = 2.0;
+  if (_sdf->HasElement("lodNearRatio")){
+    this->mag->lod_near_ratio = _sdf->Get<double>("lodNearRatio");
+  }
+  if (this->mag->lod_near_ratio < 0) {
+    gzerr << "DipoleMagnet <lodNearRatio> must not be negative, using 2" << std::endl;
+    this->mag->lod_near_ratio = 2.0;
+  }
+
+  this->mag->lod_far_ratio = 3.0;
+  if (_sdf->HasElement("lodFarRatio")){
+    this->mag->lod_far_ratio = _sdf->Get<double>("lodFarRatio");
+  }
+  if (this->mag->lod_far_ratio <= this->mag->lod_near_ratio)
+    this->mag->lod_far_ratio = this->mag->lod_near_ratio*(1 + 1e-6);
+
+  this->far_field_ratio = 0;
+  if (_sdf->HasElement("farFieldRatio")){
+    this->far_field_ratio = _sdf->Get<double>("farFieldRatio");
+  }
+
+  // The kernel is chosen once here, so the interaction loops are compiled
+  // for exactly this model and the outputs the plugin uses
+  std::string interaction_model = "point";
+  if (_sdf->HasElement("interactionModel")){
+    interaction_model = _sdf->Get<std::string>("interactionModel");
+  }
+  if (interaction_model == "softened") {
+    double softening = _sdf->HasElement("softeningLength") ?
+        _sdf->Get<double>("softeningLength") : 0.0;
+    if (softening > 0) {
+      this->SelectKernel(SoftenedDipoleModel(softening));
+    } else {
+      gzerr << "DipoleMagnet softened model needs a positive <softeningLength>, "
+          "using a point dipole" << std::endl;
+      this->SelectKernel(PointDipoleModel());
+    }
+  } else if (interaction_model == "gilbert") {
+    double separation = _sdf->HasElement("poleSeparation") ?
+        _sdf->Get<double>("poleSeparation") : 0.0;
+    if (separation > 0) {
+      this->SelectKernel(GilbertModel(separation));
+    } else {
+      gzerr << "DipoleMagnet gilbert model needs a positive <poleSeparation>, "
+          "using a point dipole" << std::endl;
+      this->SelectKernel(PointDipoleModel());
+    }
+  } else {
+    if (interaction_model != "point")
+      gzerr << "DipoleMagnet <interactionModel> must be point, softened or gilbert, "
+          "using a point dipole" << std::endl;
+    this->SelectKernel(PointDipoleModel());
+  }
+
   if (this->should_publish) {
     if (!_sdf->HasElement("topicNs"))
     {
@@ -130,32 +275,141 @@ void DipoleMagnet::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf) {
       return;
     }
 
-    this->rosnode = new ros::NodeHandle(this->robot_namespace);
-    this->rosnode->setCallbackQueue(&this->queue);
+    this->rosnode = DipoleMagnet::GetSharedNode(this->robot_namespace);
+    this->tracked_object = boost::make_shared<int>(0);
 
-    this->wrench_pub = this->rosnode->advertise<geometry_msgs::WrenchStamped>(
+    this->wrench_pub = this->rosnode->node.advertise<geometry_msgs::WrenchStamped>(
         this->topic_ns + "/wrench", 1,
         boost::bind( &DipoleMagnet::Connect,this),
-        boost::bind( &DipoleMagnet::Disconnect,this), ros::VoidPtr(), &this->queue);
-    this->mfs_pub = this->rosnode->advertise<sensor_msgs::MagneticField>(
+        boost::bind( &DipoleMagnet::Disconnect,this), this->tracked_object,
+        &this->rosnode->queue);
+    this->mfs_pub = this->rosnode->node.advertise<sensor_msgs::MagneticField>(
         this->topic_ns + "/mfs", 1,
         boost::bind( &DipoleMagnet::Connect,this),
-        boost::bind( &DipoleMagnet::Disconnect,this), ros::VoidPtr(), &this->queue);
+        boost::bind( &DipoleMagnet::Disconnect,this), this->tracked_object,
+        &this->rosnode->queue);
+
+    // Stamps that let magnet_latency_probe time every mfs sample. The
+    // queue is long so that the stamps are not what gets dropped.
+    if (_sdf->HasElement("latencyProbe") && _sdf->Get<bool>("latencyProbe")) {
+      std_msgs::MultiArrayDimension cols;
+      cols.label = "seq,sim_time_ns,step_time,send_time";
+      cols.size = LatencyProbe::STAMP_FIELD_COUNT;
+      cols.stride = LatencyProbe::STAMP_FIELD_COUNT;
+      this->mfs_stamp_msg.layout.dim.push_back(cols);
+      this->mfs_stamp_msg.data.resize(LatencyProbe::STAMP_FIELD_COUNT);
+      this->mfs_stamp_pub = this->rosnode->node.advertise<std_msgs::Float64MultiArray>(
+          this->topic_ns + "/mfs_stamp", 1000);
+    }
+
+    // Strongest contributions to the wrench, for debugging
+    if (_sdf->HasElement("introspection")) {
+      sdf::ElementPtr intro = _sdf->GetElement("introspection");
+      size_t top_k = 5;
+      if (intro->HasElement("top_k"))
+        top_k = intro->Get<unsigned int>("top_k");
+      bool rank_by_torque = intro->HasElement("rank_by") &&
+          intro->Get<std::string>("rank_by") == "torque";
+      if (intro->HasElement("updateRate"))
+        this->contributions_rate = intro->Get<double>("updateRate");
+      this->contributions.reset(new TopContributions(top_k, rank_by_torque));
+
+      std_msgs::MultiArrayDimension rows;
+      rows.label = "contribution";
+      rows.size = 0;
+      rows.stride = 0;
+      std_msgs::MultiArrayDimension cols;
+      cols.label = "kind,id,fx,fy,fz,tx,ty,tz";
+      cols.size = 8;
+      cols.stride = 8;
+      this->contributions_msg.layout.dim.push_back(rows);
+      this->contributions_msg.layout.dim.push_back(cols);
+      this->contributions_pub = this->rosnode->node.advertise<std_msgs::Float64MultiArray>(
+          this->topic_ns + "/contributions", 1);
+    }
 
-    // Custom Callback Queue
-    this->callback_queue_thread = boost::thread( boost::bind( &DipoleMagnet::QueueThread,this ) );
+    // Statistics of the wrench and field over the tolerance draws
+    if (tolerance_sdf && this->mag->calculate) {
+      if (tolerance_sdf->HasElement("threads"))
+        gzwarn << "DipoleMagnet <tolerance><threads> is ignored, the analysis "
+            "runs on the threads of the MagneticEnvironment plugin" << std::endl;
+      if (tolerance_sdf->HasElement("updateRate"))
+        this->tolerance_rate = tolerance_sdf->Get<double>("updateRate");
+      this->tolerance.reset(new ToleranceAnalysis());
+
+      std_msgs::MultiArrayDimension rows;
+      rows.label = "fx,fy,fz,tx,ty,tz,bx,by,bz";
+      rows.size = ToleranceAnalysis::kOutputs;
+      rows.stride = ToleranceAnalysis::kOutputs*ToleranceAnalysis::STATISTIC_COUNT;
+      std_msgs::MultiArrayDimension cols;
+      cols.label = "mean,stddev,p05,p50,p95";
+      cols.size = ToleranceAnalysis::STATISTIC_COUNT;
+      cols.stride = ToleranceAnalysis::STATISTIC_COUNT;
+      this->tolerance_msg.layout.dim.push_back(rows);
+      this->tolerance_msg.layout.dim.push_back(cols);
+      this->tolerance_pub = this->rosnode->node.advertise<std_msgs::Float64MultiArray>(
+          this->topic_ns + "/tolerance", 1);
+    }
   }
 
   this->mag->model_id = this->model->GetId() * 100 + this->low_id;
+  this->mag->owner_id = this->model->GetId();
 
   gzmsg << "Loaded Gazebo dipole magnet plugin on " << this->model->GetName() << std::endl;
 
-  DipoleMagnetContainer::Get().Add(this->mag);
+  this->initial_moment = this->mag->moment;
+  this->UpdatePose();
+  // Removal does not wait for steps, so the callbacks hold this magnet
+  // while they run and skip it once it is gone
+  std::weak_ptr<DipoleMagnet> self = this->shared_from_this();
+  this->mag->update_pose = [self]() {
+    if (std::shared_ptr<DipoleMagnet> magnet = self.lock())
+      magnet->UpdatePose();
+  };
+  if (this->mag->calculate) {
+    this->mag->solve = [self]() {
+      if (std::shared_ptr<DipoleMagnet> magnet = self.lock())
+        magnet->Solve();
+    };
+  }
+  this->container = DipoleMagnetContainer::Get(this->world);
+  this->container->Add(this->mag);
 
   // Listen to the update event. This event is broadcast every
   // simulation iteration.
   this->update_connection = event::Events::ConnectWorldUpdateBegin(
-      boost::bind(&DipoleMagnet::OnUpdate, this, _1));
+      [self](const common::UpdateInfo& _info) {
+        if (std::shared_ptr<DipoleMagnet> magnet = self.lock())
+          magnet->OnUpdate(_info);
+      });
+}
+
+void DipoleMagnet::UpdatePose() {
+  ignition::math::Pose3d p_self = this->link->WorldCoGPose();
+  p_self.Pos() += -p_self.Rot().RotateVector(this->mag->offset.Pos());
+  p_self.Rot() *= this->mag->offset.Rot().Inverse();
+  this->mag->pose = p_self;
+  // Only needed to tell whether the magnet is at rest
+  if (this->container && this->container->sleep) {
+    this->mag->sleep_state.linear_velocity = this->link->WorldCoGLinearVel();
+    this->mag->sleep_state.angular_velocity = this->link->WorldAngularVel();
+  }
+}
+
+void DipoleMagnet::Reset() {
+  if (this->mag) {
+    this->mag->moment = this->initial_moment;
+    this->mag->force.Set(0, 0, 0);
+    this->mag->torque.Set(0, 0, 0);
+    this->mag->field.Set(0, 0, 0);
+  }
+  this->held_force.Set(0, 0, 0);
+  this->held_torque.Set(0, 0, 0);
+  this->held_mfs.Set(0, 0, 0);
+  this->held_energy = 0;
+  this->last_time = common::Time();
+  if (this->container)
+    this->container->Reset();
 }
 
 void DipoleMagnet::Connect() {
@@ -166,60 +420,347 @@ void DipoleMagnet::Disconnect() {
   this->connect_count--;
 }
 
-void DipoleMagnet::QueueThread() {
+DipoleMagnet::SharedNode::SharedNode(const std::string& ns) : node(ns) {
+  this->node.setCallbackQueue(&this->queue);
+  // Custom Callback Queue
+  this->callback_queue_thread = boost::thread(
+      boost::bind(&DipoleMagnet::SharedNode::QueueThread, this));
+}
+
+DipoleMagnet::SharedNode::~SharedNode() {
+  this->queue.clear();
+  this->queue.disable();
+  this->node.shutdown();
+  this->callback_queue_thread.join();
+}
+
+void DipoleMagnet::SharedNode::QueueThread() {
   static const double timeout = 0.01;
 
-  while (this->rosnode->ok())
+  while (this->node.ok())
   {
     this->queue.callAvailable(ros::WallDuration(timeout));
   }
 }
 
+std::shared_ptr<DipoleMagnet::SharedNode> DipoleMagnet::GetSharedNode(const std::string& ns) {
+  static boost::mutex registry_lock;
+  static std::map<std::string, std::weak_ptr<SharedNode> > registry;
+
+  boost::mutex::scoped_lock lock(registry_lock);
+  std::shared_ptr<SharedNode> shared = registry[ns].lock();
+  if (!shared) {
+    shared = std::make_shared<SharedNode>(ns);
+    registry[ns] = shared;
+  }
+  return shared;
+}
+
 // Called by the world update start event
 void DipoleMagnet::OnUpdate(const common::UpdateInfo & /*_info*/) {
 
   // Calculate the force from all other magnets
-  ignition::math::Pose3d p_self = this->link->WorldCoGPose();
-  p_self.Pos() += -p_self.Rot().RotateVector(this->mag->offset.Pos());
-  p_self.Rot() *= this->mag->offset.Rot().Inverse();
-
-  this->mag->pose = p_self;
+  this->UpdatePose();
 
   if (!this->mag->calculate)
     return;
 
-  DipoleMagnetContainer& dp = DipoleMagnetContainer::Get();
-
+  DipoleMagnetContainer& dp = *this->container;
+  QualityGovernor::Timer timer(dp.governor.get());
+  dp.Refresh(this->world->Iterations(), this->world->SimTime());
+
+  // On steps the governor skips, and while the magnet is asleep, the last
+  // wrench is held
+  if (dp.IsUpdateStep() && !dp.IsSolved() && !this->mag->sleep_state.asleep)
+    this->Solve();
+
+  this->link->AddForce(this->held_force);
+  this->link->AddTorque(this->held_torque);
+  // The held energy belongs to the poses of the step that solved it, so
+  // steps the governor skips add no share
+  if (dp.energy && dp.IsUpdateStep()) {
+    dp.energy->Add(this->held_energy,
+        this->held_force.Dot(this->link->WorldCoGLinearVel()) +
+        this->held_torque.Dot(this->link->WorldAngularVel()));
+  }
+  this->PublishData(this->held_force, this->held_torque, this->held_mfs);
+  if (this->recording) {
+    this->PublishContributions();
+    this->recording = NULL;
+  }
+  if (this->tolerance && dp.IsUpdateStep())
+    this->PublishTolerance();
+}
 
+void DipoleMagnet::Solve() {
+  DipoleMagnetContainer& dp = *this->container;
+  const ignition::math::Pose3d p_self = this->mag->pose;
   ignition::math::Vector3d moment_world = p_self.Rot().RotateVector(this->mag->moment);
 
+  // Contributions are only recorded on steps they are published. Solve may
+  // run on a worker thread, so the time comes from the container.
+  this->recording = NULL;
+  if (this->contributions) {
+    const common::Time& cur_time = dp.GetStepTime();
+    if (cur_time < this->contributions_time ||
+        (cur_time - this->contributions_time).Double() >= 1.0/this->contributions_rate) {
+      this->contributions_time = cur_time;
+      this->contributions->Clear();
+      this->recording = this->contributions.get();
+    }
+  }
+
   ignition::math::Vector3d force(0, 0, 0);
   ignition::math::Vector3d torque(0, 0, 0);
   ignition::math::Vector3d mfs(0, 0, 0);
-  for(DipoleMagnetContainer::MagnetPtrV::iterator it = dp.magnets.begin(); it < dp.magnets.end(); it++){
-    std::shared_ptr<DipoleMagnetContainer::Magnet> mag_other = *it;
-    if (mag_other->model_id != this->mag->model_id) {
-      ignition::math::Pose3d p_other = mag_other->pose;
-      ignition::math::Vector3d m_other = p_other.Rot().RotateVector(mag_other->moment);
+  double energy = 0;
+  // The energy costs one dot product per pair, but only when it is used
+  const InteractionSolver& compute = dp.energy ?
+      this->compute_interactions_energy : this->compute_interactions;
+  if (dp.ArePairsSolved(*this->mag)) {
+    // Interactions with all magnets, and their periodic images, or with the
+    // magnets of the cluster were solved by the container for this step
+    force = this->mag->force;
+    torque = this->mag->torque;
+    mfs = p_self.Rot().RotateVectorReverse(this->mag->field);
+    // Pairs with magnets that do not calculate count in full, as in the
+    // magnet's own loop
+    energy = -0.5*moment_world.Dot(this->mag->field + this->mag->fixed_field);
+    if (this->recording)
+      this->recording->Add(dp.periodic ? TopContributions::PERIODIC :
+          TopContributions::ALL_PAIRS, 0, force, torque);
+    if (!dp.periodic)
+      compute(dp, p_self, moment_world, force, torque, mfs, energy);
+  } else {
+    compute(dp, p_self, moment_world, force, torque, mfs, energy);
+  }
+
+  // Background and coil fields, applied through the local field gradient
+  for(DipoleMagnetContainer::FieldSourcePtrV::const_iterator it = dp.field_sources.begin(); it < dp.field_sources.end(); it++){
+    ignition::math::Vector3d field;
+    ignition::math::Matrix3d gradient;
+    (*it)->GetField(p_self.Pos(), field, gradient);
+
+    ignition::math::Vector3d force_tmp = gradient.Transposed() * moment_world;
+    ignition::math::Vector3d torque_tmp = moment_world.Cross(field);
+    if (this->recording)
+      this->recording->Add(TopContributions::FIELD_SOURCE,
+          it - dp.field_sources.begin(), force_tmp, torque_tmp);
+
+    force += force_tmp;
+    torque += torque_tmp;
+    mfs += p_self.Rot().RotateVectorReverse(field);
+    energy -= moment_world.Dot(field);
+  }
+
+  this->held_force = force;
+  this->held_torque = torque;
+  this->held_mfs = mfs;
+  this->held_energy = energy;
+  if (dp.sleep)
+    dp.sleep->RecordWrench(this->mag->sleep_state, force, torque);
+}
 
+template <class Model>
+void DipoleMagnet::SelectKernel(const Model& model) {
+  using std::placeholders::_1;
+  using std::placeholders::_2;
+  using std::placeholders::_3;
+  using std::placeholders::_4;
+  using std::placeholders::_5;
+  using std::placeholders::_6;
+  using std::placeholders::_7;
+  // The field is only needed when it is published
+  if (this->should_publish) {
+    typedef InteractionKernel<Model, OUTPUT_FORCE | OUTPUT_TORQUE | OUTPUT_FIELD> Kernel;
+    typedef InteractionKernel<Model, Kernel::outputs | OUTPUT_ENERGY> EnergyKernel;
+    this->compute_interactions = std::bind(&DipoleMagnet::ComputeInteractions<Kernel>,
+        this, Kernel(model), _1, _2, _3, _4, _5, _6, _7);
+    this->compute_interactions_energy = std::bind(&DipoleMagnet::ComputeInteractions<EnergyKernel>,
+        this, EnergyKernel(model), _1, _2, _3, _4, _5, _6, _7);
+  } else {
+    typedef InteractionKernel<Model, OUTPUT_FORCE | OUTPUT_TORQUE> Kernel;
+    typedef InteractionKernel<Model, Kernel::outputs | OUTPUT_ENERGY> EnergyKernel;
+    this->compute_interactions = std::bind(&DipoleMagnet::ComputeInteractions<Kernel>,
+        this, Kernel(model), _1, _2, _3, _4, _5, _6, _7);
+    this->compute_interactions_energy = std::bind(&DipoleMagnet::ComputeInteractions<EnergyKernel>,
+        this, EnergyKernel(model), _1, _2, _3, _4, _5, _6, _7);
+  }
+}
+
+template <class Kernel>
+void DipoleMagnet::ComputeInteractions(const Kernel& kernel,
+    DipoleMagnetContainer& dp,
+    const ignition::math::Pose3d& p_self,
+    const ignition::math::Vector3d& moment_world,
+    ignition::math::Vector3d& force,
+    ignition::math::Vector3d& torque,
+    ignition::math::Vector3d& mfs, double& energy) {
+  // Interactions between magnets may already be solved by the container.
+  // Shapes and recording are decided here once per step, for all pairs.
+  if (!dp.ArePairsSolved(*this->mag)) {
+    if (dp.ArePointDipoles()) {
+      if (this->recording)
+        this->ComputeMagnetInteractions<Kernel, PairPolicy<false, true> >(kernel, dp, p_self,
+            moment_world, force, torque, mfs, energy);
+      else
+        this->ComputeMagnetInteractions<Kernel, PairPolicy<false, false> >(kernel, dp, p_self,
+            moment_world, force, torque, mfs, energy);
+    } else {
+      if (this->recording)
+        this->ComputeMagnetInteractions<Kernel, PairPolicy<true, true> >(kernel, dp, p_self,
+            moment_world, force, torque, mfs, energy);
+      else
+        this->ComputeMagnetInteractions<Kernel, PairPolicy<true, false> >(kernel, dp, p_self,
+            moment_world, force, torque, mfs, energy);
+    }
+  }
+  this->ComputePlaneInteractions(kernel, dp, p_self, moment_world, force, torque, mfs, energy);
+}
+
+template <class Kernel, class Policy>
+void DipoleMagnet::ComputeMagnetInteractions(const Kernel& kernel,
+    DipoleMagnetContainer& dp,
+    const ignition::math::Pose3d& p_self,
+    const ignition::math::Vector3d& moment_world,
+    ignition::math::Vector3d& force,
+    ignition::math::Vector3d& torque,
+    ignition::math::Vector3d& mfs, double& energy) {
+  double far_field_ratio = this->far_field_ratio;
+  double cutoff = 0;
+  if (dp.governor) {
+    const QualityGovernor::Settings& settings = dp.governor->GetSettings();
+    if (settings.far_field_ratio > 0 &&
+        (far_field_ratio <= 0 || settings.far_field_ratio < far_field_ratio))
+      far_field_ratio = settings.far_field_ratio;
+    cutoff = settings.cutoff;
+  }
+
+  // Only models in the same cluster, if clustering is enabled
+  const DipoleMagnetContainer::GroupPtrV& groups = dp.GetInteractingGroups(*this->mag);
+  for(DipoleMagnetContainer::GroupPtrV::const_iterator git = groups.begin(); git != groups.end(); git++){
+    const DipoleMagnetContainer::Group& group = **git;
+
+    // Models beyond the cutoff are ignored, but their largest possible
+    // field is reported to the governor
+    if (cutoff > 0 && group.owner_id != this->mag->owner_id) {
+      double dist = p_self.Pos().Distance(group.aggregate.center) - group.aggregate.radius;
+      if (dist > cutoff) {
+        dp.governor->ReportCutoffField(2e-7*group.moment_sum/(dist*dist*dist));
+        continue;
+      }
+    }
+
+    // Far away models are represented by their aggregate multipole
+    if (far_field_ratio > 0 && group.owner_id != this->mag->owner_id &&
+        group.magnets.size() > 1 &&
+        p_self.Pos().Distance(group.aggregate.center) >
+        far_field_ratio * group.aggregate.radius) {
       ignition::math::Vector3d force_tmp;
       ignition::math::Vector3d torque_tmp;
-      GetForceTorque(p_self, moment_world, p_other, m_other, force_tmp, torque_tmp);
+      ignition::math::Vector3d field_tmp;
+      group.aggregate.GetForceTorque(p_self.Pos(), moment_world, force_tmp, torque_tmp, field_tmp);
+      if (Policy::recorded)
+        this->recording->Add(TopContributions::AGGREGATE, group.owner_id, force_tmp, torque_tmp);
 
       force += force_tmp;
       torque += torque_tmp;
+      if (Kernel::outputs & OUTPUT_FIELD)
+        mfs += p_self.Rot().RotateVectorReverse(field_tmp);
+      if (Kernel::outputs & OUTPUT_ENERGY)
+        energy -= moment_world.Dot(field_tmp)*(group.fixed ? 1.0 : 0.5);
+      continue;
+    }
 
-      ignition::math::Vector3<double> mfs_tmp;
-      GetMFS(p_self, p_other, m_other, mfs_tmp);
-
-      mfs += mfs_tmp;
+    if (group.owner_id == this->mag->owner_id)
+      this->AddGroupInteractions<Kernel, Policy, true>(kernel, group, p_self, moment_world,
+          force, torque, mfs, energy);
+    else
+      this->AddGroupInteractions<Kernel, Policy, false>(kernel, group, p_self, moment_world,
+          force, torque, mfs, energy);
+  }
+}
 
-      this->link->AddForce(force_tmp);
-      this->link->AddTorque(torque_tmp);
+template <class Kernel, class Policy, bool kOwnModel>
+void DipoleMagnet::AddGroupInteractions(const Kernel& kernel,
+    const DipoleMagnetContainer::Group& group,
+    const ignition::math::Pose3d& p_self,
+    const ignition::math::Vector3d& moment_world,
+    ignition::math::Vector3d& force,
+    ignition::math::Vector3d& torque,
+    ignition::math::Vector3d& mfs, double& energy) {
+  for(DipoleMagnetContainer::MagnetPtrV::const_iterator it = group.magnets.begin(); it < group.magnets.end(); it++){
+    const DipoleMagnetContainer::Magnet& other = **it;
+    // Other models never share this magnet's id
+    if (kOwnModel && other.model_id == this->mag->model_id)
+      continue;
+    const ignition::math::Pose3d& p_other = other.pose;
+    ignition::math::Vector3d m_other = p_other.Rot().RotateVector(other.moment);
+
+    Interaction pair;
+    const double w = Policy::shaped ?
+        GetFiniteSizeWeight(p_self, *this->mag, p_other, other) : 0.0;
+    if (!Policy::shaped || w < 1) {
+      kernel(p_self.Pos(), moment_world, p_other.Pos(), m_other, pair);
+    } else {
+      pair.force.Set(0, 0, 0);
+      pair.torque.Set(0, 0, 0);
+      pair.field.Set(0, 0, 0);
+      pair.energy = 0;
     }
+    if (Policy::shaped && w > 0) {
+      ignition::math::Vector3d force_fs;
+      ignition::math::Vector3d torque_fs;
+      ignition::math::Vector3d field_fs;
+      GetFiniteForceTorque(p_self, moment_world, this->mag->shape,
+          p_other, m_other, other.shape, force_fs, torque_fs, field_fs);
+      pair.force = pair.force*(1 - w) + force_fs*w;
+      pair.torque = pair.torque*(1 - w) + torque_fs*w;
+      pair.field = pair.field*(1 - w) + field_fs*w;
+      if (Kernel::outputs & OUTPUT_ENERGY)
+        pair.energy = pair.energy*(1 - w) - moment_world.Dot(field_fs)*w;
+    }
+    if (Policy::recorded)
+      this->recording->Add(TopContributions::MAGNET, other.model_id, pair.force, pair.torque);
+
+    force += pair.force;
+    torque += pair.torque;
+    if (Kernel::outputs & OUTPUT_FIELD)
+      mfs += p_self.Rot().RotateVectorReverse(pair.field);
+    // Magnets that do not calculate never count their share
+    if (Kernel::outputs & OUTPUT_ENERGY)
+      energy += pair.energy*(other.calculate ? 0.5 : 1.0);
   }
+}
 
-  this->PublishData(force, torque, mfs);
+template <class Kernel>
+void DipoleMagnet::ComputePlaneInteractions(const Kernel& kernel,
+    DipoleMagnetContainer& dp,
+    const ignition::math::Pose3d& p_self,
+    const ignition::math::Vector3d& moment_world,
+    ignition::math::Vector3d& force,
+    ignition::math::Vector3d& torque,
+    ignition::math::Vector3d& mfs, double& energy) {
+  // Attraction to ferromagnetic boundaries through image dipoles
+  for(DipoleMagnetContainer::FerromagneticPlaneV::const_iterator it = dp.planes.begin(); it < dp.planes.end(); it++){
+    ignition::math::Vector3d p_image;
+    ignition::math::Vector3d m_image;
+    if (!it->GetImage(p_self.Pos(), moment_world, p_image, m_image))
+      continue;
+
+    Interaction image;
+    kernel(p_self.Pos(), moment_world, p_image, m_image, image);
+    if (this->recording)
+      this->recording->Add(TopContributions::PLANE, it - dp.planes.begin(), image.force, image.torque);
+
+    force += image.force;
+    torque += image.torque;
+    if (Kernel::outputs & OUTPUT_FIELD)
+      mfs += p_self.Rot().RotateVectorReverse(image.field);
+    // The image moves with the magnet, so only half is its energy
+    if (Kernel::outputs & OUTPUT_ENERGY)
+      energy += 0.5*image.energy;
+  }
 }
 
 void DipoleMagnet::PublishData(
@@ -232,6 +773,10 @@ void DipoleMagnet::PublishData(
     if (this->update_rate > 0 &&
         (cur_time-this->last_time).Double() < (1.0/this->update_rate))
       return;
+    if (this->container->governor && this->world->Iterations() %
+        this->container->governor->GetSettings().publish_interval != 0)
+      return;
+    this->last_time = cur_time;
 
     this->lock.lock();
     // copy data into wrench message
@@ -258,63 +803,209 @@ void DipoleMagnet::PublishData(
 
 
     this->wrench_pub.publish(this->wrench_msg);
+    double send_time = MonotonicSeconds();
     this->mfs_pub.publish(this->mfs_msg);
 
+    if (this->mfs_stamp_pub) {
+      std::vector<double>& stamp = this->mfs_stamp_msg.data;
+      stamp[LatencyProbe::STAMP_SEQ] = this->mfs_seq++;
+      stamp[LatencyProbe::STAMP_SIM_TIME] = cur_time.sec*1e9 + cur_time.nsec;
+      stamp[LatencyProbe::STAMP_STEP_TIME] = this->container->GetStepStart();
+      stamp[LatencyProbe::STAMP_SEND_TIME] = send_time;
+      this->mfs_stamp_pub.publish(this->mfs_stamp_msg);
+    }
+
     this->lock.unlock();
   }
 }
 
 
-void DipoleMagnet::GetForceTorque(const ignition::math::Pose3d& p_self,
-    const ignition::math::Vector3d& m_self,
-    const ignition::math::Pose3d& p_other,
-    const ignition::math::Vector3d& m_other,
-    ignition::math::Vector3d& force,
-    ignition::math::Vector3d& torque) {
-
-  bool debug = false;
-  ignition::math::Vector3d p = p_self.Pos() - p_other.Pos();
-  ignition::math::Vector3d p_unit = p/p.Length();
-
-  ignition::math::Vector3d m1 = m_other;
-  ignition::math::Vector3d m2 = m_self;
-  if (debug)
-    std::cout << "p: " << p << " m1: " << m1 << " m2: " << m2 << std::endl;
-
-  double K = 3.0*1e-7/pow(p.Length(), 4);
-  force = K * (m2 * (m1.Dot(p_unit)) +  m1 * (m2.Dot(p_unit)) +
-      p_unit*(m1.Dot(m2)) - 5*p_unit*(m1.Dot(p_unit))*(m2.Dot(p_unit)));
-
-  double Ktorque = 1e-7/pow(p.Length(), 3);
-  ignition::math::Vector3d B1 = Ktorque*(3*(m1.Dot(p_unit))*p_unit - m1);
-  torque = m2.Cross(B1);
-  if (debug)
-    std::cout << "B: " << B1 << " K: " << Ktorque << " t: " << torque << std::endl;
+void DipoleMagnet::PublishTolerance() {
+  common::Time cur_time = this->world->SimTime();
+  if (cur_time >= this->tolerance_time &&
+      (cur_time - this->tolerance_time).Double() < 1.0/this->tolerance_rate)
+    return;
+  if (this->tolerance_pub.getNumSubscribers() == 0)
+    return;
+  this->tolerance_time = cur_time;
+
+  // Every magnet this one interacts with, exactly and as a point dipole.
+  // Soft magnets follow the draws of the permanent magnets.
+  DipoleMagnetContainer& dp = *this->container;
+  const ignition::math::Pose3d& pose = this->mag->pose;
+  const MomentSamples& self = *this->mag->moment_samples;
+  const size_t n = self.Size();
+  this->tolerance_sources.clear();
+  const DipoleMagnetContainer::GroupPtrV& groups = dp.GetInteractingGroups(*this->mag);
+  for (size_t g = 0; g < groups.size(); ++g) {
+    const DipoleMagnetContainer::MagnetPtrV& mags = groups[g]->magnets;
+    for (size_t i = 0; i < mags.size(); ++i) {
+      const DipoleMagnetContainer::Magnet& other = *mags[i];
+      if (other.model_id == this->mag->model_id)
+        continue;
+      ToleranceAnalysis::Source source;
+      source.pose = other.pose;
+      source.moment = other.moment;
+      source.samples = other.moment_samples;
+      if (other.polarizability > 0) {
+        source.pose.Rot() = ignition::math::Quaterniond::Identity;
+        source.samples = GetInducedSamples(dp, other, n);
+      }
+      this->tolerance_sources.push_back(source);
+    }
+  }
+
+  // The images in ferromagnetic planes follow the draws of this magnet
+  for (size_t i = 0; i < dp.planes.size(); ++i) {
+    const DipoleMagnetContainer::FerromagneticPlane& plane = dp.planes[i];
+    ToleranceAnalysis::Source source;
+    ignition::math::Vector3d p_image;
+    if (!plane.GetImage(pose.Pos(), pose.Rot().RotateVector(this->mag->moment),
+          p_image, source.moment))
+      continue;
+    source.pose = ignition::math::Pose3d(p_image, ignition::math::Quaterniond::Identity);
+    std::shared_ptr<MomentSamples> images = std::make_shared<MomentSamples>();
+    images->x.resize(n);
+    images->y.resize(n);
+    images->z.resize(n);
+    for (size_t k = 0; k < n; ++k) {
+      ignition::math::Vector3d m_image;
+      plane.GetImage(pose.Pos(), pose.Rot().RotateVector(
+            ignition::math::Vector3d(self.x[k], self.y[k], self.z[k])), p_image, m_image);
+      images->x[k] = m_image.X();
+      images->y[k] = m_image.Y();
+      images->z[k] = m_image.Z();
+    }
+    source.samples = images;
+    this->tolerance_sources.push_back(source);
+  }
+
+  // Background and coil fields are taken at their nominal values
+  ignition::math::Vector3d field(0, 0, 0);
+  ignition::math::Matrix3d gradient = ignition::math::Matrix3d::Zero;
+  for (size_t i = 0; i < dp.field_sources.size(); ++i) {
+    ignition::math::Vector3d field_tmp;
+    ignition::math::Matrix3d gradient_tmp;
+    dp.field_sources[i]->GetField(pose.Pos(), field_tmp, gradient_tmp);
+    field += field_tmp;
+    gradient += gradient_tmp;
+  }
+
+  this->tolerance->Evaluate(pose, self, this->tolerance_sources, field, gradient,
+      dp.task_pool.get());
+  this->tolerance->GetStatistics(this->tolerance_msg.data);
+  this->tolerance_pub.publish(this->tolerance_msg);
 }
 
-void DipoleMagnet::GetMFS(const ignition::math::Pose3d& p_self,
-    const ignition::math::Pose3d& p_other,
-    const ignition::math::Vector3d& m_other,
-    ignition::math::Vector3d& mfs) {
+std::shared_ptr<MomentSamples> DipoleMagnet::GetInducedSamples(
+    const DipoleMagnetContainer& dp, const DipoleMagnetContainer::Magnet& soft,
+    size_t samples) {
+  const ignition::math::Vector3d nominal = soft.pose.Rot().RotateVector(soft.moment);
+  std::shared_ptr<MomentSamples> induced = std::make_shared<MomentSamples>();
+  induced->x.assign(samples, nominal.X());
+  induced->y.assign(samples, nominal.Y());
+  induced->z.assign(samples, nominal.Z());
+
+  // The induced moment is linear in the field, so each draw adds the field
+  // of its deviation from the nominal moments
+  for (size_t j = 0; j < dp.magnets.size(); ++j) {
+    const DipoleMagnetContainer::Magnet& other = *dp.magnets[j];
+    const MomentSamples* draws = other.moment_samples.get();
+    const ignition::math::Vector3d r = soft.pose.Pos() - other.pose.Pos();
+    if (!draws || draws->Size() == 0 || r.SquaredLength() == 0)
+      continue;
+    for (size_t k = 0; k < samples; ++k) {
+      const size_t d = k % draws->Size();
+      const ignition::math::Vector3d delta = other.pose.Rot().RotateVector(
+          ignition::math::Vector3d(draws->x[d], draws->y[d], draws->z[d]) - other.moment);
+      const ignition::math::Vector3d m = DipoleField(r, delta)*soft.polarizability;
+      induced->x[k] += m.X();
+      induced->y[k] += m.Y();
+      induced->z[k] += m.Z();
+    }
+  }
+  return induced;
+}
+
+void DipoleMagnet::PublishContributions() {
+  std::vector<TopContributions::Entry> entries;
+  this->contributions->GetSorted(entries);
+
+  this->contributions_msg.layout.dim[0].size = entries.size();
+  this->contributions_msg.layout.dim[0].stride = 8*entries.size();
+  std::vector<double>& data = this->contributions_msg.data;
+  data.resize(8*entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const TopContributions::Entry& entry = entries[i];
+    data[8*i] = entry.kind;
+    data[8*i + 1] = entry.id;
+    for (int a = 0; a < 3; ++a) {
+      data[8*i + 2 + a] = entry.force[a];
+      data[8*i + 5 + a] = entry.torque[a];
+    }
+  }
+  this->contributions_pub.publish(this->contributions_msg);
+}
 
-  // sensor location
-  ignition::math::Vector3d p = p_self.Pos() - p_other.Pos();
-  ignition::math::Vector3d p_unit = p/p.Length();
+void DipoleMagnet::GetFiniteForceTorque(const ignition::math::Pose3d& p_self,
+    const ignition::math::Vector3d& m_self, const MagnetShape& s_self,
+    const ignition::math::Pose3d& p_other,
+    const ignition::math::Vector3d& m_other, const MagnetShape& s_other,
+    ignition::math::Vector3d& force, ignition::math::Vector3d& torque,
+    ignition::math::Vector3d& field) {
+  force.Set(0, 0, 0);
+  torque.Set(0, 0, 0);
+  field.Set(0, 0, 0);
+
+  const InteractionKernel<PointDipoleModel, OUTPUT_FORCE | OUTPUT_TORQUE> point;
+  for (size_t l = 0; l < s_other.points.size(); ++l) {
+    ignition::math::Vector3d p_l = p_other.Pos() + p_other.Rot().RotateVector(s_other.points[l]);
+    ignition::math::Vector3d m_l = m_other*s_other.weights[l];
+    field += DipoleField(p_self.Pos() - p_l, m_l);
+
+    for (size_t k = 0; k < s_self.points.size(); ++k) {
+      ignition::math::Vector3d lever = p_self.Rot().RotateVector(s_self.points[k]);
+      ignition::math::Vector3d m_k = m_self*s_self.weights[k];
+
+      Interaction pair;
+      point(p_self.Pos() + lever, m_k, p_l, m_l, pair);
+      force += pair.force;
+      torque += pair.torque + lever.Cross(pair.force);
+    }
+  }
+}
 
-  // Get the field at the sensor location
-  double K = 1e-7/pow(p.Length(), 3);
-  ignition::math::Vector3d B = K*(3*(m_other.Dot(p_unit))*p_unit - m_other);
+double DipoleMagnet::GetFiniteSizeWeight(const ignition::math::Pose3d& p_self,
+    const DipoleMagnetContainer::Magnet& self, const ignition::math::Pose3d& p_other,
+    const DipoleMagnetContainer::Magnet& other) {
+  if (self.shape.points.size() < 2 && other.shape.points.size() < 2)
+    return 0;
+
+  // Symmetric in the two magnets, so their forces are equal and opposite
+  // across the blend as well
+  double extent = self.shape.radius + other.shape.radius;
+  double near_dist = std::max(self.lod_near_ratio, other.lod_near_ratio) * extent;
+  double far_dist = std::max(self.lod_far_ratio, other.lod_far_ratio) * extent;
+  double d = p_self.Pos().Distance(p_other.Pos());
+  if (d <= near_dist)
+    return 1;
+  if (d >= far_dist)
+    return 0;
+  double t = (far_dist - d)/(far_dist - near_dist);
+  return t*t*(3 - 2*t);
+}
 
-  // Rotate the B vector into the capsule/body frame
-  ignition::math::Vector3d B_body = p_self.Rot().RotateVectorReverse(B);
+void DipoleMagnetPlugin::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf) {
+  this->magnet = std::make_shared<DipoleMagnet>();
+  this->magnet->Load(_parent, _sdf);
+}
 
-  // Assign vector
-  mfs[0] = B_body[0];
-  mfs[1] = B_body[1];
-  mfs[2] = B_body[2];
+void DipoleMagnetPlugin::Reset() {
+  if (this->magnet)
+    this->magnet->Reset();
 }
 
 // Register this plugin with the simulator
-GZ_REGISTER_MODEL_PLUGIN(DipoleMagnet)
+GZ_REGISTER_MODEL_PLUGIN(DipoleMagnetPlugin)
 
 }
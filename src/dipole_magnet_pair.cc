@@ -129,6 +129,37 @@ void DipoleMagnetPair::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf) {
     this->mag.second->offset.Rot() = ignition::math::Quaterniond(rpy_offset);
   }
 
+  std::string interaction_model = "point";
+  if (_sdf->HasElement("interactionModel")){
+    interaction_model = _sdf->Get<std::string>("interactionModel");
+  }
+  if (interaction_model == "softened") {
+    double softening = _sdf->HasElement("softeningLength") ?
+        _sdf->Get<double>("softeningLength") : 0.0;
+    if (softening > 0) {
+      this->SelectKernel(SoftenedDipoleModel(softening));
+    } else {
+      gzerr << "DipoleMagnetPair softened model needs a positive <softeningLength>, "
+          "using a point dipole" << std::endl;
+      this->SelectKernel(PointDipoleModel());
+    }
+  } else if (interaction_model == "gilbert") {
+    double separation = _sdf->HasElement("poleSeparation") ?
+        _sdf->Get<double>("poleSeparation") : 0.0;
+    if (separation > 0) {
+      this->SelectKernel(GilbertModel(separation));
+    } else {
+      gzerr << "DipoleMagnetPair gilbert model needs a positive <poleSeparation>, "
+          "using a point dipole" << std::endl;
+      this->SelectKernel(PointDipoleModel());
+    }
+  } else {
+    if (interaction_model != "point")
+      gzerr << "DipoleMagnetPair <interactionModel> must be point, softened or gilbert, "
+          "using a point dipole" << std::endl;
+    this->SelectKernel(PointDipoleModel());
+  }
+
   if (this->should_publish) {
     if (!_sdf->HasElement("topicNs"))
     {
@@ -209,17 +240,14 @@ void DipoleMagnetPair::OnUpdate(const common::UpdateInfo & /*_info*/) {
   
   ignition::math::Vector3d m_other = p_other.Rot().RotateVector(this->mag.second->moment);
 
-  ignition::math::Vector3d force_tmp;
-  ignition::math::Vector3d torque_tmp;
-  GetForceTorque(p_self, moment_world, p_other, m_other, force_tmp, torque_tmp);
+  Interaction pair;
+  this->kernel(p_self.Pos(), moment_world, p_other.Pos(), m_other, pair);
+  ignition::math::Vector3d force_tmp = pair.force;
+  ignition::math::Vector3d torque_tmp = pair.torque;
 
   force += force_tmp;
   torque += torque_tmp;
-
-  ignition::math::Vector3<double> mfs_tmp;
-  GetMFS(p_self, p_other, m_other, mfs_tmp);
-
-  mfs += mfs_tmp;
+  mfs += p_self.Rot().RotateVectorReverse(pair.field);
 
   this->link.first->AddForce(force_tmp);
   this->link.first->AddTorque(torque_tmp);
@@ -272,55 +300,6 @@ void DipoleMagnetPair::PublishData(
 }
 
 
-void DipoleMagnetPair::GetForceTorque(const ignition::math::Pose3d& p_self,
-    const ignition::math::Vector3d& m_self,
-    const ignition::math::Pose3d& p_other,
-    const ignition::math::Vector3d& m_other,
-    ignition::math::Vector3d& force,
-    ignition::math::Vector3d& torque) {
-
-  bool debug = false;
-  ignition::math::Vector3d p = p_self.Pos() - p_other.Pos();
-  ignition::math::Vector3d p_unit = p/p.Length();
-
-  ignition::math::Vector3d m1 = m_other;
-  ignition::math::Vector3d m2 = m_self;
-  if (debug)
-    std::cout << "p: " << p << " m1: " << m1 << " m2: " << m2 << std::endl;
-
-  double K = 3.0*1e-7/pow(p.Length(), 4);
-  force = K * (m2 * (m1.Dot(p_unit)) +  m1 * (m2.Dot(p_unit)) +
-      p_unit*(m1.Dot(m2)) - 5*p_unit*(m1.Dot(p_unit))*(m2.Dot(p_unit)));
-
-  double Ktorque = 1e-7/pow(p.Length(), 3);
-  ignition::math::Vector3d B1 = Ktorque*(3*(m1.Dot(p_unit))*p_unit - m1);
-  torque = m2.Cross(B1);
-  if (debug)
-    std::cout << "B: " << B1 << " K: " << Ktorque << " t: " << torque << std::endl;
-}
-
-void DipoleMagnetPair::GetMFS(const ignition::math::Pose3d& p_self,
-    const ignition::math::Pose3d& p_other,
-    const ignition::math::Vector3d& m_other,
-    ignition::math::Vector3d& mfs) {
-
-  // sensor location
-  ignition::math::Vector3d p = p_self.Pos() - p_other.Pos();
-  ignition::math::Vector3d p_unit = p/p.Length();
-
-  // Get the field at the sensor location
-  double K = 1e-7/pow(p.Length(), 3);
-  ignition::math::Vector3d B = K*(3*(m_other.Dot(p_unit))*p_unit - m_other);
-
-  // Rotate the B vector into the capsule/body frame
-  ignition::math::Vector3d B_body = p_self.Rot().RotateVectorReverse(B);
-
-  // Assign vector
-  mfs[0] = B_body[0];
-  mfs[1] = B_body[1];
-  mfs[2] = B_body[2];
-}
-
 // Register this plugin with the simulator
 GZ_REGISTER_MODEL_PLUGIN(DipoleMagnetPair)
 
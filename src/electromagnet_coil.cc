@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <iostream>
+
+#include "storm_gazebo_ros_magnet/electromagnet_coil.h"
+
+namespace gazebo {
+
+ElectromagnetCoil::ElectromagnetCoil(): ModelPlugin() {
+  this->rosnode = NULL;
+  this->initial_current = 0;
+}
+
+ElectromagnetCoil::~ElectromagnetCoil() {
+  if (this->rosnode) {
+    this->queue.clear();
+    this->queue.disable();
+    this->rosnode->shutdown();
+    this->callback_queue_thread.join();
+    delete this->rosnode;
+  }
+  if (this->coil && this->container) {
+    DipoleMagnetContainer::FieldSourcePtrV& sources = this->container->field_sources;
+    sources.erase(std::remove(sources.begin(), sources.end(),
+          DipoleMagnetContainer::FieldSourcePtr(this->coil)), sources.end());
+  }
+}
+
+void ElectromagnetCoil::Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf) {
+  this->model = _parent;
+  gzdbg << "Loading ElectromagnetCoil plugin" << std::endl;
+
+  this->robot_namespace = "";
+  if (_sdf->HasElement("robotNamespace"))
+    this->robot_namespace = _sdf->GetElement("robotNamespace")->Get<std::string>() + "/";
+
+  if(!_sdf->HasElement("bodyName")) {
+    gzerr << "ElectromagnetCoil plugin missing <bodyName>, cannot proceed" << std::endl;
+    return;
+  }
+  this->link_name = _sdf->GetElement("bodyName")->Get<std::string>();
+
+  this->link = this->model->GetLink(this->link_name);
+  if(!this->link){
+    gzerr << "Error: link named " << this->link_name << " does not exist" << std::endl;
+    return;
+  }
+
+  CoilField::Geometry geometry;
+  if (!_sdf->HasElement("outer_radius") || !_sdf->HasElement("turns")) {
+    gzerr << "ElectromagnetCoil plugin needs <outer_radius> and <turns>, cannot proceed"
+        << std::endl;
+    return;
+  }
+  geometry.outer_radius = _sdf->Get<double>("outer_radius");
+  if (geometry.outer_radius <= 0) {
+    gzerr << "ElectromagnetCoil <outer_radius> must be positive, cannot proceed" << std::endl;
+    return;
+  }
+  geometry.inner_radius = geometry.outer_radius;
+  if (_sdf->HasElement("inner_radius"))
+    geometry.inner_radius = _sdf->Get<double>("inner_radius");
+  if (geometry.inner_radius < 0 || geometry.inner_radius > geometry.outer_radius) {
+    gzerr << "ElectromagnetCoil <inner_radius> must be between 0 and <outer_radius>, "
+        "cannot proceed" << std::endl;
+    return;
+  }
+  if (_sdf->HasElement("length"))
+    geometry.length = _sdf->Get<double>("length");
+  if (geometry.length < 0) {
+    gzerr << "ElectromagnetCoil <length> must not be negative, cannot proceed" << std::endl;
+    return;
+  }
+  geometry.turns = _sdf->Get<double>("turns");
+  if (geometry.turns <= 0) {
+    gzerr << "ElectromagnetCoil <turns> must be positive, cannot proceed" << std::endl;
+    return;
+  }
+  if (_sdf->HasElement("radial_loops"))
+    geometry.radial_loops = std::max(1, _sdf->Get<int>("radial_loops"));
+  if (_sdf->HasElement("axial_loops"))
+    geometry.axial_loops = std::max(1, _sdf->Get<int>("axial_loops"));
+
+  // By default map four coil radii around the coil at 1/16 of its radius
+  double extent = 4*std::max(geometry.outer_radius, 0.5*geometry.length);
+  double map_radius = extent;
+  double map_half_length = extent;
+  double map_resolution = geometry.outer_radius/16;
+  if (_sdf->HasElement("map_radius"))
+    map_radius = _sdf->Get<double>("map_radius");
+  if (_sdf->HasElement("map_half_length"))
+    map_half_length = _sdf->Get<double>("map_half_length");
+  if (_sdf->HasElement("map_resolution"))
+    map_resolution = _sdf->Get<double>("map_resolution");
+  if (map_radius <= 0 || map_half_length <= 0 || map_resolution <= 0) {
+    gzerr << "ElectromagnetCoil <map_radius>, <map_half_length> and <map_resolution> "
+        "must be positive, cannot proceed" << std::endl;
+    return;
+  }
+
+  if (_sdf->HasElement("xyzOffset")){
+    this->offset.Pos() = _sdf->Get<ignition::math::Vector3d>("xyzOffset");
+  }
+
+  if (_sdf->HasElement("rpyOffset")){
+    ignition::math::Vector3d rpy_offset = _sdf->Get<ignition::math::Vector3d>("rpyOffset");
+    this->offset.Rot() = ignition::math::Quaterniond(rpy_offset);
+  }
+
+  common::Timer timer;
+  timer.Start();
+  this->coil = std::make_shared<CoilField>();
+  this->coil->Build(geometry, map_radius, map_half_length, map_resolution);
+  gzmsg << "ElectromagnetCoil field map for " << this->model->GetName()
+      << " computed in " << timer.GetElapsed().Double() << " s" << std::endl;
+
+  if (_sdf->HasElement("current"))
+    this->initial_current = _sdf->Get<double>("current");
+  this->coil->SetCurrent(this->initial_current);
+
+  if (_sdf->HasElement("topicNs")) {
+    this->topic_ns = _sdf->GetElement("topicNs")->Get<std::string>();
+
+    if (!ros::isInitialized())
+    {
+      gzerr << "A ROS node for Gazebo has not been initialized, the coil current "
+        "will not be settable at runtime. Load the Gazebo system plugin "
+        "'libgazebo_ros_api_plugin.so' in the gazebo_ros package." << std::endl;
+    } else {
+      this->rosnode = new ros::NodeHandle(this->robot_namespace);
+      this->rosnode->setCallbackQueue(&this->queue);
+
+      this->current_sub = this->rosnode->subscribe<std_msgs::Float64>(
+          this->topic_ns + "/current", 1,
+          boost::bind(&ElectromagnetCoil::OnCurrent, this, _1));
+
+      // Custom Callback Queue
+      this->callback_queue_thread = boost::thread(
+          boost::bind(&ElectromagnetCoil::QueueThread, this));
+    }
+  }
+
+  // The container moves the coil at the start of every step, before any
+  // magnet is solved. The hook lives in the coil, so it holds what it needs
+  // rather than this plugin.
+  CoilField* coil = this->coil.get();
+  physics::LinkPtr link = this->link;
+  ignition::math::Pose3d offset = this->offset;
+  this->coil->update_pose = [coil, link, offset]() {
+    ignition::math::Pose3d pose = link->WorldPose();
+    pose.Pos() += pose.Rot().RotateVector(offset.Pos());
+    pose.Rot() *= offset.Rot();
+    coil->SetPose(pose);
+  };
+  this->coil->update_pose();
+  this->container = DipoleMagnetContainer::Get(this->model->GetWorld());
+  this->container->field_sources.push_back(this->coil);
+
+  gzmsg << "Loaded Gazebo electromagnet coil plugin on " << this->model->GetName() << std::endl;
+}
+
+void ElectromagnetCoil::Reset() {
+  if (this->coil)
+    this->coil->SetCurrent(this->initial_current);
+  if (this->container)
+    this->container->Reset();
+}
+
+void ElectromagnetCoil::QueueThread() {
+  static const double timeout = 0.01;
+
+  while (this->rosnode->ok())
+  {
+    this->queue.callAvailable(ros::WallDuration(timeout));
+  }
+}
+
+void ElectromagnetCoil::OnCurrent(const std_msgs::Float64::ConstPtr& msg) {
+  this->coil->SetCurrent(msg->data);
+}
+
+// Register this plugin with the simulator
+GZ_REGISTER_MODEL_PLUGIN(ElectromagnetCoil)
+
+}
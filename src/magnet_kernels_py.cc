@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "storm_gazebo_ros_magnet/batch_evaluation.h"
+#include "storm_gazebo_ros_magnet/interaction_kernel.h"
+#include "storm_gazebo_ros_magnet/task_pool.h"
+#include "storm_gazebo_ros_magnet/tiled_all_pairs.h"
+
+namespace py = pybind11;
+
+namespace gazebo {
+
+/// \brief C-contiguous float64 array. Arrays that already have this layout
+/// are used in place, anything else is converted once.
+typedef py::array_t<double, py::array::c_style | py::array::forcecast> Array;
+
+/// \brief Convert an argument and check that it has shape (rows, cols)
+static Array GetArray(const py::object& obj, const char* name, ssize_t cols,
+    ssize_t rows = -1) {
+  Array array = obj.cast<Array>();
+  if (array.ndim() != 2 || array.shape(1) != cols ||
+      (rows >= 0 && array.shape(0) != rows)) {
+    throw std::invalid_argument(std::string(name) + " must have shape (" +
+        (rows >= 0 ? std::to_string(rows) : std::string("n")) + ", " +
+        std::to_string(cols) + ")");
+  }
+  return array;
+}
+
+/// \brief Magnets of the arguments. The arrays are kept alive by the caller.
+static MagnetArrays GetMagnets(const Array& positions, const Array* moments,
+    const Array* orientations) {
+  MagnetArrays magnets;
+  magnets.size = positions.shape(0);
+  magnets.positions = positions.data();
+  magnets.moments = moments ? moments->data() : NULL;
+  magnets.orientations = orientations ? orientations->data() : NULL;
+  return magnets;
+}
+
+/// \brief Serializes the calls that use the pool
+static boost::mutex pool_lock;
+
+/// \brief Pool of the requested size, NULL for a single thread. The pool
+/// is kept for later calls and only replaced when a call asks for a
+/// different size. Called with pool_lock held.
+static TaskPool* GetPool(int threads) {
+  static std::unique_ptr<TaskPool> pool;
+  if (threads <= 0)
+    threads = std::max(1u, boost::thread::hardware_concurrency());
+  if (threads == 1)
+    return NULL;
+  if (!pool || pool->GetThreadCount() != static_cast<size_t>(threads))
+    pool.reset(new TaskPool(threads));
+  return pool.get();
+}
+
+/// \brief Shared implementation of pairs() and targets()
+static py::dict Evaluate(bool pairs,
+    const py::object& p_self, const py::object& m_self,
+    const py::object& p_other, const py::object& m_other,
+    const py::object& q_self, const py::object& q_other,
+    const std::string& model, double parameter,
+    bool force, bool torque, bool field, bool gradient, bool energy, int threads) {
+  Array target_p = GetArray(p_self, "p_self", 3);
+  const ssize_t n = target_p.shape(0);
+  Array source_p = GetArray(p_other, "p_other", 3, pairs ? n : -1);
+  const ssize_t n_sources = source_p.shape(0);
+
+  std::unique_ptr<Array> target_m, target_q, source_m, source_q;
+  if (!m_self.is_none())
+    target_m.reset(new Array(GetArray(m_self, "m_self", 3, n)));
+  if (!q_self.is_none())
+    target_q.reset(new Array(GetArray(q_self, "q_self", 4, n)));
+  source_m.reset(new Array(GetArray(m_other, "m_other", 3, n_sources)));
+  if (!q_other.is_none())
+    source_q.reset(new Array(GetArray(q_other, "q_other", 4, n_sources)));
+  if ((force || torque || energy) && !target_m)
+    throw std::invalid_argument("force, torque and energy need m_self");
+  if (model != "point" && model != "softened" && model != "gilbert")
+    throw std::invalid_argument("model must be point, softened or gilbert");
+  if (model != "point" && parameter <= 0)
+    throw std::invalid_argument(model + " model needs a positive parameter");
+
+  py::dict result;
+  InteractionArrays out;
+  if (force) {
+    Array a({n, static_cast<ssize_t>(3)});
+    out.force = a.mutable_data();
+    result["force"] = a;
+  }
+  if (torque) {
+    Array a({n, static_cast<ssize_t>(3)});
+    out.torque = a.mutable_data();
+    result["torque"] = a;
+  }
+  if (field) {
+    Array a({n, static_cast<ssize_t>(3)});
+    out.field = a.mutable_data();
+    result["field"] = a;
+  }
+  if (gradient) {
+    Array a({n, static_cast<ssize_t>(3), static_cast<ssize_t>(3)});
+    out.gradient = a.mutable_data();
+    result["gradient"] = a;
+  }
+  if (energy) {
+    Array a(n);
+    out.energy = a.mutable_data();
+    result["energy"] = a;
+  }
+
+  MagnetArrays targets = GetMagnets(target_p, target_m.get(), target_q.get());
+  MagnetArrays sources = GetMagnets(source_p, source_m.get(), source_q.get());
+
+  {
+    // Python objects are not touched while the GIL is released
+    py::gil_scoped_release release;
+    boost::mutex::scoped_lock lock(pool_lock);
+    BatchEvaluator batch(GetPool(threads));
+    if (model == "point") {
+      if (pairs)
+        batch.Pairs(PointDipoleModel(), targets, sources, out);
+      else
+        batch.Targets(PointDipoleModel(), targets, sources, out);
+    } else if (model == "softened") {
+      if (pairs)
+        batch.Pairs(SoftenedDipoleModel(parameter), targets, sources, out);
+      else
+        batch.Targets(SoftenedDipoleModel(parameter), targets, sources, out);
+    } else {
+      if (pairs)
+        batch.Pairs(GilbertModel(parameter), targets, sources, out);
+      else
+        batch.Targets(GilbertModel(parameter), targets, sources, out);
+    }
+  }
+  return result;
+}
+
+static py::dict Pairs(const py::object& p_self, const py::object& m_self,
+    const py::object& p_other, const py::object& m_other,
+    const py::object& q_self, const py::object& q_other,
+    const std::string& model, double parameter,
+    bool force, bool torque, bool field, bool gradient, bool energy, int threads) {
+  return Evaluate(true, p_self, m_self, p_other, m_other, q_self, q_other,
+      model, parameter, force, torque, field, gradient, energy, threads);
+}
+
+static py::dict Targets(const py::object& p_self, const py::object& m_self,
+    const py::object& p_other, const py::object& m_other,
+    const py::object& q_self, const py::object& q_other,
+    const std::string& model, double parameter,
+    bool force, bool torque, bool field, bool gradient, bool energy, int threads) {
+  return Evaluate(false, p_self, m_self, p_other, m_other, q_self, q_other,
+      model, parameter, force, torque, field, gradient, energy, threads);
+}
+
+static py::dict AllPairs(const py::object& positions, const py::object& moments,
+    const py::object& ids, const py::object& orientations, int tile_size, int threads) {
+  Array p = GetArray(positions, "positions", 3);
+  const ssize_t n = p.shape(0);
+  Array m = GetArray(moments, "moments", 3, n);
+  std::unique_ptr<Array> q;
+  if (!orientations.is_none())
+    q.reset(new Array(GetArray(orientations, "orientations", 4, n)));
+  py::array_t<std::int64_t, py::array::c_style | py::array::forcecast> id;
+  if (!ids.is_none()) {
+    id = ids.cast<py::array_t<std::int64_t, py::array::c_style | py::array::forcecast> >();
+    if (id.ndim() != 1 || id.shape(0) != n)
+      throw std::invalid_argument("ids must have shape (n,)");
+  }
+  if (tile_size <= 0)
+    throw std::invalid_argument("tile_size must be positive");
+
+  Array force({n, static_cast<ssize_t>(3)});
+  Array torque({n, static_cast<ssize_t>(3)});
+  Array field({n, static_cast<ssize_t>(3)});
+  MagnetArrays magnets = GetMagnets(p, &m, q.get());
+  const std::int64_t* id_data = ids.is_none() ? NULL : id.data();
+  double* f = force.mutable_data();
+  double* t = torque.mutable_data();
+  double* b = field.mutable_data();
+
+  {
+    // The tiled kernel works on its own structure of arrays, one copy per
+    // thread, each summing the rows of tiles it solved
+    py::gil_scoped_release release;
+    boost::mutex::scoped_lock lock(pool_lock);
+    TaskPool* pool = GetPool(threads);
+    const size_t parts = pool ? pool->GetThreadCount() : 1;
+    std::vector<TiledAllPairs> kernels(parts, TiledAllPairs(tile_size));
+    for (size_t k = 0; k < parts; ++k) {
+      TiledAllPairs& kernel = kernels[k];
+      kernel.Resize(n);
+      for (ssize_t i = 0; i < n; ++i) {
+        ignition::math::Vector3d pos = magnets.Position(i);
+        ignition::math::Vector3d moment = magnets.Moment(i);
+        kernel.x[i] = pos.X();
+        kernel.y[i] = pos.Y();
+        kernel.z[i] = pos.Z();
+        kernel.mx[i] = moment.X();
+        kernel.my[i] = moment.Y();
+        kernel.mz[i] = moment.Z();
+        kernel.id[i] = id_data ? static_cast<std::uint32_t>(id_data[i]) : static_cast<std::uint32_t>(i);
+      }
+    }
+
+    if (pool) {
+      std::vector<TaskPool::Task> tasks;
+      for (size_t k = 0; k < parts; ++k) {
+        TiledAllPairs* kernel = &kernels[k];
+        tasks.push_back([kernel, k, parts]() { kernel->SolveRows(k, parts); });
+      }
+      pool->Run(tasks);
+    } else {
+      kernels[0].SolveRows(0, 1);
+    }
+
+    TiledAllPairs& kernel = kernels[0];
+    for (size_t k = 1; k < parts; ++k) {
+      const TiledAllPairs& part = kernels[k];
+      for (ssize_t i = 0; i < n; ++i) {
+        kernel.fx[i] += part.fx[i];
+        kernel.fy[i] += part.fy[i];
+        kernel.fz[i] += part.fz[i];
+        kernel.bx[i] += part.bx[i];
+        kernel.by[i] += part.by[i];
+        kernel.bz[i] += part.bz[i];
+      }
+    }
+    kernel.SolveTorques();
+    for (ssize_t i = 0; i < n; ++i) {
+      f[3*i] = kernel.fx[i];
+      f[3*i + 1] = kernel.fy[i];
+      f[3*i + 2] = kernel.fz[i];
+      t[3*i] = kernel.tx[i];
+      t[3*i + 1] = kernel.ty[i];
+      t[3*i + 2] = kernel.tz[i];
+      b[3*i] = kernel.bx[i];
+      b[3*i + 1] = kernel.by[i];
+      b[3*i + 2] = kernel.bz[i];
+    }
+  }
+
+  py::dict result;
+  result["force"] = force;
+  result["torque"] = torque;
+  result["field"] = field;
+  return result;
+}
+
+}  // namespace gazebo
+
+PYBIND11_MODULE(storm_magnet_kernels, m) {
+  m.doc() = "Batch evaluation of the magnet interaction kernels of the "
+      "storm_gazebo_ros_magnet plugins";
+
+  const char* pairs_doc =
+      "Interaction of source i on target i for every row i.\n\n"
+      "Positions and moments are (n, 3) arrays, orientations (n, 4) unit\n"
+      "quaternions w, x, y, z that rotate body frame moments into the world.\n"
+      "model is point, softened or gilbert, with parameter the softening\n"
+      "length or pole separation. Returns a dict of the requested outputs.";
+  const char* targets_doc =
+      "Sum of the interactions of all sources on each target. Sources at the\n"
+      "position of a target are skipped. m_self may be None for field probes.\n"
+      "Arguments as for pairs().";
+
+  m.def("pairs", &gazebo::Pairs, pairs_doc,
+      py::arg("p_self"), py::arg("m_self"), py::arg("p_other"), py::arg("m_other"),
+      py::arg("q_self") = py::none(), py::arg("q_other") = py::none(),
+      py::arg("model") = "point", py::arg("parameter") = 0.0,
+      py::arg("force") = true, py::arg("torque") = true,
+      py::arg("field") = false, py::arg("gradient") = false,
+      py::arg("energy") = false, py::arg("threads") = 0);
+  m.def("targets", &gazebo::Targets, targets_doc,
+      py::arg("p_self"), py::arg("m_self"), py::arg("p_other"), py::arg("m_other"),
+      py::arg("q_self") = py::none(), py::arg("q_other") = py::none(),
+      py::arg("model") = "point", py::arg("parameter") = 0.0,
+      py::arg("force") = true, py::arg("torque") = true,
+      py::arg("field") = false, py::arg("gradient") = false,
+      py::arg("energy") = false, py::arg("threads") = 0);
+  m.def("all_pairs", &gazebo::AllPairs,
+      "Exact point dipole interactions of all pairs of magnets, with the\n"
+      "tiled kernel of the <all_pairs> environment option. Magnets with equal\n"
+      "ids do not interact; by default every magnet has its own id.",
+      py::arg("positions"), py::arg("moments"), py::arg("ids") = py::none(),
+      py::arg("orientations") = py::none(), py::arg("tile_size") = 64,
+      py::arg("threads") = 0);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+/// \brief ROS node that reports the latency of the mfs samples of dipole
+/// magnets with <latencyProbe> enabled, from the physics step that produced
+/// them to their receipt here. Must run on the same host as Gazebo.
+///
+/// Usage: magnet_latency_probe [--period s] [--timeout s] topic_ns...
+
+#include <ros/ros.h>
+#include <sensor_msgs/MagneticField.h>
+#include <std_msgs/Float64MultiArray.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "storm_gazebo_ros_magnet/latency_probe.h"
+
+namespace gazebo {
+
+/// \brief Subscriptions and statistics of one magnet's topics
+class ProbedTopic {
+ public:
+  ProbedTopic(ros::NodeHandle& node, const std::string& _topic_ns, double timeout)
+      : topic_ns(_topic_ns), probe(timeout) {
+    // Nagle's algorithm would add its own delay to small messages
+    ros::TransportHints hints = ros::TransportHints().tcpNoDelay();
+    this->mfs_sub = node.subscribe(this->topic_ns + "/mfs", 100,
+        &ProbedTopic::OnSample, this, hints);
+    this->stamp_sub = node.subscribe(this->topic_ns + "/mfs_stamp", 1000,
+        &ProbedTopic::OnStamp, this, hints);
+  }
+
+  void OnSample(const sensor_msgs::MagneticField::ConstPtr& msg) {
+    double receipt = MonotonicSeconds();
+    this->probe.AddSample(msg->header.stamp.toNSec(), receipt);
+  }
+
+  void OnStamp(const std_msgs::Float64MultiArray::ConstPtr& msg) {
+    if (msg->data.size() < LatencyProbe::STAMP_FIELD_COUNT)
+      return;
+    const std::vector<double>& d = msg->data;
+    this->probe.AddStamp(std::llround(d[LatencyProbe::STAMP_SEQ]),
+        std::llround(d[LatencyProbe::STAMP_SIM_TIME]), d[LatencyProbe::STAMP_STEP_TIME],
+        d[LatencyProbe::STAMP_SEND_TIME], MonotonicSeconds());
+  }
+
+  /// \brief Print one line of statistics in milliseconds
+  void Print(double now) {
+    LatencyProbe::Report r = this->probe.GetReport(now);
+    std::printf("%-24s %6ld %6ld %6ld %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n",
+        this->topic_ns.c_str(), r.received, r.dropped, r.missing,
+        1e3*r.step_p50, 1e3*r.step_p90, 1e3*r.step_p99, 1e3*r.step_max,
+        1e3*r.send_p50, 1e3*r.send_p99, 1e3*r.jitter, 1e3*r.interarrival_stddev);
+  }
+
+ private:
+  std::string topic_ns;
+  LatencyProbe probe;
+  ros::Subscriber mfs_sub;
+  ros::Subscriber stamp_sub;
+};
+
+}  // namespace gazebo
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "magnet_latency_probe");
+
+  double period = 5.0;
+  double timeout = 1.0;
+  std::vector<std::string> topics;
+  bool usage = false;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--period") && i + 1 < argc) {
+      period = std::atof(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--timeout") && i + 1 < argc) {
+      timeout = std::atof(argv[++i]);
+    } else if (argv[i][0] != '-') {
+      topics.push_back(argv[i]);
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || topics.empty() || period <= 0 || timeout <= 0) {
+    std::cerr << "usage: " << argv[0] << " [--period s] [--timeout s] topic_ns..." << std::endl;
+    return 2;
+  }
+
+  ros::NodeHandle node;
+  std::vector<std::unique_ptr<gazebo::ProbedTopic> > probed;
+  for (size_t i = 0; i < topics.size(); ++i)
+    probed.emplace_back(new gazebo::ProbedTopic(node, topics[i], timeout));
+
+  // Callbacks and reports run on this thread only
+  ros::WallTimer timer = node.createWallTimer(ros::WallDuration(period),
+      [&probed](const ros::WallTimerEvent&) {
+        std::printf("%-24s %6s %6s %6s %8s %8s %8s %8s %8s %8s %8s %8s\n", "topic (ms)",
+            "recv", "drop", "miss", "step50", "step90", "step99", "stepmax",
+            "send50", "send99", "jitter", "iat_sd");
+        double now = gazebo::MonotonicSeconds();
+        for (size_t i = 0; i < probed.size(); ++i)
+          probed[i]->Print(now);
+        std::fflush(stdout);
+      });
+
+  ros::spin();
+  return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+/// \brief Offline tool that places magnets to maximize field, gradient or
+/// force components at target points and writes them as a world snippet.
+///
+/// Usage: magnet_layout_optimizer [--threads n] [-o snippet.world] spec.txt
+
+#include <boost/thread.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "storm_gazebo_ros_magnet/layout_optimizer.h"
+#include "storm_gazebo_ros_magnet/task_pool.h"
+
+namespace gazebo {
+
+/// \brief Read three numbers into a vector
+static bool ReadVector(std::istream& in, ignition::math::Vector3d& v) {
+  double x, y, z;
+  if (!(in >> x >> y >> z))
+    return false;
+  v.Set(x, y, z);
+  return true;
+}
+
+/// \brief Options of the spec that are not part of the layout
+struct LayoutOptions {
+  LayoutOptions() : radius(0.005), length(0.01), threads(0) {
+  }
+
+  double radius;
+  double length;
+  int threads;
+};
+
+/// \brief Parse a spec file. Each line is a keyword and its values, '#'
+/// starts a comment.
+static bool ParseSpec(std::istream& in, MagnetLayout& layout, LayoutOptions& options) {
+  std::string line;
+  int line_number = 0;
+  while (std::getline(in, line)) {
+    ++line_number;
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string keyword;
+    if (!(fields >> keyword))
+      continue;
+
+    bool ok = true;
+    if (keyword == "magnet") {
+      MagnetLayout::Magnet mag;
+      ok = (fields >> mag.name) && ReadVector(fields, mag.position) &&
+          ReadVector(fields, mag.moment) && mag.moment.Length() > 0;
+      std::string flag;
+      while (ok && fields >> flag) {
+        if (flag == "fixed_position")
+          mag.fix_position = true;
+        else if (flag == "fixed_direction")
+          mag.fix_direction = true;
+        else
+          ok = false;
+      }
+      layout.magnets.push_back(mag);
+    } else if (keyword == "field" || keyword == "gradient" || keyword == "force") {
+      MagnetLayout::Term term;
+      ok = ReadVector(fields, term.point);
+      if (keyword == "field") {
+        term.type = MagnetLayout::FIELD;
+        term.second.Set(0, 0, 0);
+        ok = ok && ReadVector(fields, term.direction);
+      } else if (keyword == "gradient") {
+        term.type = MagnetLayout::GRADIENT;
+        ok = ok && ReadVector(fields, term.direction) && ReadVector(fields, term.second);
+      } else {
+        // The probe moment comes first, then the force direction
+        term.type = MagnetLayout::FORCE;
+        ok = ok && ReadVector(fields, term.second) && ReadVector(fields, term.direction);
+      }
+      ok = ok && (fields >> term.weight);
+      layout.terms.push_back(term);
+    } else if (keyword == "bounds") {
+      layout.has_bounds = true;
+      ok = ReadVector(fields, layout.lower) && ReadVector(fields, layout.upper);
+    } else if (keyword == "min_distance") {
+      ok = static_cast<bool>(fields >> layout.min_distance);
+    } else if (keyword == "clearance") {
+      ok = static_cast<bool>(fields >> layout.clearance);
+    } else if (keyword == "penalty") {
+      ok = static_cast<bool>(fields >> layout.penalty);
+    } else if (keyword == "max_iterations") {
+      ok = static_cast<bool>(fields >> layout.minimizer.max_iterations);
+    } else if (keyword == "tolerance") {
+      ok = static_cast<bool>(fields >> layout.minimizer.gradient_tolerance);
+    } else if (keyword == "max_step") {
+      ok = static_cast<bool>(fields >> layout.minimizer.max_step);
+    } else if (keyword == "geometry") {
+      ok = static_cast<bool>(fields >> options.radius >> options.length);
+    } else if (keyword == "threads") {
+      ok = static_cast<bool>(fields >> options.threads);
+    } else {
+      std::cerr << "line " << line_number << ": unknown keyword " << keyword << std::endl;
+      return false;
+    }
+
+    std::string rest;
+    if (!ok || fields >> rest) {
+      std::cerr << "line " << line_number << ": malformed " << keyword << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace gazebo
+
+int main(int argc, char** argv) {
+  std::string spec_path;
+  std::string output_path;
+  int threads = -1;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-o") && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && spec_path.empty()) {
+      spec_path = argv[i];
+    } else {
+      spec_path.clear();
+      break;
+    }
+  }
+  if (spec_path.empty()) {
+    std::cerr << "usage: " << argv[0] << " [--threads n] [-o snippet.world] spec.txt" << std::endl;
+    return 2;
+  }
+
+  std::ifstream spec(spec_path.c_str());
+  if (!spec) {
+    std::cerr << "cannot open " << spec_path << std::endl;
+    return 1;
+  }
+  gazebo::MagnetLayout layout;
+  gazebo::LayoutOptions options;
+  if (!gazebo::ParseSpec(spec, layout, options))
+    return 1;
+  if (layout.magnets.empty() || layout.terms.empty()) {
+    std::cerr << "the spec needs at least one magnet and one objective term" << std::endl;
+    return 1;
+  }
+  if (layout.clearance <= 0) {
+    std::cerr << "clearance must be positive, the field is unbounded at the target points" << std::endl;
+    return 1;
+  }
+
+  // The command line overrides the spec, 0 is one thread per core
+  if (threads >= 0)
+    options.threads = threads;
+  if (options.threads <= 0)
+    options.threads = std::max(1u, boost::thread::hardware_concurrency());
+  std::unique_ptr<gazebo::TaskPool> pool;
+  if (options.threads > 1) {
+    pool.reset(new gazebo::TaskPool(options.threads));
+    layout.pool = pool.get();
+  }
+
+  double initial = layout.Objective();
+  double objective = layout.Optimize();
+  std::cerr << "objective " << initial << " -> " << objective
+            << " after " << layout.minimizer.iterations << " iterations"
+            << (layout.minimizer.converged ? "" : " (not converged)")
+            << ", constraint penalty " << layout.Violation() << std::endl;
+
+  if (output_path.empty()) {
+    layout.WriteWorldSnippet(std::cout, options.radius, options.length);
+  } else {
+    std::ofstream out(output_path.c_str());
+    if (!out) {
+      std::cerr << "cannot write " << output_path << std::endl;
+      return 1;
+    }
+    layout.WriteWorldSnippet(out, options.radius, options.length);
+  }
+  return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+/// \brief Solver process for a magnetic environment with <solver_process>.
+/// Attaches to the shared memory exchange of the world and computes the
+/// interactions between all magnets every step, on its own threads and
+/// optionally its own cores. With several workers configured, one process
+/// is started per rank and each solves the magnets of its own domain. Must
+/// run on the same host as Gazebo.
+///
+/// Usage: magnet_solver [--rank k] [--threads n] [--cpus 2,3,...] [--tile n]
+///     [--spin n] [--period s] name
+
+#include <sched.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "storm_gazebo_ros_magnet/domain_decomposition.h"
+#include "storm_gazebo_ros_magnet/latency_probe.h"
+#include "storm_gazebo_ros_magnet/shared_exchange.h"
+#include "storm_gazebo_ros_magnet/task_pool.h"
+#include "storm_gazebo_ros_magnet/tiled_all_pairs.h"
+
+namespace gazebo {
+
+static std::atomic<bool> stop_requested(false);
+
+static void OnSignal(int) {
+  stop_requested = true;
+}
+
+/// \brief Restrict the process to a comma separated list of cpus
+static bool PinToCpus(const std::string& list) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  std::istringstream in(list);
+  std::string cpu;
+  while (std::getline(in, cpu, ',')) {
+    char* end = NULL;
+    long index = std::strtol(cpu.c_str(), &end, 10);
+    if (cpu.empty() || *end != '\0' || index < 0 || index >= CPU_SETSIZE)
+      return false;
+    CPU_SET(index, &set);
+  }
+  return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+/// \brief All-pairs solve of the magnets in the exchange by a single
+/// worker, with the tile rows split between the threads of a pool
+class ExchangeSolver {
+ public:
+  ExchangeSolver(TaskPool& _pool, size_t tile_size) : pool(_pool) {
+    for (size_t k = 0; k < this->pool.GetThreadCount(); ++k)
+      this->parts.emplace_back(tile_size);
+  }
+
+  void Solve(SharedExchange::Slot* slots, size_t count) {
+    const size_t parts = this->parts.size();
+    for (size_t k = 0; k < parts; ++k) {
+      TiledAllPairs& part = this->parts[k];
+      part.Resize(count);
+      for (size_t i = 0; i < count; ++i) {
+        const SharedExchange::Slot& slot = slots[i];
+        part.x[i] = slot.position[0];
+        part.y[i] = slot.position[1];
+        part.z[i] = slot.position[2];
+        part.mx[i] = slot.moment[0];
+        part.my[i] = slot.moment[1];
+        part.mz[i] = slot.moment[2];
+        part.id[i] = slot.id;
+      }
+    }
+
+    std::vector<TaskPool::Task> tasks;
+    for (size_t k = 0; k < parts; ++k) {
+      TiledAllPairs* part = &this->parts[k];
+      tasks.push_back([part, k, parts]() { part->SolveRows(k, parts); });
+    }
+    this->pool.Run(tasks);
+
+    TiledAllPairs& total = this->parts[0];
+    for (size_t k = 1; k < parts; ++k) {
+      const TiledAllPairs& part = this->parts[k];
+      for (size_t i = 0; i < count; ++i) {
+        total.fx[i] += part.fx[i];
+        total.fy[i] += part.fy[i];
+        total.fz[i] += part.fz[i];
+        total.bx[i] += part.bx[i];
+        total.by[i] += part.by[i];
+        total.bz[i] += part.bz[i];
+      }
+    }
+    total.SolveTorques();
+
+    for (size_t i = 0; i < count; ++i) {
+      SharedExchange::Slot& slot = slots[i];
+      slot.force[0] = total.fx[i];
+      slot.force[1] = total.fy[i];
+      slot.force[2] = total.fz[i];
+      slot.torque[0] = total.tx[i];
+      slot.torque[1] = total.ty[i];
+      slot.torque[2] = total.tz[i];
+      slot.field[0] = total.bx[i];
+      slot.field[1] = total.by[i];
+      slot.field[2] = total.bz[i];
+    }
+  }
+
+ private:
+  TaskPool& pool;
+  /// \brief One copy of the magnets per thread, each summing the rows of
+  /// tiles it solved
+  std::vector<TiledAllPairs> parts;
+};
+
+}  // namespace gazebo
+
+int main(int argc, char** argv) {
+  size_t rank = 0;
+  size_t threads = 1;
+  size_t tile = 64;
+  int spin = 0;
+  double period = 0;
+  std::string cpus;
+  std::string name;
+  bool usage = false;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--rank") && i + 1 < argc) {
+      rank = std::max(0, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::max(1, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--cpus") && i + 1 < argc) {
+      cpus = argv[++i];
+    } else if (!std::strcmp(argv[i], "--tile") && i + 1 < argc) {
+      tile = std::max(1, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--spin") && i + 1 < argc) {
+      spin = std::max(0, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--period") && i + 1 < argc) {
+      period = std::atof(argv[++i]);
+    } else if (argv[i][0] != '-' && name.empty()) {
+      name = argv[i];
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || name.empty()) {
+    std::cerr << "usage: " << argv[0] << " [--rank k] [--threads n] [--cpus 2,3,...] "
+        "[--tile n] [--spin n] [--period s] name" << std::endl;
+    return 2;
+  }
+
+  // Before the pool starts, so its threads inherit the affinity
+  if (!cpus.empty() && !gazebo::PinToCpus(cpus)) {
+    std::cerr << "Cannot pin to cpus " << cpus << ": " << std::strerror(errno) << std::endl;
+    return 1;
+  }
+
+  std::unique_ptr<gazebo::SharedExchange> exchange = gazebo::SharedExchange::Open(name);
+  if (!exchange) {
+    std::cerr << "Cannot open the exchange " << name << ": " << std::strerror(errno)
+        << std::endl;
+    return 1;
+  }
+  exchange->spin = spin;
+  // Wake up regularly to notice signals
+  exchange->timeout = 0.1;
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = gazebo::OnSignal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  gazebo::TaskPool pool(threads);
+  gazebo::SharedExchange* ex = exchange.get();
+  std::function<bool(size_t)> solve;
+  std::unique_ptr<gazebo::ExchangeSolver> all_pairs;
+  std::unique_ptr<gazebo::DomainSolver> domain;
+  // A single worker solving all pairs exactly uses the symmetric kernel
+  if (ex->header->workers == 1 && ex->header->far_field_ratio == 0) {
+    all_pairs.reset(new gazebo::ExchangeSolver(pool, tile));
+    solve = [ex, &all_pairs](size_t count) {
+      all_pairs->Solve(ex->slots, count);
+      return true;
+    };
+  } else {
+    domain.reset(new gazebo::DomainSolver(rank, &pool));
+    solve = [ex, &domain](size_t count) { return domain->Solve(*ex, count); };
+  }
+
+  if (!exchange->Attach(rank, true)) {
+    std::cerr << "Rank " << rank << " of " << name << " is taken or not below "
+        << ex->header->workers << std::endl;
+    return 1;
+  }
+  std::cerr << "Solving " << name << " as rank " << rank << " of " << ex->header->workers
+      << " with " << threads << " threads" << std::endl;
+
+  long steps = 0;
+  double solve_sum = 0;
+  double solve_max = 0;
+  double last_report = gazebo::MonotonicSeconds();
+  while (!gazebo::stop_requested) {
+    if (ex->Serve(rank, solve)) {
+      ++steps;
+      solve_sum += ex->header->solve_time[rank];
+      solve_max = std::max(solve_max, ex->header->solve_time[rank]);
+    }
+
+    double now = gazebo::MonotonicSeconds();
+    if (period > 0 && now - last_report >= period) {
+      if (steps > 0) {
+        std::fprintf(stderr, "%ld steps of %u magnets, solve mean %.3f ms, max %.3f ms\n",
+            steps, ex->header->count, 1e3*solve_sum/steps, 1e3*solve_max);
+      }
+      steps = 0;
+      solve_sum = 0;
+      solve_max = 0;
+      last_report = now;
+    }
+  }
+
+  exchange->Attach(rank, false);
+  return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+/// \brief Measures how the step time of magnet_solver scales with the
+/// number of worker processes. Creates an exchange holding a random swarm,
+/// starts the workers, times a number of steps and compares a sample of
+/// the forces with an exact sum. Runs without Gazebo.
+///
+/// Usage: magnet_solver_benchmark [--magnets n] [--steps n] [--workers 1,2,4]
+///     [--threads n] [--far-field-ratio r] [--leaf n] [--per-model n]
+///     [--samples n] [--solver path]
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "storm_gazebo_ros_magnet/latency_probe.h"
+#include "storm_gazebo_ros_magnet/shared_exchange.h"
+
+namespace gazebo {
+
+/// \brief Fill the slots with magnets jittered around a cubic lattice of
+/// 1 cm spacing, with random directions. Runs of per_model neighbouring
+/// magnets share an id, and the ids are shuffled, as those of models
+/// spawned in any order would be.
+static void FillSwarm(SharedExchange& exchange, size_t n, size_t per_model) {
+  std::mt19937 rng(1);
+  std::vector<std::uint32_t> ids((n + per_model - 1)/per_model);
+  for (size_t k = 0; k < ids.size(); ++k)
+    ids[k] = k;
+  std::shuffle(ids.begin(), ids.end(), rng);
+  std::uniform_real_distribution<double> jitter(-0.002, 0.002);
+  std::normal_distribution<double> direction(0, 1);
+  size_t side = std::ceil(std::cbrt(static_cast<double>(n)));
+  for (size_t i = 0; i < n; ++i) {
+    SharedExchange::Slot& slot = exchange.slots[i];
+    slot.position[0] = 0.01*(i % side) + jitter(rng);
+    slot.position[1] = 0.01*(i/side % side) + jitter(rng);
+    slot.position[2] = 0.01*(i/(side*side)) + jitter(rng);
+    double m[3] = {direction(rng), direction(rng), direction(rng)};
+    double norm = std::sqrt(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+    for (int a = 0; a < 3; ++a)
+      slot.moment[a] = 0.1*m[a]/norm;
+    slot.id = ids[i/per_model];
+  }
+  exchange.header->count = n;
+}
+
+/// \brief Largest error of the force and field of the sampled magnets,
+/// relative to the RMS of their exact values
+static void GetError(const SharedExchange& exchange, size_t n, size_t samples,
+    double& force_error, double& field_error) {
+  const SharedExchange::Slot* slots = exchange.slots;
+  std::vector<double> force_diff, field_diff;
+  double force_sq = 0, field_sq = 0;
+  samples = std::min(samples, n);
+  for (size_t s = 0; s < samples; ++s) {
+    const SharedExchange::Slot& si = slots[s*n/samples];
+    double f[3] = {0, 0, 0};
+    double b[3] = {0, 0, 0};
+    for (size_t j = 0; j < n; ++j) {
+      const SharedExchange::Slot& sj = slots[j];
+      if (sj.id == si.id)
+        continue;
+      double r[3], mir = 0, mjr = 0, mimj = 0, r2 = 0;
+      for (int a = 0; a < 3; ++a) {
+        r[a] = si.position[a] - sj.position[a];
+        r2 += r[a]*r[a];
+      }
+      for (int a = 0; a < 3; ++a) {
+        mir += si.moment[a]*r[a];
+        mjr += sj.moment[a]*r[a];
+        mimj += si.moment[a]*sj.moment[a];
+      }
+      double ir2 = 1/r2;
+      double scale = 1e-7*ir2*std::sqrt(ir2);
+      for (int a = 0; a < 3; ++a) {
+        b[a] += (3*r[a]*mjr*ir2 - sj.moment[a])*scale;
+        f[a] += (si.moment[a]*mjr + sj.moment[a]*mir + r[a]*(mimj - 5*mir*mjr*ir2))*
+            3*scale*ir2;
+      }
+    }
+    double df = 0, db = 0;
+    for (int a = 0; a < 3; ++a) {
+      df += (si.force[a] - f[a])*(si.force[a] - f[a]);
+      db += (si.field[a] - b[a])*(si.field[a] - b[a]);
+      force_sq += f[a]*f[a];
+      field_sq += b[a]*b[a];
+    }
+    force_diff.push_back(std::sqrt(df));
+    field_diff.push_back(std::sqrt(db));
+  }
+  force_error = field_error = 0;
+  if (samples == 0)
+    return;
+  force_error = *std::max_element(force_diff.begin(), force_diff.end())/
+      std::sqrt(force_sq/samples);
+  field_error = *std::max_element(field_diff.begin(), field_diff.end())/
+      std::sqrt(field_sq/samples);
+}
+
+/// \brief Start one magnet_solver per rank
+static std::vector<pid_t> StartWorkers(const std::string& solver, const std::string& name,
+    size_t workers, size_t threads) {
+  std::vector<pid_t> pids;
+  for (size_t k = 0; k < workers; ++k) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      std::string rank = std::to_string(k);
+      std::string thread_count = std::to_string(threads);
+      execlp(solver.c_str(), solver.c_str(), "--rank", rank.c_str(), "--threads",
+          thread_count.c_str(), name.c_str(), static_cast<char*>(NULL));
+      std::cerr << "Cannot run " << solver << ": " << std::strerror(errno) << std::endl;
+      _exit(127);
+    }
+    if (pid > 0)
+      pids.push_back(pid);
+  }
+  return pids;
+}
+
+static void StopWorkers(const std::vector<pid_t>& pids) {
+  for (size_t k = 0; k < pids.size(); ++k)
+    kill(pids[k], SIGTERM);
+  for (size_t k = 0; k < pids.size(); ++k)
+    waitpid(pids[k], NULL, 0);
+}
+
+/// \brief Parse a comma separated list of positive counts
+static bool ParseCounts(const std::string& list, std::vector<size_t>& counts) {
+  std::istringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    int count = std::atoi(item.c_str());
+    if (count < 1 || count > static_cast<int>(SharedExchange::kMaxWorkers))
+      return false;
+    counts.push_back(count);
+  }
+  return !counts.empty();
+}
+
+}  // namespace gazebo
+
+int main(int argc, char** argv) {
+  size_t magnets = 20000;
+  size_t steps = 10;
+  size_t threads = 1;
+  size_t leaf = 64;
+  size_t samples = 200;
+  size_t per_model = 1;
+  double far_field_ratio = 2;
+  std::string worker_list = "1,2,4";
+  // Next to this tool by default, where the build puts both
+  std::string solver = "magnet_solver";
+  std::string self = argv[0];
+  if (self.find('/') != std::string::npos)
+    solver = self.substr(0, self.rfind('/') + 1) + solver;
+
+  bool usage = false;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--magnets") && i + 1 < argc) {
+      magnets = std::max(1, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--steps") && i + 1 < argc) {
+      steps = std::max(1, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--workers") && i + 1 < argc) {
+      worker_list = argv[++i];
+    } else if (!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::max(1, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--far-field-ratio") && i + 1 < argc) {
+      far_field_ratio = std::max(0.0, std::atof(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--leaf") && i + 1 < argc) {
+      leaf = std::max(1, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--per-model") && i + 1 < argc) {
+      per_model = std::max(1, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--samples") && i + 1 < argc) {
+      samples = std::max(0, std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--solver") && i + 1 < argc) {
+      solver = argv[++i];
+    } else {
+      usage = true;
+    }
+  }
+  std::vector<size_t> worker_counts;
+  if (usage || !gazebo::ParseCounts(worker_list, worker_counts)) {
+    std::cerr << "usage: " << argv[0] << " [--magnets n] [--steps n] [--workers 1,2,4] "
+        "[--threads n] [--far-field-ratio r] [--leaf n] [--per-model n] [--samples n] "
+        "[--solver path]"
+        << std::endl;
+    return 2;
+  }
+
+  std::printf("%zu magnets, %zu per model, far field ratio %g, leaf size %zu, "
+      "%zu threads per worker\n", magnets, per_model, far_field_ratio, leaf, threads);
+  std::printf("%8s %10s %10s %8s %10s %12s %12s\n", "workers", "mean_ms", "min_ms",
+      "speedup", "efficiency", "force_err", "field_err");
+  std::string name = "/storm_magnet_benchmark_" + std::to_string(getpid());
+  // Speedups are relative to the first worker count
+  double base_time = 0;
+  size_t base_workers = 0;
+  for (size_t c = 0; c < worker_counts.size(); ++c) {
+    const size_t workers = worker_counts[c];
+    std::unique_ptr<gazebo::SharedExchange> exchange = gazebo::SharedExchange::Create(
+        name, magnets, workers, leaf, far_field_ratio);
+    if (!exchange) {
+      std::cerr << "Cannot create the exchange " << name << ": " << std::strerror(errno)
+          << std::endl;
+      return 1;
+    }
+    exchange->timeout = 600;
+    gazebo::FillSwarm(*exchange, magnets, per_model);
+
+    std::vector<pid_t> pids = gazebo::StartWorkers(solver, name, workers, threads);
+    double deadline = gazebo::MonotonicSeconds() + 10;
+    while (!exchange->IsAttached() && gazebo::MonotonicSeconds() < deadline)
+      usleep(1000);
+    if (!exchange->IsAttached()) {
+      std::cerr << "The workers did not attach" << std::endl;
+      gazebo::StopWorkers(pids);
+      return 1;
+    }
+
+    // The first step also pages in the segment and the workers' buffers
+    bool ok = exchange->Call();
+    double sum = 0;
+    double min = 0;
+    for (size_t s = 0; ok && s < steps; ++s) {
+      double start = gazebo::MonotonicSeconds();
+      ok = exchange->Call();
+      double time = gazebo::MonotonicSeconds() - start;
+      sum += time;
+      min = s == 0 ? time : std::min(min, time);
+    }
+    if (!ok) {
+      std::cerr << "The workers did not reply" << std::endl;
+      gazebo::StopWorkers(pids);
+      return 1;
+    }
+
+    double force_error, field_error;
+    gazebo::GetError(*exchange, magnets, samples, force_error, field_error);
+    gazebo::StopWorkers(pids);
+
+    double mean = sum/steps;
+    if (c == 0) {
+      base_time = mean;
+      base_workers = workers;
+    }
+    double speedup = base_time/mean;
+    std::printf("%8zu %10.3f %10.3f %8.2f %10.2f %12.3g %12.3g\n", workers, 1e3*mean,
+        1e3*min, speedup, speedup*base_workers/workers, force_error, field_error);
+    std::fflush(stdout);
+  }
+  return 0;
+}
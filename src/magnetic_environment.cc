@@ -0,0 +1,774 @@
+/*
+ * Copyright (c) 2016, Vanderbilt University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: Addisu Z. Taddese
+ */
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <ros/subscribe_options.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "storm_gazebo_ros_magnet/equilibrium.h"
+#include "storm_gazebo_ros_magnet/magnetic_environment.h"
+
+namespace gazebo {
+
+namespace {
+
+/// \brief Parse 9 whitespace separated values in row-major order
+bool ParseMatrix3(const std::string& str, ignition::math::Matrix3d& mat) {
+  std::istringstream stream(str);
+  for (int i = 0; i < 9; ++i) {
+    if (!(stream >> mat(i / 3, i % 3)))
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+MagneticEnvironment::MagneticEnvironment(): WorldPlugin() {
+  this->rosnode = NULL;
+  this->governor_rate = 1.0;
+  this->energy_rate = 1.0;
+  this->has_checkpoint = false;
+  this->save_requested = false;
+  this->restore_requested = false;
+}
+
+MagneticEnvironment::~MagneticEnvironment() {
+  this->update_connection.reset();
+  if (this->rosnode) {
+    this->queue.clear();
+    this->queue.disable();
+    this->rosnode->shutdown();
+    this->callback_queue_thread.join();
+    delete this->rosnode;
+  }
+
+  if (!this->container)
+    return;
+  DipoleMagnetContainer& dp = *this->container;
+  dp.planes.clear();
+  dp.periodic.reset();
+  dp.all_pairs.reset();
+  dp.governor.reset();
+  dp.energy.reset();
+  dp.sleep.reset();
+  dp.exchange.reset();
+  dp.cluster_field = 0;
+  dp.task_pool.reset();
+  dp.tiled_cluster = 0;
+  for (size_t i = 0; i < this->field_sources.size(); ++i) {
+    dp.field_sources.erase(std::remove(dp.field_sources.begin(), dp.field_sources.end(),
+          this->field_sources[i]), dp.field_sources.end());
+  }
+}
+
+void MagneticEnvironment::Load(physics::WorldPtr _world, sdf::ElementPtr _sdf) {
+  this->world = _world;
+  gzdbg << "Loading MagneticEnvironment plugin" << std::endl;
+
+  this->container = DipoleMagnetContainer::Get(this->world);
+  DipoleMagnetContainer& dp = *this->container;
+
+  this->robot_namespace = "";
+  if (_sdf->HasElement("robotNamespace"))
+    this->robot_namespace = _sdf->GetElement("robotNamespace")->Get<std::string>() + "/";
+
+  if (_sdf->HasElement("logLevel")) {
+    std::string level = _sdf->Get<std::string>("logLevel");
+    if (level == "none")
+      dp.log_level = DipoleMagnetContainer::LOG_NONE;
+    else if (level == "summary")
+      dp.log_level = DipoleMagnetContainer::LOG_SUMMARY;
+    else if (level == "verbose")
+      dp.log_level = DipoleMagnetContainer::LOG_VERBOSE;
+    else
+      gzerr << "MagneticEnvironment <logLevel> must be none, summary or verbose"
+          << std::endl;
+  }
+
+  if (_sdf->HasElement("ferromagnetic_plane")) {
+    sdf::ElementPtr elem = _sdf->GetElement("ferromagnetic_plane");
+    while (elem) {
+      DipoleMagnetContainer::FerromagneticPlane plane;
+      if (this->LoadPlane(elem, plane))
+        dp.planes.push_back(plane);
+      elem = elem->GetNextElement("ferromagnetic_plane");
+    }
+  }
+
+  if (_sdf->HasElement("induction")) {
+    sdf::ElementPtr induction = _sdf->GetElement("induction");
+    if (induction->HasElement("tolerance"))
+      dp.induction_tolerance = induction->Get<double>("tolerance");
+    if (induction->HasElement("max_iterations"))
+      dp.induction_max_iterations = induction->Get<int>("max_iterations");
+  }
+
+  if (_sdf->HasElement("periodic")) {
+    sdf::ElementPtr periodic = _sdf->GetElement("periodic");
+    double tolerance = 1e-4;
+    double cutoff = 0;
+    if (periodic->HasElement("tolerance"))
+      tolerance = periodic->Get<double>("tolerance");
+    if (periodic->HasElement("cutoff"))
+      cutoff = periodic->Get<double>("cutoff");
+    if (!periodic->HasElement("box_size") ||
+        periodic->Get<ignition::math::Vector3d>("box_size").Min() <= 0 ||
+        tolerance <= 0 || tolerance >= 1) {
+      gzerr << "<periodic> needs a positive <box_size> and a <tolerance> in (0, 1), "
+          "ignoring it" << std::endl;
+    } else {
+      dp.periodic = std::make_shared<EwaldSolver>();
+      dp.periodic->Configure(periodic->Get<ignition::math::Vector3d>("box_size"),
+          tolerance, cutoff);
+      if (cutoff > 0) {
+        gzmsg << "Periodic magnets with Ewald alpha " << dp.periodic->alpha
+            << ", cutoff " << dp.periodic->cutoff << " and a "
+            << dp.periodic->mesh[0] << "x" << dp.periodic->mesh[1] << "x"
+            << dp.periodic->mesh[2] << " mesh" << std::endl;
+      } else {
+        gzmsg << "Periodic magnets with Ewald summation, the cutoff and mesh follow "
+            "the number of magnets" << std::endl;
+      }
+    }
+  }
+
+  if (_sdf->HasElement("all_pairs")) {
+    sdf::ElementPtr all_pairs = _sdf->GetElement("all_pairs");
+    int tile_size = 64;
+    if (all_pairs->HasElement("tile_size"))
+      tile_size = all_pairs->Get<int>("tile_size");
+    if (tile_size <= 0) {
+      gzerr << "<all_pairs> needs a positive <tile_size>, ignoring it" << std::endl;
+    } else {
+      dp.all_pairs = std::make_shared<TiledAllPairs>(tile_size);
+      gzmsg << "Exact all-pairs magnet interactions in tiles of " << tile_size
+          << " magnets" << std::endl;
+    }
+  }
+
+  if (_sdf->HasElement("clusters")) {
+    sdf::ElementPtr clusters = _sdf->GetElement("clusters");
+    if (!clusters->HasElement("field_threshold") ||
+        clusters->Get<double>("field_threshold") <= 0) {
+      gzerr << "<clusters> needs a positive <field_threshold> in T, ignoring it"
+          << std::endl;
+    } else {
+      dp.cluster_field = clusters->Get<double>("field_threshold");
+      if (clusters->HasElement("small_cluster"))
+        dp.small_cluster = clusters->Get<int>("small_cluster");
+      if (clusters->HasElement("tiled_cluster"))
+        dp.tiled_cluster = std::max(0, clusters->Get<int>("tiled_cluster"));
+      int threads = 0;
+      if (clusters->HasElement("threads"))
+        threads = clusters->Get<int>("threads");
+      if (threads > 0)
+        dp.task_pool = std::make_shared<TaskPool>(threads);
+      gzmsg << "Magnet clusters split below " << dp.cluster_field << " T, solved on "
+          << std::max(threads, 1) << " threads" << std::endl;
+    }
+  }
+
+  if (_sdf->HasElement("background_field")) {
+    sdf::ElementPtr elem = _sdf->GetElement("background_field");
+    while (elem) {
+      std::shared_ptr<BackgroundField> field = this->LoadBackgroundField(elem);
+      if (field) {
+        this->field_sources.push_back(field);
+        dp.field_sources.push_back(field);
+      }
+      elem = elem->GetNextElement("background_field");
+    }
+  }
+
+  if (_sdf->HasElement("governor"))
+    this->LoadGovernor(_sdf->GetElement("governor"));
+
+  if (_sdf->HasElement("energy"))
+    this->LoadEnergy(_sdf->GetElement("energy"));
+
+  if (_sdf->HasElement("solver_process")) {
+    sdf::ElementPtr remote = _sdf->GetElement("solver_process");
+    // Shared memory names are a single path component
+    std::string name = "/storm_magnets_" + this->world->Name();
+    std::replace(name.begin() + 1, name.end(), '/', '_');
+    if (remote->HasElement("name"))
+      name = remote->Get<std::string>("name");
+    size_t capacity = 4096;
+    if (remote->HasElement("capacity"))
+      capacity = remote->Get<unsigned int>("capacity");
+    size_t workers = 1;
+    if (remote->HasElement("workers"))
+      workers = remote->Get<unsigned int>("workers");
+    size_t leaf_size = 64;
+    if (remote->HasElement("leaf_size"))
+      leaf_size = remote->Get<unsigned int>("leaf_size");
+    double far_field_ratio = 0;
+    if (remote->HasElement("far_field_ratio"))
+      far_field_ratio = remote->Get<double>("far_field_ratio");
+    std::shared_ptr<SharedExchange> exchange(SharedExchange::Create(name, capacity, workers,
+        leaf_size, far_field_ratio));
+    if (!exchange) {
+      gzerr << "Cannot create the magnet solver exchange " << name << ": "
+          << std::strerror(errno) << std::endl;
+    } else {
+      if (remote->HasElement("timeout"))
+        exchange->timeout = remote->Get<double>("timeout");
+      if (remote->HasElement("spin"))
+        exchange->spin = remote->Get<int>("spin");
+      dp.exchange = exchange;
+      gzmsg << "Magnet interactions are solved by " << workers
+          << " magnet_solver processes attached to " << name << ", for up to "
+          << capacity << " magnets" << std::endl;
+    }
+  }
+
+  if (_sdf->HasElement("sleep")) {
+    sdf::ElementPtr sleep_sdf = _sdf->GetElement("sleep");
+    std::shared_ptr<IslandSleep> sleep = std::make_shared<IslandSleep>();
+    if (sleep_sdf->HasElement("linear_velocity"))
+      sleep->linear_velocity = sleep_sdf->Get<double>("linear_velocity");
+    if (sleep_sdf->HasElement("angular_velocity"))
+      sleep->angular_velocity = sleep_sdf->Get<double>("angular_velocity");
+    if (sleep_sdf->HasElement("tolerance"))
+      sleep->tolerance = sleep_sdf->Get<double>("tolerance");
+    if (sleep_sdf->HasElement("field_tolerance"))
+      sleep->field_tolerance = sleep_sdf->Get<double>("field_tolerance");
+    if (sleep_sdf->HasElement("wake_distance"))
+      sleep->wake_distance = sleep_sdf->Get<double>("wake_distance");
+    if (sleep_sdf->HasElement("wake_angle"))
+      sleep->wake_angle = sleep_sdf->Get<double>("wake_angle");
+    if (sleep_sdf->HasElement("sleep_time"))
+      sleep->sleep_time = sleep_sdf->Get<double>("sleep_time");
+    dp.sleep = sleep;
+    if (dp.periodic || dp.all_pairs || dp.exchange)
+      gzwarn << "Magnets do not sleep while <periodic>, <all_pairs> or <solver_process> "
+          "solves them" << std::endl;
+    else
+      gzmsg << "Magnet islands sleep after " << sleep->sleep_time << " s at rest" << std::endl;
+  }
+
+  // Models are loaded after world plugins, so the equilibrium is solved at
+  // the first step
+  if (_sdf->HasElement("equilibrium"))
+    this->equilibrium_sdf = _sdf->GetElement("equilibrium");
+
+  for (size_t i = 0; i < this->field_sources.size(); ++i)
+    this->initial_states.push_back(this->field_sources[i]->SaveState());
+
+  if (_sdf->HasElement("checkpointServices") &&
+      _sdf->Get<bool>("checkpointServices")) {
+    if (this->InitRos()) {
+      this->services.push_back(this->rosnode->advertiseService(
+            "magnetic_environment/save_checkpoint",
+            &MagneticEnvironment::OnSaveCheckpoint, this));
+      this->services.push_back(this->rosnode->advertiseService(
+            "magnetic_environment/restore_checkpoint",
+            &MagneticEnvironment::OnRestoreCheckpoint, this));
+    }
+  }
+
+  if (this->rosnode) {
+    // Custom Callback Queue
+    this->callback_queue_thread = boost::thread(
+        boost::bind(&MagneticEnvironment::QueueThread, this));
+  }
+
+  gzmsg << "Loaded magnetic environment with " << dp.planes.size()
+      << " ferromagnetic planes and " << this->field_sources.size()
+      << " background fields" << std::endl;
+
+  // World plugins are connected before any model plugin, so this runs first
+  // in every step
+  this->update_connection = event::Events::ConnectWorldUpdateBegin(
+      boost::bind(&MagneticEnvironment::OnUpdate, this, _1));
+}
+
+void MagneticEnvironment::Reset() {
+  for (size_t i = 0; i < this->field_sources.size(); ++i)
+    this->field_sources[i]->RestoreState(this->initial_states[i]);
+  if (this->container)
+    this->container->Reset();
+}
+
+void MagneticEnvironment::OnUpdate(const common::UpdateInfo & /*_info*/) {
+  if (this->equilibrium_sdf) {
+    this->SolveEquilibrium();
+    this->equilibrium_sdf.reset();
+  }
+
+  if (this->governor_pub) {
+    common::Time cur_time = this->world->SimTime();
+    if (cur_time < this->governor_time ||
+        (cur_time - this->governor_time).Double() >= 1.0/this->governor_rate) {
+      this->governor_time = cur_time;
+      this->PublishGovernor();
+    }
+  }
+
+  if (this->container->energy)
+    this->UpdateEnergy();
+
+  boost::mutex::scoped_lock lock(this->checkpoint_lock);
+  DipoleMagnetContainer& dp = *this->container;
+  if (this->save_requested) {
+    dp.Save(this->checkpoint);
+    this->has_checkpoint = true;
+    this->save_requested = false;
+  }
+  if (this->restore_requested) {
+    if (dp.Restore(this->checkpoint)) {
+      // The balance and the step timing of the abandoned run do not carry
+      // over, and the reset governor solves this step
+      if (dp.energy)
+        dp.energy->Reset();
+      if (dp.governor)
+        dp.governor->Reset();
+    } else {
+      gzerr << "Magnets were added or removed since the checkpoint was saved, "
+          "not restoring it" << std::endl;
+    }
+    this->restore_requested = false;
+  }
+}
+
+void MagneticEnvironment::LoadGovernor(sdf::ElementPtr _sdf) {
+  if (!_sdf->HasElement("budget")) {
+    gzerr << "MagneticEnvironment <governor> needs a <budget> in microseconds"
+        << std::endl;
+    return;
+  }
+  double min_far_field_ratio = 2;
+  double cutoff = 0;
+  int max_update_interval = 4;
+  int max_publish_interval = 4;
+  if (_sdf->HasElement("min_far_field_ratio"))
+    min_far_field_ratio = _sdf->Get<double>("min_far_field_ratio");
+  if (_sdf->HasElement("cutoff"))
+    cutoff = _sdf->Get<double>("cutoff");
+  if (_sdf->HasElement("max_update_interval"))
+    max_update_interval = _sdf->Get<int>("max_update_interval");
+  if (_sdf->HasElement("max_publish_interval"))
+    max_publish_interval = _sdf->Get<int>("max_publish_interval");
+
+  std::shared_ptr<QualityGovernor> governor = std::make_shared<QualityGovernor>();
+  governor->Configure(_sdf->Get<double>("budget"), min_far_field_ratio, cutoff,
+      max_update_interval, max_publish_interval);
+  this->container->governor = governor;
+  gzmsg << "Magnet quality governor with a budget of " << governor->budget
+      << " us and " << governor->GetLevelCount() << " levels" << std::endl;
+
+  if (!_sdf->HasElement("topicNs") || !this->InitRos())
+    return;
+  if (_sdf->HasElement("updateRate"))
+    this->governor_rate = _sdf->Get<double>("updateRate");
+
+  std_msgs::MultiArrayDimension dim;
+  dim.label = "step_time_us,budget_us,level,far_field_ratio,cutoff,"
+      "update_interval,publish_interval,far_field_error,cutoff_field,hold_time";
+  dim.size = 10;
+  dim.stride = 10;
+  this->governor_msg.layout.dim.push_back(dim);
+  this->governor_msg.data.resize(10);
+  this->governor_pub = this->rosnode->advertise<std_msgs::Float64MultiArray>(
+      _sdf->Get<std::string>("topicNs") + "/governor", 1);
+}
+
+void MagneticEnvironment::PublishGovernor() {
+  const QualityGovernor& governor = *this->container->governor;
+  const QualityGovernor::Settings& settings = governor.GetSettings();
+  double step_size = this->world->Physics()->GetMaxStepSize();
+  std::vector<double>& data = this->governor_msg.data;
+  data[0] = governor.GetAverageTime();
+  data[1] = governor.budget;
+  data[2] = governor.GetLevel();
+  data[3] = settings.far_field_ratio;
+  data[4] = settings.cutoff;
+  data[5] = settings.update_interval;
+  data[6] = settings.publish_interval;
+  data[7] = governor.GetFarFieldError(settings.far_field_ratio);
+  data[8] = governor.GetCutoffField();
+  // Age of the oldest held wrench
+  data[9] = (settings.update_interval - 1)*step_size;
+  this->governor_pub.publish(this->governor_msg);
+}
+
+void MagneticEnvironment::LoadEnergy(sdf::ElementPtr _sdf) {
+  std::shared_ptr<EnergyMonitor> energy = std::make_shared<EnergyMonitor>();
+  if (_sdf->HasElement("drift_tolerance"))
+    energy->drift_tolerance = _sdf->Get<double>("drift_tolerance");
+  this->container->energy = energy;
+
+  if (!_sdf->HasElement("topicNs") || !this->InitRos())
+    return;
+  if (_sdf->HasElement("updateRate"))
+    this->energy_rate = _sdf->Get<double>("updateRate");
+
+  std_msgs::MultiArrayDimension dim;
+  dim.label = "energy,power,work,drift,relative_drift";
+  dim.size = 5;
+  dim.stride = 5;
+  this->energy_msg.layout.dim.push_back(dim);
+  this->energy_msg.data.resize(5);
+  this->energy_pub = this->rosnode->advertise<std_msgs::Float64MultiArray>(
+      _sdf->Get<std::string>("topicNs") + "/energy", 1);
+}
+
+void MagneticEnvironment::UpdateEnergy() {
+  // This runs before any magnet, so the magnets have added their shares
+  // of the previous step, if there was one
+  EnergyMonitor& energy = *this->container->energy;
+  common::Time cur_time = this->world->SimTime();
+  if (cur_time > this->energy_step_time &&
+      energy.EndStep(this->energy_step_time.Double())) {
+    gzwarn << "Magnetic energy drifted by " << 100*energy.GetRelativeDrift()
+        << "% of its range at t = " << this->energy_step_time.Double()
+        << " s, the time step may be too large for the magnets" << std::endl;
+  }
+  this->energy_step_time = cur_time;
+
+  if (!this->energy_pub)
+    return;
+  if (cur_time >= this->energy_time &&
+      (cur_time - this->energy_time).Double() < 1.0/this->energy_rate)
+    return;
+  this->energy_time = cur_time;
+  std::vector<double>& data = this->energy_msg.data;
+  data[0] = energy.energy;
+  data[1] = energy.power;
+  data[2] = energy.work;
+  data[3] = energy.drift;
+  data[4] = energy.GetRelativeDrift();
+  this->energy_pub.publish(this->energy_msg);
+}
+
+void MagneticEnvironment::SolveEquilibrium() {
+  sdf::ElementPtr _sdf = this->equilibrium_sdf;
+  DipoleMagnetContainer& dp = *this->container;
+  MagnetEquilibrium eq;
+
+  if (_sdf->HasElement("max_iterations"))
+    eq.minimizer.max_iterations = _sdf->Get<int>("max_iterations");
+  eq.minimizer.gradient_tolerance = 1e-4;
+  if (_sdf->HasElement("tolerance"))
+    eq.minimizer.gradient_tolerance = _sdf->Get<double>("tolerance");
+  eq.minimizer.max_step = 0.005;
+  if (_sdf->HasElement("max_step"))
+    eq.minimizer.max_step = _sdf->Get<double>("max_step");
+  if (_sdf->HasElement("contact_stiffness"))
+    eq.contact_stiffness = _sdf->Get<double>("contact_stiffness");
+  double contact_radius = -1;
+  if (_sdf->HasElement("contact_radius"))
+    contact_radius = _sdf->Get<double>("contact_radius");
+  bool gravity = _sdf->HasElement("gravity") && _sdf->Get<bool>("gravity");
+  bool rotate = !_sdf->HasElement("rotate") || _sdf->Get<bool>("rotate");
+  ignition::math::Vector3d translation_mask(1, 1, 1);
+  if (_sdf->HasElement("translation_mask"))
+    translation_mask = _sdf->Get<ignition::math::Vector3d>("translation_mask");
+
+  std::set<std::string> fixed_models;
+  if (_sdf->HasElement("fixed_model")) {
+    sdf::ElementPtr elem = _sdf->GetElement("fixed_model");
+    while (elem) {
+      fixed_models.insert(elem->Get<std::string>());
+      elem = elem->GetNextElement("fixed_model");
+    }
+  }
+
+  if (_sdf->HasElement("contact_plane")) {
+    sdf::ElementPtr elem = _sdf->GetElement("contact_plane");
+    while (elem) {
+      MagnetEquilibrium::ContactPlane plane;
+      plane.point = elem->Get<ignition::math::Vector3d>("point");
+      plane.normal = elem->Get<ignition::math::Vector3d>("normal").Normalize();
+      eq.contact_planes.push_back(plane);
+      elem = elem->GetNextElement("contact_plane");
+    }
+  }
+
+  // Runs before the first step, so take the magnets registered so far
+  dp.SyncRegistrations();
+  std::map<std::uint32_t, DipoleMagnetContainer::MagnetPtrV> owned;
+  for (size_t i = 0; i < dp.magnets.size(); ++i)
+    owned[dp.magnets[i]->owner_id].push_back(dp.magnets[i]);
+
+  // A model is free when it is a single body that is not held by a joint
+  std::vector<physics::ModelPtr> models;
+  std::vector<ignition::math::Pose3d> cog_poses;
+  physics::Model_V all_models = this->world->Models();
+  for (size_t i = 0; i < all_models.size(); ++i) {
+    physics::ModelPtr model = all_models[i];
+    std::map<std::uint32_t, DipoleMagnetContainer::MagnetPtrV>::const_iterator it =
+        owned.find(model->GetId());
+    if (it == owned.end())
+      continue;
+
+    MagnetEquilibrium::Body body;
+    physics::Link_V links = model->GetLinks();
+    // Joint coordinates are not optimized, so articulated models stay put
+    std::string held;
+    if (model->IsStatic())
+      held = "it is static";
+    else if (model->GetJointCount() > 0)
+      held = "it has joints";
+    else if (links.size() != 1)
+      held = "it has more than one link";
+    body.fixed = !held.empty() || fixed_models.count(model->GetName()) > 0;
+    if (!held.empty()) {
+      gzmsg << "Magnetic equilibrium keeps " << model->GetName() << " in place, "
+          << held << std::endl;
+    }
+    ignition::math::Pose3d cog;
+    if (!body.fixed) {
+      physics::LinkPtr link = links[0];
+      cog = link->WorldCoGPose();
+      body.rotate = rotate;
+      body.translation_mask = translation_mask;
+      if (gravity && link->GetGravityMode())
+        body.weight = this->world->Gravity()*link->GetInertial()->Mass();
+      if (contact_radius >= 0) {
+        body.contact_radius = contact_radius;
+      } else {
+        ignition::math::Vector3d size = link->CollisionBoundingBox().Size();
+        body.contact_radius = 0.5*std::min(size.X(), std::min(size.Y(), size.Z()));
+      }
+    }
+    body.position = cog.Pos();
+    body.rotation = cog.Rot();
+
+    for (size_t j = 0; j < it->second.size(); ++j) {
+      const DipoleMagnetContainer::Magnet& mag = *it->second[j];
+      body.magnet_positions.push_back(cog.Rot().RotateVectorReverse(mag.pose.Pos() - cog.Pos()));
+      body.magnet_moments.push_back(cog.Rot().RotateVectorReverse(
+            mag.pose.Rot().RotateVector(mag.moment)));
+    }
+    eq.bodies.push_back(body);
+    models.push_back(model);
+    cog_poses.push_back(cog);
+  }
+
+  common::Time time = this->world->SimTime();
+  dp.UpdateFieldSources(time);
+  eq.planes = dp.planes;
+  eq.field_sources = dp.field_sources;
+
+  double initial_energy = eq.Energy();
+  double energy = eq.Solve();
+
+  size_t n_free = 0;
+  for (size_t i = 0; i < eq.bodies.size(); ++i) {
+    const MagnetEquilibrium::Body& body = eq.bodies[i];
+    if (body.fixed)
+      continue;
+    ++n_free;
+    // Keep the pose of the model relative to its link
+    const ignition::math::Pose3d& cog = cog_poses[i];
+    ignition::math::Pose3d model_pose = models[i]->WorldPose();
+    ignition::math::Vector3d rel_pos = cog.Rot().RotateVectorReverse(model_pose.Pos() - cog.Pos());
+    ignition::math::Quaterniond rel_rot = cog.Rot().Inverse()*model_pose.Rot();
+    models[i]->SetWorldPose(ignition::math::Pose3d(
+          body.position + body.rotation.RotateVector(rel_pos), body.rotation*rel_rot));
+  }
+  dp.Reset();
+
+  gzmsg << "Magnetic equilibrium of " << n_free << " free models: energy "
+      << initial_energy << " J -> " << energy << " J in "
+      << eq.minimizer.iterations << " iterations" << std::endl;
+  if (!eq.minimizer.converged)
+    gzwarn << "Magnetic equilibrium did not reach the tolerance of "
+        << eq.minimizer.gradient_tolerance << std::endl;
+}
+
+bool MagneticEnvironment::InitRos() {
+  if (this->rosnode)
+    return true;
+
+  if (!ros::isInitialized())
+  {
+    gzerr << "A ROS node for Gazebo has not been initialized, MagneticEnvironment "
+      "topics and services are disabled. Load the Gazebo system plugin "
+      "'libgazebo_ros_api_plugin.so' in the gazebo_ros package." << std::endl;
+    return false;
+  }
+
+  this->rosnode = new ros::NodeHandle(this->robot_namespace);
+  this->rosnode->setCallbackQueue(&this->queue);
+  return true;
+}
+
+bool MagneticEnvironment::OnSaveCheckpoint(std_srvs::Trigger::Request& /*req*/,
+    std_srvs::Trigger::Response& res) {
+  boost::mutex::scoped_lock lock(this->checkpoint_lock);
+  this->save_requested = true;
+  res.success = true;
+  res.message = "checkpoint will be saved at the next step";
+  return true;
+}
+
+bool MagneticEnvironment::OnRestoreCheckpoint(std_srvs::Trigger::Request& /*req*/,
+    std_srvs::Trigger::Response& res) {
+  boost::mutex::scoped_lock lock(this->checkpoint_lock);
+  if (!this->has_checkpoint && !this->save_requested) {
+    res.success = false;
+    res.message = "no checkpoint has been saved";
+    return true;
+  }
+  this->restore_requested = true;
+  res.success = true;
+  res.message = "checkpoint will be restored at the next step";
+  return true;
+}
+
+void MagneticEnvironment::QueueThread() {
+  static const double timeout = 0.01;
+
+  while (this->rosnode->ok())
+  {
+    this->queue.callAvailable(ros::WallDuration(timeout));
+  }
+}
+
+bool MagneticEnvironment::LoadPlane(sdf::ElementPtr _sdf,
+    DipoleMagnetContainer::FerromagneticPlane& plane) {
+  plane.point = ignition::math::Vector3d::Zero;
+  if (_sdf->HasElement("point"))
+    plane.point = _sdf->Get<ignition::math::Vector3d>("point");
+
+  plane.normal = ignition::math::Vector3d(0, 0, 1);
+  if (_sdf->HasElement("normal"))
+    plane.normal = _sdf->Get<ignition::math::Vector3d>("normal");
+
+  if (plane.normal.Length() < std::numeric_limits<double>::epsilon()) {
+    gzerr << "ferromagnetic_plane has a zero <normal>, ignoring it" << std::endl;
+    return false;
+  }
+  plane.normal.Normalize();
+
+  // Defaults to an ideal soft iron
+  plane.image_factor = 1.0;
+  if (_sdf->HasElement("relative_permeability")) {
+    double mu_r = _sdf->Get<double>("relative_permeability");
+    if (mu_r < 1.0) {
+      gzerr << "ferromagnetic_plane <relative_permeability> must be >= 1, ignoring it"
+          << std::endl;
+      return false;
+    }
+    plane.image_factor = (mu_r - 1.0)/(mu_r + 1.0);
+  }
+  return true;
+}
+
+std::shared_ptr<BackgroundField> MagneticEnvironment::LoadBackgroundField(
+    sdf::ElementPtr _sdf) {
+  std::shared_ptr<BackgroundField> field = std::make_shared<BackgroundField>();
+
+  if (_sdf->HasElement("field"))
+    field->SetField(_sdf->Get<ignition::math::Vector3d>("field"));
+
+  if (_sdf->HasElement("origin"))
+    field->SetOrigin(_sdf->Get<ignition::math::Vector3d>("origin"));
+
+  if (_sdf->HasElement("gradient")) {
+    ignition::math::Matrix3d gradient;
+    if (!ParseMatrix3(_sdf->Get<std::string>("gradient"), gradient)) {
+      gzerr << "background_field <gradient> needs 9 values, ignoring it" << std::endl;
+      return std::shared_ptr<BackgroundField>();
+    }
+    if (!BackgroundField::IsSourceFree(gradient)) {
+      gzerr << "background_field <gradient> must be symmetric and traceless, as that of "
+          "a field without sources, ignoring it" << std::endl;
+      return std::shared_ptr<BackgroundField>();
+    }
+    field->SetGradient(gradient);
+  }
+
+  if (_sdf->HasElement("frequency")) {
+    ignition::math::Vector3d field_amplitude;
+    ignition::math::Matrix3d gradient_amplitude = ignition::math::Matrix3d::Zero;
+    double phase = 0;
+    if (_sdf->HasElement("field_amplitude"))
+      field_amplitude = _sdf->Get<ignition::math::Vector3d>("field_amplitude");
+    if (_sdf->HasElement("gradient_amplitude") &&
+        !ParseMatrix3(_sdf->Get<std::string>("gradient_amplitude"), gradient_amplitude)) {
+      gzerr << "background_field <gradient_amplitude> needs 9 values, ignoring it" << std::endl;
+      return std::shared_ptr<BackgroundField>();
+    }
+    if (!BackgroundField::IsSourceFree(gradient_amplitude)) {
+      gzerr << "background_field <gradient_amplitude> must be symmetric and traceless, as "
+          "that of a field without sources, ignoring it" << std::endl;
+      return std::shared_ptr<BackgroundField>();
+    }
+    if (_sdf->HasElement("phase"))
+      phase = _sdf->Get<double>("phase");
+    field->SetOscillation(field_amplitude, gradient_amplitude,
+        _sdf->Get<double>("frequency"), phase);
+  }
+
+  if (_sdf->HasElement("topicNs")) {
+    if (!this->InitRos())
+      return field;
+
+    std::string topic_ns = _sdf->Get<std::string>("topicNs");
+    this->subscribers.push_back(this->rosnode->subscribe<geometry_msgs::Vector3>(
+          topic_ns + "/field", 1,
+          boost::bind(&MagneticEnvironment::OnField, this, _1, field)));
+    this->subscribers.push_back(this->rosnode->subscribe<std_msgs::Float64MultiArray>(
+          topic_ns + "/gradient", 1,
+          boost::bind(&MagneticEnvironment::OnGradient, this, _1, field)));
+  }
+
+  return field;
+}
+
+void MagneticEnvironment::OnField(const geometry_msgs::Vector3::ConstPtr& msg,
+    std::shared_ptr<BackgroundField> field) {
+  field->SetField(ignition::math::Vector3d(msg->x, msg->y, msg->z));
+}
+
+void MagneticEnvironment::OnGradient(const std_msgs::Float64MultiArray::ConstPtr& msg,
+    std::shared_ptr<BackgroundField> field) {
+  if (msg->data.size() != 9) {
+    gzerr << "Background field gradient needs 9 values, got " << msg->data.size() << std::endl;
+    return;
+  }
+  ignition::math::Matrix3d gradient;
+  for (int i = 0; i < 9; ++i)
+    gradient(i / 3, i % 3) = msg->data[i];
+  if (!BackgroundField::IsSourceFree(gradient)) {
+    gzerr << "Background field gradient must be symmetric and traceless, ignoring it"
+        << std::endl;
+    return;
+  }
+  field->SetGradient(gradient);
+}
+
+// Register this plugin with the simulator
+GZ_REGISTER_WORLD_PLUGIN(MagneticEnvironment)
+
+}